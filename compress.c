@@ -0,0 +1,115 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <lz4.h>
+
+#include <debug.h>
+#include <controller.h>
+#include <compress.h>
+
+/* Largest number of messages sent as is after a failed compression */
+#define COMPRESS_BACKOFF_MAX	64
+
+/*
+ * Compress the message in out.
+ * Return the size of the compressed message, or 0 if the message must be
+ * sent as is. When the payloads of a connection don't compress, the next
+ * messages are sent as is without trying, for an increasing number of
+ * messages.
+ */
+int compress_message(struct connection *conn, const void *data, size_t len,
+		     void *out, size_t out_len)
+{
+	int ret;
+	size_t max_len;
+	struct compress_hdr *hdr = out;
+
+	if (len < COMPRESS_MIN_SIZE || len > GB_NETLINK_MTU)
+		return 0;
+
+	/* The state is shared by the threads writing on the connection */
+	pthread_mutex_lock(&conn->compress_lock);
+	if (conn->compress != COMPRESS_ON) {
+		ret = 0;
+		goto out;
+	}
+
+	if (conn->compress_skip) {
+		conn->compress_skip--;
+		ret = 0;
+		goto out;
+	}
+
+	/* Give up as soon as the output would not be worth it */
+	max_len = len - len / 8;
+	if (max_len > out_len)
+		max_len = out_len;
+
+	ret = LZ4_compress_default(data, (char *)(hdr + 1), len,
+				   max_len - sizeof(*hdr));
+	if (ret <= 0) {
+		conn->compress_backoff = conn->compress_backoff ?
+					 conn->compress_backoff * 2 : 1;
+		if (conn->compress_backoff > COMPRESS_BACKOFF_MAX)
+			conn->compress_backoff = COMPRESS_BACKOFF_MAX;
+		conn->compress_skip = conn->compress_backoff;
+		ret = 0;
+		goto out;
+	}
+	conn->compress_backoff = 0;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->size = htole16(sizeof(*hdr) + ret);
+	hdr->msg_size = htole16(len);
+	hdr->pad[1] = COMPRESS_FLAG_LZ4;
+	ret += sizeof(*hdr);
+
+out:
+	pthread_mutex_unlock(&conn->compress_lock);
+
+	return ret;
+}
+
+/* Return the size of the original message, decompressed in out */
+int decompress_message(const void *data, size_t len,
+		       void *out, size_t out_len)
+{
+	int ret;
+	size_t msg_size;
+	const struct compress_hdr *hdr = data;
+
+	if (len < sizeof(*hdr) || le16toh(hdr->size) != len)
+		return -EPROTO;
+
+	msg_size = le16toh(hdr->msg_size);
+	if (msg_size > out_len)
+		return -EMSGSIZE;
+
+	ret = LZ4_decompress_safe((const char *)(hdr + 1), out,
+				  len - sizeof(*hdr), msg_size);
+	if (ret != msg_size) {
+		pr_err("Failed to decompress a message\n");
+		return -EPROTO;
+	}
+
+	return ret;
+}
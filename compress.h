@@ -0,0 +1,89 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <errno.h>
+#include <stddef.h>
+
+#include <config.h>
+#include <gbridge.h>
+
+/*
+ * On the connections where the module supports it, the messages sent to
+ * the module may be compressed with LZ4, and the module may do the same.
+ * A compressed message starts with a compress_hdr, laid out like a
+ * gb_operation_msg_hdr (see segment.h), followed by the LZ4 block of the
+ * whole original message. It is marked in pad[1].
+ * Messages smaller than COMPRESS_MIN_SIZE, or that don't shrink by at
+ * least 1/8, are sent as is.
+ */
+#define COMPRESS_FLAG_LZ4	0x20
+#define COMPRESS_MIN_SIZE	128
+
+/* Compression mode of a connection */
+enum compress_mode {
+	/* pad[1] is left to the module, nothing is compressed */
+	COMPRESS_OFF,
+	/*
+	 * The compressed messages of the module are accepted. The module
+	 * enables compression on the connection by sending one.
+	 */
+	COMPRESS_OFFERED,
+	/* The module supports it, e.g. it has advertised it */
+	COMPRESS_ON,
+};
+
+struct compress_hdr {
+	__le16 size;		/* Size of the compressed message */
+	__le16 msg_size;	/* Size of the original message */
+	__u8 reserved[2];
+	__u8 pad[2];		/* cport and flags */
+} __packed;
+
+struct connection;
+
+static inline int compress_is_compressed(const void *data)
+{
+	const struct compress_hdr *hdr = data;
+
+	return hdr->pad[1] & COMPRESS_FLAG_LZ4;
+}
+
+#ifdef HAVE_LIBLZ4
+int compress_message(struct connection *conn, const void *data, size_t len,
+		     void *out, size_t out_len);
+int decompress_message(const void *data, size_t len,
+		       void *out, size_t out_len);
+#else
+static inline int compress_message(struct connection *conn,
+				   const void *data, size_t len,
+				   void *out, size_t out_len)
+{
+	return 0;
+}
+
+static inline int decompress_message(const void *data, size_t len,
+				     void *out, size_t out_len)
+{
+	return -EPROTONOSUPPORT;
+}
+#endif
+
+#endif /* _COMPRESS_H_ */
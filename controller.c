@@ -18,11 +18,16 @@
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <debug.h>
 #include <gbridge.h>
+#include <compress.h>
 #include <controller.h>
+#include <hotplug.h>
+#include <manifest_cache.h>
+#include <segment.h>
 
 static
 TAILQ_HEAD(conn_head, connection)
@@ -32,6 +37,26 @@ TAILQ_HEAD(ctrl_head, controller)
 controllers = TAILQ_HEAD_INITIALIZER(controllers);
 static uint8_t g_intf_id = 0;
 static pthread_mutex_t intf_alloc_lock;
+/* The connections may be created and destroyed by several SVC workers */
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t connections_cond = PTHREAD_COND_INITIALIZER;
+/* The interfaces of every controller, as they may be unplugged anytime */
+static pthread_mutex_t interfaces_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* An interface whose module is gone, to be unplugged by the unplug thread */
+struct unplug {
+	struct controller *ctrl;
+	uint8_t intf_id;
+	TAILQ_ENTRY(unplug) node;
+};
+
+static TAILQ_HEAD(unplug_head, unplug) unplugs =
+	TAILQ_HEAD_INITIALIZER(unplugs);
+static pthread_mutex_t unplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unplug_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t unplug_thread;
+static int unplug_run;
+static int unplug_stopped;
 
 void cport_pack(struct gb_operation_msg_hdr *header, uint16_t cport_id)
 {
@@ -102,26 +127,29 @@ int hd_to_intf_cport_id(uint16_t hd_cport_id,
 		return 0;
 	}
 
+	pthread_mutex_lock(&connections_lock);
 	TAILQ_FOREACH(conn, &connections, node) {
-		if (conn->cport1_id == hd_cport_id) {
+		if (conn->intf1->id == AP_INTF_ID &&
+		    conn->cport1_id == hd_cport_id) {
 			*intf_id = conn->intf2->id;
 			*cport_id = conn->cport2_id;
-			return 0;
+			break;
 		}
 	}
+	pthread_mutex_unlock(&connections_lock);
 
-	return -EINVAL;
+	return conn ? 0 : -EINVAL;
 }
 
-static struct connection *_get_connection(struct interface *intf,
-					  uint16_t cport_id)
+/* Called locked */
+static struct connection *connection_find(uint8_t intf_id, uint16_t cport_id)
 {
 	struct connection *conn;
 
 	TAILQ_FOREACH(conn, &connections, node) {
-		if (conn->intf1 == intf && conn->cport1_id == cport_id)
+		if (conn->intf1->id == intf_id && conn->cport1_id == cport_id)
 			return conn;
-		if (conn->intf2 == intf && conn->cport2_id == cport_id)
+		if (conn->intf2->id == intf_id && conn->cport2_id == cport_id)
 			return conn;
 	}
 
@@ -130,15 +158,178 @@ static struct connection *_get_connection(struct interface *intf,
 
 struct connection *get_connection(uint8_t intf_id, uint16_t cport_id)
 {
+	struct connection *conn;
+
+	pthread_mutex_lock(&connections_lock);
+	conn = connection_find(intf_id, cport_id);
+	if (conn)
+		conn->users++;
+	pthread_mutex_unlock(&connections_lock);
+
+	return conn;
+}
+
+void put_connection(struct connection *conn)
+{
+	pthread_mutex_lock(&connections_lock);
+	if (!--conn->users)
+		pthread_cond_broadcast(&connections_cond);
+	pthread_mutex_unlock(&connections_lock);
+}
+
+/*
+ * Forward a message received from a module on ctrl.
+ * Fragments are reassembled, and the message is forwarded once complete
+ * and decompressed.
+ */
+static int connection_forward(struct controller *ctrl, struct connection *conn,
+			      uint8_t intf_id, void *data, size_t len)
+{
+	int ret;
+	struct segment *msg = NULL;
+	uint8_t buffer[GB_NETLINK_MTU];
+
+	if (ctrl->mtu && segment_is_fragment(data)) {
+		ret = segment_receive(&conn->rx_segment, data, len, &msg);
+		if (ret <= 0)
+			return ret;
+		data = msg->data;
+		len = ret;
+	}
+
+	/* Elsewhere, pad[1] belongs to the module */
+	if (conn->compress && compress_is_compressed(data)) {
+		ret = decompress_message(data, len, buffer, sizeof(buffer));
+		if (ret < 0)
+			goto out;
+		data = buffer;
+		len = ret;
+
+		/* The module has enabled compression on the connection */
+		pthread_mutex_lock(&conn->compress_lock);
+		conn->compress = COMPRESS_ON;
+		pthread_mutex_unlock(&conn->compress_lock);
+	}
+
+	if (manifest_cache_response(conn, data, len)) {
+		ret = 0;
+		goto out;
+	}
+
+	ret = controller_write(intf_id, conn->cport1_id, data, len);
+
+out:
+	if (msg)
+		segment_put(msg);
+
+	return ret;
+}
+
+static void *interface_unplug_thread(void *data)
+{
+	struct unplug *unplug;
 	struct interface *intf;
+	pthread_mutex_t *lock;
 
-	intf = get_interface(intf_id);
-	if (!intf) {
-		pr_err("Invalid interface id %d\n", intf_id);
-		return NULL;
+	pthread_mutex_lock(&unplug_lock);
+	while (unplug_run) {
+		unplug = TAILQ_FIRST(&unplugs);
+		if (!unplug) {
+			pthread_cond_wait(&unplug_cond, &unplug_lock);
+			continue;
+		}
+		TAILQ_REMOVE(&unplugs, unplug, node);
+		pthread_mutex_unlock(&unplug_lock);
+
+		lock = unplug->ctrl->interfaces_lock;
+		if (lock)
+			pthread_mutex_lock(lock);
+
+		/* The interface may have been destroyed meanwhile */
+		pthread_mutex_lock(&interfaces_lock);
+		TAILQ_FOREACH(intf, &unplug->ctrl->interfaces, node) {
+			if (intf->id == unplug->intf_id)
+				break;
+		}
+		pthread_mutex_unlock(&interfaces_lock);
+		if (intf)
+			interface_hot_unplug(intf);
+
+		if (lock)
+			pthread_mutex_unlock(lock);
+		free(unplug);
+
+		pthread_mutex_lock(&unplug_lock);
 	}
+	pthread_mutex_unlock(&unplug_lock);
 
-	return _get_connection(intf, cport_id);
+	return NULL;
+}
+
+/*
+ * Called by the thread of an interface whose module is gone. The thread
+ * can't join itself, so the interface is unplugged by the unplug thread.
+ */
+void interface_unplug_queue(struct interface *intf)
+{
+	int ret;
+	struct unplug *unplug;
+
+	unplug = malloc(sizeof(*unplug));
+	if (!unplug) {
+		pr_err("Failed to unplug interface %u\n", intf->id);
+		return;
+	}
+
+	unplug->ctrl = intf->ctrl;
+	unplug->intf_id = intf->id;
+
+	pthread_mutex_lock(&unplug_lock);
+	if (unplug_stopped)
+		goto err_unlock;
+
+	if (!unplug_run) {
+		unplug_run = 1;
+		ret = pthread_create(&unplug_thread, NULL,
+				     interface_unplug_thread, NULL);
+		if (ret) {
+			pr_err("Failed to create the unplug thread\n");
+			unplug_run = 0;
+			goto err_unlock;
+		}
+	}
+
+	TAILQ_INSERT_TAIL(&unplugs, unplug, node);
+	pthread_cond_signal(&unplug_cond);
+	pthread_mutex_unlock(&unplug_lock);
+
+	return;
+
+err_unlock:
+	pthread_mutex_unlock(&unplug_lock);
+	free(unplug);
+}
+
+static void interface_unplug_exit(void)
+{
+	struct unplug *unplug;
+
+	pthread_mutex_lock(&unplug_lock);
+	unplug_stopped = 1;
+	if (unplug_run) {
+		unplug_run = 0;
+		pthread_cond_signal(&unplug_cond);
+		pthread_mutex_unlock(&unplug_lock);
+		pthread_join(unplug_thread, NULL);
+		pthread_mutex_lock(&unplug_lock);
+	}
+
+	/* The interfaces left are destroyed with their controller */
+	while ((unplug = TAILQ_FIRST(&unplugs))) {
+		TAILQ_REMOVE(&unplugs, unplug, node);
+		free(unplug);
+	}
+	pthread_mutex_unlock(&unplug_lock);
 }
 
 static void *interface_recv(void *data)
@@ -152,6 +343,10 @@ static void *interface_recv(void *data)
 
 	while (1) {
 		ret = ctrl->intf_read(intf, &cport_id, buffer, GB_NETLINK_MTU);
+		if (ret == -ENOTCONN) {
+			interface_unplug_queue(intf);
+			break;
+		}
 		if (ret < 0) {
 			pr_err("Failed to read data: %d\n", ret);
 			continue;
@@ -159,13 +354,15 @@ static void *interface_recv(void *data)
 
 		pr_dump(buffer, ret);
 
-		conn = _get_connection(intf, cport_id);
+		conn = get_connection(intf->id, cport_id);
 		if (!conn) {
 			pr_err("Received data on invalid cport number\n");
 			continue;
 		}
 
-		ret = controller_write(AP_INTF_ID, conn->cport1_id, buffer, ret);
+		ret = connection_forward(ctrl, conn, conn->intf1->id,
+					 buffer, ret);
+		put_connection(conn);
 		if (ret < 0) {
 			pr_err("Failed to transmit data\n");
 		}
@@ -202,6 +399,13 @@ struct interface *interface_create(struct controller *ctrl, uint32_t vendor_id,
 	intf->vendor_id = vendor_id;
 	intf->product_id = product_id;
 	intf->serial_id = serial_id;
+	intf->manifest_cache = 0;
+	intf->manifest_crc = 0;
+	intf->connecting = 0;
+	intf->connections = 0;
+	intf->unplugged = 0;
+	intf->replugging = 0;
+	memset(intf->gb_drivers, 0, sizeof(intf->gb_drivers));
 
 	if (ctrl->interface_create)
 		if (ctrl->interface_create(intf))
@@ -213,7 +417,9 @@ struct interface *interface_create(struct controller *ctrl, uint32_t vendor_id,
 			goto err_destroy_intf;
 	}
 
+	pthread_mutex_lock(&interfaces_lock);
 	TAILQ_INSERT_TAIL(&ctrl->interfaces, intf, node);
+	pthread_mutex_unlock(&interfaces_lock);
 
 	return intf;
 
@@ -233,7 +439,10 @@ void interface_destroy(struct interface *intf)
 		pthread_join(intf->thread, NULL);
 	}
 
+	pthread_mutex_lock(&interfaces_lock);
 	TAILQ_REMOVE(&intf->ctrl->interfaces, intf, node);
+	pthread_mutex_unlock(&interfaces_lock);
+	hotplug_cancel(intf->id);
 
 	if (intf->ctrl->interface_destroy)
 		intf->ctrl->interface_destroy(intf);
@@ -251,31 +460,133 @@ void interfaces_destroy(struct controller *ctrl)
 
 int interface_hotplug(struct interface *intf)
 {
-	int ret;
-	ret = svc_send_module_inserted_event(intf->id, intf->vendor_id,
-					     intf->product_id, intf->serial_id);
+	return hotplug_queue(intf);
+}
 
-	return ret;
+/* Take the next connection of the interface out of the list, if any */
+static struct connection *connection_claim(struct interface *intf)
+{
+	struct connection *conn;
+
+	pthread_mutex_lock(&connections_lock);
+	TAILQ_FOREACH(conn, &connections, node) {
+		if (conn->intf1 == intf || conn->intf2 == intf)
+			break;
+	}
+	if (conn)
+		TAILQ_REMOVE(&connections, conn, node);
+	pthread_mutex_unlock(&connections_lock);
+
+	return conn;
 }
 
+static void connection_release(struct connection *conn);
+
 int interface_hot_unplug(struct interface *intf)
 {
-	return 0;
+	int ret = 0;
+	int queued;
+	uint8_t intf_id = intf->id;
+	struct connection *conn;
+
+	pthread_mutex_lock(&connections_lock);
+	intf->unplugged = 1;
+	while (intf->connecting || intf->replugging)
+		pthread_cond_wait(&connections_cond, &connections_lock);
+	pthread_mutex_unlock(&connections_lock);
+
+	/* The kernel doesn't know the modules still waiting to be inserted */
+	queued = hotplug_cancel(intf_id);
+	if (!queued) {
+		ret = svc_send_module_removed_event(intf_id);
+		if (ret < 0)
+			pr_err("Failed to send the unplug event of interface %u\n",
+			       intf_id);
+	}
+	manifest_cache_cancel(intf_id);
+
+	/*
+	 * The kernel destroys the connections too, once it has handled the
+	 * event, but the module is not waited for.
+	 */
+	while ((conn = connection_claim(intf)))
+		connection_release(conn);
+
+	/* Some may have been claimed meanwhile by connection_destroy() */
+	pthread_mutex_lock(&connections_lock);
+	while (intf->connections)
+		pthread_cond_wait(&connections_cond, &connections_lock);
+	pthread_mutex_unlock(&connections_lock);
+
+	interface_destroy(intf);
+	pr_info("Interface %u unplugged\n", intf_id);
+
+	return ret;
+}
+
+int interface_replug(uint8_t intf_id)
+{
+	int ret;
+	struct interface *intf;
+	struct connection *conn;
+
+	/* interface_hot_unplug() waits for the interface to be plugged again */
+	pthread_mutex_lock(&connections_lock);
+	intf = get_interface(intf_id);
+	if (!intf || intf->unplugged || intf->replugging) {
+		pthread_mutex_unlock(&connections_lock);
+		return -ENODEV;
+	}
+	intf->replugging = 1;
+	while (intf->connecting)
+		pthread_cond_wait(&connections_cond, &connections_lock);
+	pthread_mutex_unlock(&connections_lock);
+
+	if (!hotplug_cancel(intf_id)) {
+		ret = svc_send_module_removed_event(intf_id);
+		if (ret < 0)
+			pr_err("Failed to send the unplug event of interface %u\n",
+			       intf_id);
+	}
+
+	while ((conn = connection_claim(intf)))
+		connection_release(conn);
+
+	pthread_mutex_lock(&connections_lock);
+	while (intf->connections)
+		pthread_cond_wait(&connections_cond, &connections_lock);
+	pthread_mutex_unlock(&connections_lock);
+
+	ret = interface_hotplug(intf);
+	if (ret < 0)
+		pr_err("Failed to plug interface %u again\n", intf_id);
+	else
+		pr_info("Interface %u plugged again\n", intf_id);
+
+	pthread_mutex_lock(&connections_lock);
+	intf->replugging = 0;
+	pthread_cond_broadcast(&connections_cond);
+	pthread_mutex_unlock(&connections_lock);
+
+	return ret;
 }
 
 struct interface *get_interface(uint8_t intf_id)
 {
 	struct controller *ctrl;
-	struct interface *intf;
+	struct interface *intf = NULL;
 
+	pthread_mutex_lock(&interfaces_lock);
 	TAILQ_FOREACH(ctrl, &controllers, node) {
 		TAILQ_FOREACH(intf, &ctrl->interfaces, node) {
 			if (intf->id == intf_id)
-				return intf;
+				goto out;
 		}
 	}
+out:
+	pthread_mutex_unlock(&interfaces_lock);
 
-	return NULL;
+	return intf;
 }
 
 void *connection_recv(void *data)
@@ -288,20 +599,21 @@ void *connection_recv(void *data)
 
 	while (1) {
 		ret = ctrl->read(conn, buffer, GB_NETLINK_MTU);
-		if (ret < 0) {
+		/*
+		 * e.g. -ENOTCONN once the module has closed its socket: the
+		 * thread can't release its own connection, so the interface is
+		 * unplugged by the unplug thread.
+		 */
+		if (ret <= 0) {
 			pr_err("Failed to read data: %d\n", ret);
-			break;
-		}
-
-		if (ret == 0) {
-			pr_err("Read is expected to be blocking!\n");
+			interface_unplug_queue(intf2);
 			break;
 		}
 
 		pr_dump(buffer, ret);
 
-		ret = controller_write(conn->intf1->id, conn->cport1_id,
-				       buffer, ret);
+		ret = connection_forward(ctrl, conn, conn->intf1->id,
+					 buffer, ret);
 		if (ret < 0) {
 			pr_err("Failed to transmit data\n");
 		}
@@ -310,6 +622,13 @@ void *connection_recv(void *data)
 	return NULL;
 }
 
+/* Called locked, once a connection of intf has been created or not */
+static void connection_done(struct interface *intf)
+{
+	intf->connecting--;
+	pthread_cond_broadcast(&connections_cond);
+}
+
 int
 connection_create(uint8_t intf1_id, uint16_t cport1_id,
 		  uint8_t intf2_id, uint16_t cport2_id)
@@ -326,22 +645,38 @@ connection_create(uint8_t intf1_id, uint16_t cport1_id,
 		return -EINVAL;
 	}
 
+	/* The interface can't be unplugged while the connection is created */
+	pthread_mutex_lock(&connections_lock);
 	intf2 = get_interface(intf2_id);
+	if (intf2 && (intf2->unplugged || intf2->replugging))
+		intf2 = NULL;
+	if (intf2)
+		intf2->connecting++;
+	pthread_mutex_unlock(&connections_lock);
 	if (!intf2) {
 		pr_err("Invalid interface id %d\n", intf2_id);
 		return -EINVAL;
 	}
 
 	conn = malloc(sizeof(*conn));
-	if (!conn)
-		return -ENOMEM;
+	if (!conn) {
+		ret = -ENOMEM;
+		goto err_done;
+	}
 
 	conn->intf1 = intf1;
 	conn->intf2 = intf2;
 	conn->cport1_id = cport1_id;
 	conn->cport2_id = cport2_id;
+	conn->rx_segment = NULL;
+	conn->users = 0;
 
 	ctrl = intf2->ctrl;
+	conn->compress = ctrl->compress;
+	conn->compress_skip = 0;
+	conn->compress_backoff = 0;
+	pthread_mutex_init(&conn->compress_lock, NULL);
+	pthread_mutex_init(&conn->tx_lock, NULL);
 	if (ctrl->connection_create) {
 		ret = ctrl->connection_create(conn);
 		if (ret)
@@ -355,39 +690,82 @@ connection_create(uint8_t intf1_id, uint16_t cport1_id,
 			goto err_conn_destroy;
 	}
 
+	pthread_mutex_lock(&connections_lock);
 	TAILQ_INSERT_TAIL(&connections, conn, node);
+	intf1->connections++;
+	intf2->connections++;
+	connection_done(intf2);
+	pthread_mutex_unlock(&connections_lock);
 
 	return 0;
 
 err_conn_destroy:
 	ctrl->connection_destroy(conn);
 err_free_conn:
+	pthread_mutex_destroy(&conn->tx_lock);
+	pthread_mutex_destroy(&conn->compress_lock);
 	free(conn);
+err_done:
+	pthread_mutex_lock(&connections_lock);
+	connection_done(intf2);
+	pthread_mutex_unlock(&connections_lock);
 	return ret;
 }
 
+/* Called once the connection has been taken out of the list */
+static void connection_release(struct connection *conn)
+{
+	struct controller *ctrl = conn->intf2->ctrl;
+
+	/* Wait for the messages being written on the connection */
+	pthread_mutex_lock(&connections_lock);
+	while (conn->users)
+		pthread_cond_wait(&connections_cond, &connections_lock);
+	pthread_mutex_unlock(&connections_lock);
+
+	if (ctrl->read) {
+		pthread_cancel(conn->thread);
+		pthread_join(conn->thread, NULL);
+	}
+
+	if (ctrl->connection_destroy)
+		ctrl->connection_destroy(conn);
+
+	/* Nobody will answer the requests sent on the connection */
+	greybus_fail_operations(conn->intf1->id, conn->cport1_id, -ENODEV);
+	greybus_fail_operations(conn->intf2->id, conn->cport2_id, -ENODEV);
+
+	if (conn->rx_segment)
+		segment_put(conn->rx_segment);
+
+	pthread_mutex_lock(&connections_lock);
+	conn->intf1->connections--;
+	conn->intf2->connections--;
+	pthread_cond_broadcast(&connections_cond);
+	pthread_mutex_unlock(&connections_lock);
+	pthread_mutex_destroy(&conn->tx_lock);
+	pthread_mutex_destroy(&conn->compress_lock);
+	free(conn);
+}
+
 int
 connection_destroy(uint8_t intf1_id, uint16_t cport1_id,
 		   uint8_t intf2_id, uint16_t cport2_id)
 {
-	struct interface *intf2;
 	struct connection *conn;
-	struct controller *ctrl;
 
-	conn = get_connection(intf1_id, cport1_id);
+	pthread_mutex_lock(&connections_lock);
+	conn = connection_find(intf1_id, cport1_id);
+	if (conn)
+		TAILQ_REMOVE(&connections, conn, node);
+	pthread_mutex_unlock(&connections_lock);
 	if (!conn) {
 		pr_err("Failed to get a connection for interface %d cport %d\n",
 			intf1_id, cport1_id);
 		return -EINVAL;
 	}
 
-	intf2 = conn->intf2;
-	ctrl = intf2->ctrl;
-	if (ctrl->connection_destroy)
-		ctrl->connection_destroy(conn);
-
-	TAILQ_REMOVE(&connections, conn, node);
-	free(conn);
+	connection_release(conn);
 
 	return 0;
 }
@@ -450,27 +828,56 @@ static void controller_loop_exit(struct controller *ctrl)
 int controller_write(uint8_t intf_id, uint16_t cport_id,
 		     void *data, size_t len)
 {
+	int ret;
 	struct connection *conn;
 	struct controller *ctrl;
 	struct interface *intf;
+	struct gb_operation_msg_hdr *hdr = data;
+	uint8_t buffer[GB_NETLINK_MTU];
 
-	intf = get_interface(intf_id);
-	if (!intf) {
-		pr_err("Invalid interface id %d\n", intf_id);
-		return -EINVAL;
-	}
-
-	conn = _get_connection(intf, cport_id);
+	conn = get_connection(intf_id, cport_id);
 	if (!conn) {
 		pr_err("Failed to get a connection for interface %d cport %d\n",
 			intf_id, cport_id);
 		return -EINVAL;
 	}
+	intf = conn->intf1->id == intf_id ? conn->intf1 : conn->intf2;
 
 	pr_dump(data, len);
 
+	if (intf == conn->intf2) {
+		ret = manifest_cache_request(conn, data, len);
+		if (ret) {
+			if (ret > 0)
+				ret = 0;
+			goto out;
+		}
+	}
+
+	if (intf == conn->intf1 && conn->intf2->id != AP_INTF_ID &&
+	    conn->cport2_id == CONTROL_CPORT && len >= sizeof(*hdr) &&
+	    hdr->type == (OP_RESPONSE | GB_CONTROL_TYPE_GET_MANIFEST))
+		hotplug_event(conn->intf2->id, HOTPLUG_MANIFEST);
+
 	ctrl = intf->ctrl;
-	return ctrl->write(conn, data, len);
+	/* Only the messages going to the module are compressed */
+	if (conn->compress && intf == conn->intf2) {
+		ret = compress_message(conn, data, len, buffer, sizeof(buffer));
+		if (ret > 0) {
+			data = buffer;
+			len = ret;
+		}
+	}
+
+	if (ctrl->mtu && len > ctrl->mtu)
+		ret = segment_write(ctrl, conn, data, len);
+	else
+		ret = ctrl->write(conn, data, len);
+
+out:
+	put_connection(conn);
+
+	return ret;
 }
 
 void controllers_init(void)
@@ -495,8 +902,15 @@ void controllers_exit(void)
 {
 	struct controller *ctrl;
 
-	TAILQ_FOREACH(ctrl, &controllers, node) {
+	/*
+	 * Stop every event loop first, so none of them uses an interface of
+	 * another controller while it is destroyed.
+	 */
+	TAILQ_FOREACH(ctrl, &controllers, node)
 		controller_loop_exit(ctrl);
+	interface_unplug_exit();
+
+	TAILQ_FOREACH(ctrl, &controllers, node) {
 		interfaces_destroy(ctrl);
 		ctrl->exit(ctrl);
 	}
@@ -34,12 +34,29 @@ struct connection {
 
 	 TAILQ_ENTRY(connection) node;
 	pthread_t thread;
+	/* Message being reassembled, see segment.h */
+	struct segment *rx_segment;
+	/* Held while the fragments of a message are written */
+	pthread_mutex_t tx_lock;
+	/* Compression state, see compress.h */
+	int compress;
+	unsigned int compress_skip;
+	unsigned int compress_backoff;
+	pthread_mutex_t compress_lock;
+	/* Held by get_connection(), the connection is released at 0 */
+	int users;
 };
 
 struct interface {
 	uint32_t vendor_id;
 	uint32_t product_id;
 	uint64_t serial_id;
+	/*
+	 * Set by the controller when the manifest of the module may be cached
+	 * (see manifest_cache.h), with its CRC32C if the module advertises it
+	 */
+	int manifest_cache;
+	uint32_t manifest_crc;
 
 	void *priv;
 
@@ -48,6 +65,14 @@ struct interface {
 	struct controller *ctrl;
 	 TAILQ_ENTRY(interface) node;
 	pthread_t thread;
+	/* Connections being created, waited for by interface_hot_unplug() */
+	int connecting;
+	/* Connections created, until they are released */
+	int connections;
+	/* Set once the module is gone: no connection can be created anymore */
+	int unplugged;
+	/* Set while the module is enumerated again, see interface_replug() */
+	int replugging;
 
 	struct greybus_driver *gb_drivers[GB_NETLINK_NUM_CPORT];
 };
@@ -72,6 +97,20 @@ struct controller {
 
 	void *priv;
 
+	/*
+	 * Largest message the link can carry, if smaller than GB_NETLINK_MTU.
+	 * Bigger messages are then split in fragments (see segment.h).
+	 */
+	size_t mtu;
+	/* Default for the connections, which may override it */
+	int compress;
+	/*
+	 * Held to unplug an interface whose intf_read returned -ENOTCONN,
+	 * or queued by interface_unplug_queue(), if the controller walks its
+	 * interfaces from its own threads
+	 */
+	pthread_mutex_t *interfaces_lock;
+
 	/* gb controller private data */
 	pthread_t thread;
 	 TAILQ_ENTRY(controller) node;
@@ -92,7 +131,22 @@ struct interface *interface_create(struct controller *ctrl,
 				   uint32_t vendor_id, uint32_t product_id,
 				   uint64_t serial_id, void *priv);
 int interface_hotplug(struct interface *intf);
+/*
+ * Tell the kernel that the module is gone, and release its connections,
+ * the operations waiting on them, and the interface. Must not be called
+ * by the thread of the interface.
+ */
 int interface_hot_unplug(struct interface *intf);
+/*
+ * Unplug the interface from the unplug thread, e.g. from a callback of
+ * its controller that can't wait for the connections of the interface
+ */
+void interface_unplug_queue(struct interface *intf);
+/*
+ * Remove the module from the kernel and insert it again, e.g. once its
+ * manifest has changed. The interface itself is kept.
+ */
+int interface_replug(uint8_t intf_id);
 void interface_destroy(struct interface *intf);
 void interfaces_destroy(struct controller *ctrl);
 
@@ -109,9 +163,13 @@ void register_controller(struct controller *controller);
 void register_controllers(void);
 
 struct interface *get_interface(uint8_t intf_id);
+/*
+ * The connection returned is pinned until put_connection(): it is not
+ * released meanwhile, nor its interfaces.
+ */
 struct connection *get_connection(uint8_t intf_id, uint16_t cport_id);
+void put_connection(struct connection *conn);
 int hd_to_intf_cport_id(uint16_t hd_cport_id,
 			uint8_t *intf, uint16_t *cport_id);
-int register_gbsim_controller(const char *manifest_file);
 
 #endif				/* __CONTROLLER_H__ */
@@ -17,8 +17,11 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <bluetooth/bluetooth.h>
@@ -29,27 +32,259 @@
 #include <debug.h>
 #include <gbridge.h>
 #include <controller.h>
+#include <compress.h>
+#include <txqueue.h>
+#include <controllers/bluetooth.h>
 
 #define BDADDR_SIZE	19
 #define BDNAME_SIZE	248
 
+/* Large enough to hold a few messages received in a single read() */
+#define BT_RX_BUF_SIZE	(4 * GB_NETLINK_MTU)
+
+/*
+ * An inquiry keeps the radio busy, slowing down the connected modules.
+ * The scans are spaced out by an interval doubled after each scan that
+ * doesn't find a new module, and reset when one is found.
+ */
+#define BT_SCAN_INTERVAL_MIN	1	/* seconds */
+#define BT_SCAN_INTERVAL_MAX	120
+#define BT_INQUIRY_LEN		8	/* 1.28 seconds unit */
+#define BT_INQUIRY_MAX_RSP	255
+
+/* The name of a device is read again after BT_NAME_CACHE_TTL seconds */
+#define BT_NAME_CACHE_TTL	600
+
+/* Number of modules connected concurrently */
+#define BT_CONNECT_WORKERS	4
+
 struct bluetooth_device {
 	char name[BDNAME_SIZE];
 	char addr[BDADDR_SIZE];
 	struct btd_device *device;
 	int sock;
+
+	struct tx_queue tx_queue;
+	size_t rx_start;
+	size_t rx_end;
+	uint8_t rx_buf[BT_RX_BUF_SIZE];
+};
+
+struct bluetooth_name {
+	bdaddr_t bdaddr;
+	char name[BDNAME_SIZE];
+	int greybus;
+	time_t expires;
+	LIST_ENTRY(bluetooth_name) node;
+};
+
+/* A module waiting for a connect worker, or being connected */
+struct bluetooth_job {
+	bdaddr_t bdaddr;
+	char name[BDNAME_SIZE];
+	TAILQ_ENTRY(bluetooth_job) node;
 };
 
 struct bluetooth_controller {
+	const struct bluetooth_hci_ops *hci;
+	void *hci_priv;
+	LIST_HEAD(name_head, bluetooth_name) names;
+	bdaddr_t bdaddrs[BT_INQUIRY_MAX_RSP];
+
+	/* Protect the jobs, and the interfaces of the controller */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	TAILQ_HEAD(job_head, bluetooth_job) jobs;
+	TAILQ_HEAD(connecting_head, bluetooth_job) connecting;
+	pthread_t workers[BT_CONNECT_WORKERS];
+	int worker_count;
+};
+
+/* Default HCI backend, using the first adapter available */
+struct bluetooth_hci {
 	int dev_id;
 	int sock;
+	inquiry_info *ii;
+};
+
+static int bluetooth_hci_open(void **priv)
+{
+	int ret;
+	struct bluetooth_hci *hci;
+
+	hci = malloc(sizeof(*hci));
+	if (!hci)
+		return -ENOMEM;
+
+	hci->ii = malloc(BT_INQUIRY_MAX_RSP * sizeof(inquiry_info));
+	if (!hci->ii) {
+		ret = -ENOMEM;
+		goto err_free_hci;
+	}
+
+	hci->dev_id = hci_get_route(NULL);
+	if (hci->dev_id < 0) {
+		perror("Failed to get device id");
+		ret = -errno;
+		goto err_free_ii;
+	}
+
+	hci->sock = hci_open_dev(hci->dev_id);
+	if (hci->sock < 0) {
+		perror("Failed to open socket");
+		ret = -errno;
+		goto err_free_ii;
+	}
+
+	*priv = hci;
+
+	return 0;
+
+err_free_ii:
+	free(hci->ii);
+err_free_hci:
+	free(hci);
+
+	return ret;
+}
+
+static void bluetooth_hci_close(void *priv)
+{
+	struct bluetooth_hci *hci = priv;
+
+	close(hci->sock);
+	free(hci->ii);
+	free(hci);
+}
+
+static int bluetooth_hci_inquiry(void *priv, bdaddr_t *bdaddrs, int max)
+{
+	int i;
+	int num_rsp;
+	struct bluetooth_hci *hci = priv;
+
+	if (max > BT_INQUIRY_MAX_RSP)
+		max = BT_INQUIRY_MAX_RSP;
+
+	num_rsp = hci_inquiry(hci->dev_id, BT_INQUIRY_LEN, max, NULL,
+			      &hci->ii, IREQ_CACHE_FLUSH);
+	if (num_rsp < 0)
+		return -errno;
+
+	for (i = 0; i < num_rsp; i++)
+		bacpy(&bdaddrs[i], &hci->ii[i].bdaddr);
+
+	return num_rsp;
+}
+
+static int bluetooth_hci_read_remote_name(void *priv, const bdaddr_t *bdaddr,
+					  char *name, size_t len)
+{
+	struct bluetooth_hci *hci = priv;
+
+	if (hci_read_remote_name(hci->sock, bdaddr, len, name, 0) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static const struct bluetooth_hci_ops bluetooth_hci_default = {
+	.open = bluetooth_hci_open,
+	.close = bluetooth_hci_close,
+	.inquiry = bluetooth_hci_inquiry,
+	.read_remote_name = bluetooth_hci_read_remote_name,
+};
+
+static void bluetooth_close(void *data)
+{
+	close(*(int *)data);
+}
+
+/* Default transport, using RFCOMM on channel 1 */
+static int bluetooth_rfcomm_connect(const bdaddr_t *bdaddr)
+{
+	int ret;
+	int sock;
+	struct sockaddr_rc addr;
+
+	sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+	if (sock < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.rc_family = AF_BLUETOOTH;
+	addr.rc_channel = (uint8_t) 1;
+	bacpy(&addr.rc_bdaddr, bdaddr);
+
+	/* The connect worker may be cancelled meanwhile */
+	pthread_cleanup_push(bluetooth_close, &sock);
+	ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+	pthread_cleanup_pop(0);
+	if (ret < 0) {
+		ret = -errno;
+		close(sock);
+		return ret;
+	}
+
+	return sock;
+}
+
+static const struct bluetooth_transport_ops bluetooth_rfcomm = {
+	.connect = bluetooth_rfcomm_connect,
 };
 
+static const struct bluetooth_hci_ops *bt_hci = &bluetooth_hci_default;
+static const struct bluetooth_transport_ops *bt_transport = &bluetooth_rfcomm;
+static struct tx_queue_aggregation bt_aggregation;
+static int bt_compress;
+
+int bluetooth_set_hci_ops(const struct bluetooth_hci_ops *ops)
+{
+	bt_hci = ops;
+
+	return 0;
+}
+
+int bluetooth_set_transport_ops(const struct bluetooth_transport_ops *ops)
+{
+	bt_transport = ops;
+
+	return 0;
+}
+
+int bluetooth_set_aggregation(const struct tx_queue_aggregation *aggregation)
+{
+	bt_aggregation = *aggregation;
+
+	return 0;
+}
+
+int bluetooth_set_compression(int compress)
+{
+	bt_compress = compress;
+
+	return 0;
+}
+
+/*
+ * Called by the TX queue thread. RFCOMM sends the messages written at
+ * once in as few frames as possible.
+ */
+static int bluetooth_flush(void *priv, struct iovec *iov, int count)
+{
+	struct bluetooth_device *bd = priv;
+
+	return tx_writev_all(bd->sock, iov, count);
+}
+
+/* Tell if the module is connected, or being connected. Called locked. */
 static int bluetooth_is_connected(struct controller *ctrl, bdaddr_t *bdaddr)
 {
 	char addr[BDADDR_SIZE];
 	struct interface *intf;
 	struct bluetooth_device *bd;
+	struct bluetooth_job *job;
+	struct bluetooth_controller *bt_ctrl = ctrl->priv;
 
 	ba2str(bdaddr, addr);
 	TAILQ_FOREACH(intf, &ctrl->interfaces, node) {
@@ -59,15 +294,43 @@ static int bluetooth_is_connected(struct controller *ctrl, bdaddr_t *bdaddr)
 		}
 	}
 
+	TAILQ_FOREACH(job, &bt_ctrl->jobs, node) {
+		if (bacmp(&job->bdaddr, bdaddr) == 0)
+			return 1;
+	}
+
+	TAILQ_FOREACH(job, &bt_ctrl->connecting, node) {
+		if (bacmp(&job->bdaddr, bdaddr) == 0)
+			return 1;
+	}
+
 	return 0;
 }
 
-static int bluetooth_connect(struct controller *ctrl, bdaddr_t *bdaddr)
+static uint64_t bluetooth_serial_id(const bdaddr_t *bdaddr)
+{
+	int i;
+	uint64_t serial_id = 0;
+
+	for (i = 5; i >= 0; i--)
+		serial_id = (serial_id << 8) | bdaddr->b[i];
+
+	return serial_id;
+}
+
+/*
+ * Called by the connect workers. The transport connection, which is the
+ * slow part, is done unlocked so several modules are connected at once.
+ * The worker may only be cancelled during the transport connection.
+ */
+static int bluetooth_connect(struct controller *ctrl, bdaddr_t *bdaddr,
+			     const char *name)
 {
 	int ret;
+	int state;
+	uint8_t intf_id;
 	struct bluetooth_device *bd;
 	struct interface *intf;
-	struct sockaddr_rc addr;
 	struct bluetooth_controller *bt_ctrl = ctrl->priv;
 
 	bd = malloc(sizeof(*bd));
@@ -75,48 +338,65 @@ static int bluetooth_connect(struct controller *ctrl, bdaddr_t *bdaddr)
 		return -ENOMEM;
 
 	ba2str(bdaddr, bd->addr);
-	memset(bd->name, 0, sizeof(bd->name));
-	ret = hci_read_remote_name(bt_ctrl->sock, bdaddr,
-				   sizeof(bd->name), bd->name,
-				   IREQ_CACHE_FLUSH);
-	if (ret < 0)
-		goto err_free_bd;
+	bd->rx_start = 0;
+	bd->rx_end = 0;
+	snprintf(bd->name, sizeof(bd->name), "%s", name);
 
+	pthread_cleanup_push(free, bd);
 	pr_info("Connecting a new Greybus device\n");
-
-	bd->sock = socket(AF_BLUETOOTH, SOCK_STREAM, BTPROTO_RFCOMM);
+	bd->sock = bt_transport->connect(bdaddr);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_cleanup_pop(0);
 	if (bd->sock < 0) {
 		ret = bd->sock;
 		goto err_free_bd;
 	}
 
-	addr.rc_family = AF_BLUETOOTH;
-	addr.rc_channel = (uint8_t) 1;
-	str2ba(bd->addr, &addr.rc_bdaddr);
-
-	ret = connect(bd->sock, (struct sockaddr *)&addr, sizeof(addr));
-	if (ret < 0)
-		goto err_close_sock;
-
 	pr_info("Greybus device connected\n");
 
-	/* FIXME: use real IDs */
-	intf = interface_create(ctrl, 1, 1, 0x1234, bd);
-	if (!intf)
+	ret = tx_queue_init(&bd->tx_queue, bd->addr, bluetooth_flush, bd);
+	if (ret)
 		goto err_close_sock;
+	tx_queue_set_aggregation(&bd->tx_queue, &bt_aggregation);
+
+	/* The interfaces are walked by bluetooth_is_connected() */
+	pthread_mutex_lock(&bt_ctrl->lock);
+	/* FIXME: use real IDs. The address tells the modules apart. */
+	intf = interface_create(ctrl, 1, 1, bluetooth_serial_id(bdaddr), bd);
+	if (intf)
+		intf->manifest_cache = 1;
+	pthread_mutex_unlock(&bt_ctrl->lock);
+	if (!intf) {
+		ret = -ENOMEM;
+		goto err_tx_queue_exit;
+	}
 
+	intf_id = intf->id;
 	ret = interface_hotplug(intf);
-	if (ret < 0)
-		goto err_intf_destroy;
+	if (ret < 0) {
+		/* The module may have been unplugged meanwhile */
+		pthread_mutex_lock(&bt_ctrl->lock);
+		TAILQ_FOREACH(intf, &ctrl->interfaces, node) {
+			if (intf->id == intf_id)
+				break;
+		}
+		/* bluetooth_interface_destroy() releases the device */
+		if (intf)
+			interface_destroy(intf);
+		pthread_mutex_unlock(&bt_ctrl->lock);
+	}
 
-	return 0;
+	pthread_setcancelstate(state, NULL);
 
- err_intf_destroy:
-	interface_destroy(intf);
+	return ret;
+
+ err_tx_queue_exit:
+	tx_queue_exit(&bd->tx_queue);
  err_close_sock:
 	close(bd->sock);
  err_free_bd:
 	free(bd);
+	pthread_setcancelstate(state, NULL);
 
 	return ret;
 }
@@ -124,6 +404,8 @@ static int bluetooth_connect(struct controller *ctrl, bdaddr_t *bdaddr)
 static void bluetooth_disconnect(struct controller *ctrl,
 				 struct bluetooth_device *bd)
 {
+	tx_queue_drain(&bd->tx_queue);
+	tx_queue_exit(&bd->tx_queue);
 	close(bd->sock);
 	free(bd);
 }
@@ -133,76 +415,291 @@ static void bluetooth_interface_destroy(struct interface *intf)
 	bluetooth_disconnect(intf->ctrl, intf->priv);
 }
 
-static int bluetooth_scan(struct controller *ctrl)
+static struct bluetooth_name *
+bluetooth_name_lookup(struct bluetooth_controller *bt_ctrl,
+		      const bdaddr_t *bdaddr)
+{
+	struct bluetooth_name *bn;
+
+	LIST_FOREACH(bn, &bt_ctrl->names, node) {
+		if (bacmp(&bn->bdaddr, bdaddr) == 0)
+			return bn;
+	}
+
+	return NULL;
+}
+
+/*
+ * Tell if the device is a Greybus module, reading its name only if it is
+ * unknown or if the cached one has expired.
+ * Return the cache entry, or NULL if the name could not be read.
+ */
+static struct bluetooth_name *
+bluetooth_name_get(struct bluetooth_controller *bt_ctrl, const bdaddr_t *bdaddr)
 {
 	int ret;
-	inquiry_info *ii = NULL;
-	int max_rsp, num_rsp;
-	int len, flags;
-	int i;
+	time_t now = time(NULL);
 	char name[BDNAME_SIZE] = { 0 };
+	struct bluetooth_name *bn;
+
+	bn = bluetooth_name_lookup(bt_ctrl, bdaddr);
+	if (bn && bn->expires > now)
+		return bn;
+
+	ret = bt_hci->read_remote_name(bt_ctrl->hci_priv, bdaddr,
+				       name, sizeof(name) - 1);
+	if (ret < 0)
+		return NULL;
+
+	if (!bn) {
+		bn = malloc(sizeof(*bn));
+		if (!bn)
+			return NULL;
+		bacpy(&bn->bdaddr, bdaddr);
+		LIST_INSERT_HEAD(&bt_ctrl->names, bn, node);
+	}
+	memcpy(bn->name, name, sizeof(name));
+	bn->greybus = strstr(name, "GREYBUS") != NULL;
+	bn->expires = now + BT_NAME_CACHE_TTL;
+
+	return bn;
+}
+
+static void bluetooth_unlock(void *data)
+{
+	struct bluetooth_controller *bt_ctrl = data;
+
+	pthread_mutex_unlock(&bt_ctrl->lock);
+}
+
+static void *bluetooth_connect_worker(void *data)
+{
+	struct controller *ctrl = data;
 	struct bluetooth_controller *bt_ctrl = ctrl->priv;
+	struct bluetooth_job *job;
+
+	while (1) {
+		pthread_mutex_lock(&bt_ctrl->lock);
+		pthread_cleanup_push(bluetooth_unlock, bt_ctrl);
+		while (TAILQ_EMPTY(&bt_ctrl->jobs))
+			pthread_cond_wait(&bt_ctrl->cond, &bt_ctrl->lock);
+		job = TAILQ_FIRST(&bt_ctrl->jobs);
+		TAILQ_REMOVE(&bt_ctrl->jobs, job, node);
+		TAILQ_INSERT_TAIL(&bt_ctrl->connecting, job, node);
+		pthread_cleanup_pop(1);
+
+		if (bluetooth_connect(ctrl, &job->bdaddr, job->name))
+			pr_err("Failed to connect %s\n", job->name);
+
+		pthread_mutex_lock(&bt_ctrl->lock);
+		TAILQ_REMOVE(&bt_ctrl->connecting, job, node);
+		pthread_mutex_unlock(&bt_ctrl->lock);
+		free(job);
+	}
+
+	return NULL;
+}
 
-	len = 8;
-	max_rsp = 255;
-	flags = IREQ_CACHE_FLUSH;
+static int bluetooth_queue_connect(struct controller *ctrl,
+				   bdaddr_t *bdaddr, const char *name)
+{
+	struct bluetooth_job *job;
+	struct bluetooth_controller *bt_ctrl = ctrl->priv;
 
-	ii = malloc(max_rsp * sizeof(inquiry_info));
-	if (!ii)
+	job = malloc(sizeof(*job));
+	if (!job)
 		return -ENOMEM;
 
-	while (1) {
-		num_rsp = hci_inquiry(bt_ctrl->dev_id,
-				      len, max_rsp, NULL, &ii, flags);
-		if (num_rsp < 0) {
-			perror("hci_inquiry");
-			free(ii);
-			return errno;
-		}
+	bacpy(&job->bdaddr, bdaddr);
+	snprintf(job->name, sizeof(job->name), "%s", name);
+
+	pthread_mutex_lock(&bt_ctrl->lock);
+	TAILQ_INSERT_TAIL(&bt_ctrl->jobs, job, node);
+	pthread_cond_signal(&bt_ctrl->cond);
+	pthread_mutex_unlock(&bt_ctrl->lock);
+
+	return 0;
+}
 
-		for (i = 0; i < num_rsp; i++) {
-			memset(name, 0, sizeof(name));
-			ret =
-			    hci_read_remote_name(bt_ctrl->sock,
-						 &(ii + i)->bdaddr,
-						 sizeof(name), name, 0);
-			if (ret < 0)
-				strcpy(name, "[unknown]");
-
-			if (strstr(name, "GREYBUS")) {
-				if (!bluetooth_is_connected
-				    (ctrl, &(ii + i)->bdaddr)) {
-					bluetooth_connect(ctrl,
-							  &(ii + i)->bdaddr);
-				}
-			}
+/*
+ * Run an inquiry, and give the new modules to the connect workers.
+ * Return the number of new modules.
+ */
+static int bluetooth_inquiry(struct controller *ctrl)
+{
+	int i;
+	int num_rsp;
+	int connected;
+	int count = 0;
+	struct bluetooth_name *bn;
+	struct bluetooth_controller *bt_ctrl = ctrl->priv;
+
+	num_rsp = bt_hci->inquiry(bt_ctrl->hci_priv, bt_ctrl->bdaddrs,
+				  BT_INQUIRY_MAX_RSP);
+	if (num_rsp < 0) {
+		pr_err("Inquiry failed: %d\n", num_rsp);
+		return num_rsp;
+	}
+
+	for (i = 0; i < num_rsp; i++) {
+		pthread_mutex_lock(&bt_ctrl->lock);
+		connected = bluetooth_is_connected(ctrl, &bt_ctrl->bdaddrs[i]);
+		pthread_mutex_unlock(&bt_ctrl->lock);
+		if (connected)
+			continue;
+
+		bn = bluetooth_name_get(bt_ctrl, &bt_ctrl->bdaddrs[i]);
+		if (!bn || !bn->greybus)
+			continue;
+
+		if (!bluetooth_queue_connect(ctrl, &bt_ctrl->bdaddrs[i],
+					     bn->name))
+			count++;
+	}
+
+	return count;
+}
+
+static void bluetooth_workers_stop(struct controller *ctrl)
+{
+	int i;
+	struct bluetooth_job *job;
+	struct bluetooth_controller *bt_ctrl = ctrl->priv;
+
+	/* The scan queues the jobs, so it is stopped first */
+	if (ctrl->event_loop_run) {
+		pthread_cancel(ctrl->thread);
+		pthread_join(ctrl->thread, NULL);
+		ctrl->event_loop_run = 0;
+	}
+
+	for (i = 0; i < bt_ctrl->worker_count; i++)
+		pthread_cancel(bt_ctrl->workers[i]);
+	for (i = 0; i < bt_ctrl->worker_count; i++)
+		pthread_join(bt_ctrl->workers[i], NULL);
+	bt_ctrl->worker_count = 0;
+
+	/* The jobs of the cancelled workers are still in the lists */
+	pthread_mutex_lock(&bt_ctrl->lock);
+	while ((job = TAILQ_FIRST(&bt_ctrl->jobs))) {
+		TAILQ_REMOVE(&bt_ctrl->jobs, job, node);
+		free(job);
+	}
+	while ((job = TAILQ_FIRST(&bt_ctrl->connecting))) {
+		TAILQ_REMOVE(&bt_ctrl->connecting, job, node);
+		free(job);
+	}
+	pthread_mutex_unlock(&bt_ctrl->lock);
+}
+
+static int bluetooth_scan(struct controller *ctrl)
+{
+	int ret;
+	unsigned int interval = BT_SCAN_INTERVAL_MIN;
+	struct bluetooth_controller *bt_ctrl = ctrl->priv;
+
+	for (; bt_ctrl->worker_count < BT_CONNECT_WORKERS;
+	     bt_ctrl->worker_count++) {
+		ret = pthread_create(&bt_ctrl->workers[bt_ctrl->worker_count],
+				     NULL, bluetooth_connect_worker, ctrl);
+		if (ret) {
+			pr_err("Failed to create a connect worker: %d\n", ret);
+			break;
 		}
 	}
 
-	free(ii);
+	if (!bt_ctrl->worker_count)
+		return -ENOMEM;
+
+	while (1) {
+		ret = bluetooth_inquiry(ctrl);
+		if (ret > 0)
+			interval = BT_SCAN_INTERVAL_MIN;
+		else if (interval < BT_SCAN_INTERVAL_MAX)
+			interval *= 2;
+		if (interval > BT_SCAN_INTERVAL_MAX)
+			interval = BT_SCAN_INTERVAL_MAX;
+
+		pr_dbg("Next bluetooth scan in %u seconds\n", interval);
+		sleep(interval);
+	}
 
 	return 0;
 }
 
 static int bluetooth_write(struct connection *conn, void *data, size_t len)
 {
-	struct interface *intf = conn->intf;
+	struct interface *intf = conn->intf2;
 	struct bluetooth_device *bd = intf->priv;
 
+	if (len > GB_NETLINK_MTU)
+		return -EMSGSIZE;
+
 	cport_pack(data, conn->cport2_id);
-	return write(bd->sock, data, len);
+	return tx_queue_push(&bd->tx_queue, data, len);
+}
+
+/* Read as much as possible, so aggregated messages need a single read() */
+static int bluetooth_fill(struct bluetooth_device *bd, size_t len)
+{
+	int ret;
+
+	if (bd->rx_start == bd->rx_end) {
+		bd->rx_start = 0;
+		bd->rx_end = 0;
+	} else if (bd->rx_start + len > BT_RX_BUF_SIZE) {
+		memmove(bd->rx_buf, bd->rx_buf + bd->rx_start,
+			bd->rx_end - bd->rx_start);
+		bd->rx_end -= bd->rx_start;
+		bd->rx_start = 0;
+	}
+
+	while (bd->rx_end - bd->rx_start < len) {
+		ret = read(bd->sock, bd->rx_buf + bd->rx_end,
+			   BT_RX_BUF_SIZE - bd->rx_end);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* e.g. ECONNRESET: the link is lost for good */
+			pr_err("%s: Failed to read: %d\n", bd->addr, -errno);
+			return -ENOTCONN;
+		}
+		if (ret == 0)
+			return -ENOTCONN;
+		bd->rx_end += ret;
+	}
+
+	return 0;
 }
 
 static int bluetooth_read(struct interface *intf,
 			  uint16_t *cport_id, void *data, size_t len)
 {
 	int ret;
+	size_t size;
 	struct bluetooth_device *bd = intf->priv;
 
-	ret = read_gb_msg(bd->sock, data, len);
-	if (ret > 0)
-		*cport_id = cport_unpack(data);
-	return ret;
+	ret = bluetooth_fill(bd, sizeof(struct gb_operation_msg_hdr));
+	if (ret)
+		return ret;
+
+	size = gb_operation_msg_size(bd->rx_buf + bd->rx_start);
+	if (size < sizeof(struct gb_operation_msg_hdr) ||
+	    size > len || size > GB_NETLINK_MTU) {
+		/* The stream can't be resynchronized */
+		pr_err("%s: Invalid message size %zu\n", bd->addr, size);
+		return -ENOTCONN;
+	}
+
+	ret = bluetooth_fill(bd, size);
+	if (ret)
+		return ret;
+
+	memcpy(data, bd->rx_buf + bd->rx_start, size);
+	bd->rx_start += size;
+	*cport_id = cport_unpack(data);
+
+	return size;
 }
 
 static int bluetooth_init(struct controller *ctrl)
@@ -213,21 +710,19 @@ static int bluetooth_init(struct controller *ctrl)
 	bt_ctrl = malloc(sizeof(*bt_ctrl));
 	if (!bt_ctrl)
 		return -ENOMEM;
-	 ctrl->priv = bt_ctrl;
-
-	bt_ctrl->dev_id = hci_get_route(NULL);
-	if (bt_ctrl->dev_id < 0) {
-		perror("Failed to get device id");
-		ret = errno;
-		goto err_free_bt_ctrl;
-	}
-
-	bt_ctrl->sock = hci_open_dev(bt_ctrl->dev_id);
-	if (bt_ctrl->sock < 0) {
-		perror("Failed to open socket");
-		ret = errno;
+	ctrl->priv = bt_ctrl;
+	ctrl->compress = bt_compress ? COMPRESS_OFFERED : COMPRESS_OFF;
+	LIST_INIT(&bt_ctrl->names);
+	TAILQ_INIT(&bt_ctrl->jobs);
+	TAILQ_INIT(&bt_ctrl->connecting);
+	pthread_mutex_init(&bt_ctrl->lock, NULL);
+	pthread_cond_init(&bt_ctrl->cond, NULL);
+	ctrl->interfaces_lock = &bt_ctrl->lock;
+	bt_ctrl->worker_count = 0;
+
+	ret = bt_hci->open(&bt_ctrl->hci_priv);
+	if (ret)
 		goto err_free_bt_ctrl;
-	}
 
 	return 0;
 
@@ -239,10 +734,18 @@ err_free_bt_ctrl:
 
 static void bluetooth_exit(struct controller *ctrl)
 {
+	struct bluetooth_name *bn;
 	struct bluetooth_controller *bt_ctrl = ctrl->priv;
 
-	free(ctrl->priv);
-	close(bt_ctrl->sock);
+	while ((bn = LIST_FIRST(&bt_ctrl->names))) {
+		LIST_REMOVE(bn, node);
+		free(bn);
+	}
+
+	bt_hci->close(bt_ctrl->hci_priv);
+	pthread_cond_destroy(&bt_ctrl->cond);
+	pthread_mutex_destroy(&bt_ctrl->lock);
+	free(bt_ctrl);
 }
 
 struct controller bluetooth_controller = {
@@ -250,6 +753,7 @@ struct controller bluetooth_controller = {
 	.init = bluetooth_init,
 	.exit = bluetooth_exit,
 	.event_loop = bluetooth_scan,
+	.event_loop_stop = bluetooth_workers_stop,
 	.write = bluetooth_write,
 	.intf_read = bluetooth_read,
 	.interface_destroy = bluetooth_interface_destroy,
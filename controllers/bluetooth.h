@@ -0,0 +1,74 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BLUETOOTH_H_
+#define _BLUETOOTH_H_
+
+#include <config.h>
+#include <debug.h>
+#include <txqueue.h>
+
+#ifdef HAVE_LIBBLUETOOTH
+#include <bluetooth/bluetooth.h>
+
+/*
+ * Access to the adapter used to scan for the modules.
+ * The default backend uses the first HCI adapter, and may be replaced
+ * (e.g. by a mock) before the controller is initialized.
+ */
+struct bluetooth_hci_ops {
+	int (*open)(void **priv);
+	void (*close)(void *priv);
+	/* Return the number of devices found, at most max */
+	int (*inquiry)(void *priv, bdaddr_t *bdaddrs, int max);
+	int (*read_remote_name)(void *priv, const bdaddr_t *bdaddr,
+				char *name, size_t len);
+};
+
+/*
+ * Connection to a module, RFCOMM by default.
+ * connect() returns a connected stream socket, or a negative errno.
+ * The connect worker calling it may be cancelled, so it must not leak
+ * anything then. A mock may return one end of a socketpair.
+ */
+struct bluetooth_transport_ops {
+	int (*connect)(const bdaddr_t *bdaddr);
+};
+
+int bluetooth_set_hci_ops(const struct bluetooth_hci_ops *ops);
+int bluetooth_set_transport_ops(const struct bluetooth_transport_ops *ops);
+int bluetooth_set_aggregation(const struct tx_queue_aggregation *aggregation);
+int bluetooth_set_compression(int compress);
+#else
+static inline int
+bluetooth_set_aggregation(const struct tx_queue_aggregation *aggregation)
+{
+	pr_err("Bluetooth support has not been compiled.\n");
+
+	return -1;
+}
+
+static inline int bluetooth_set_compression(int compress)
+{
+	pr_err("Bluetooth support has not been compiled.\n");
+
+	return -1;
+}
+#endif
+
+#endif /* _BLUETOOTH_H_ */
@@ -254,6 +254,7 @@ void netlink_exit(struct controller * ctrl)
 	svc_watchdog_disable();
 	pthread_cancel(nl_recv_thread);
 	pthread_join(nl_recv_thread, NULL);
+	svc_exit();
 
 	netlink_hd_reset();
 	nl_close(sock);
@@ -16,101 +16,444 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
 
 #include <debug.h>
 #include <controller.h>
+#include <controllers/gbsim.h>
 #include <protocols/protocols.h>
 #include <protocols/manifest.h>
 
-struct gbsim_controller {
-	const char *manifest_file;
+/* The interface id 0 is the AP, and the ids are 8 bits wide */
+#define GBSIM_MAX_MODULES	254
+
+#define GBSIM_VENDOR_ID		1
+#define GBSIM_PRODUCT_ID	1
+#define GBSIM_SERIAL_ID		0x1234
+
+#define PER_MILLION		1000000
+
+struct gbsim_link {
+	struct gbsim_impairment impairment;
+	unsigned int seed;
+	uint64_t busy_until;
+	uint64_t last_arrival;
+
+	uint64_t sent;
+	uint64_t dropped;
+	uint64_t reordered;
+};
+
+/* A manifest file, mapped once for all the modules using it */
+struct gbsim_manifest_file {
+	char *path;
+	const void *blob;
+	size_t size;
+	TAILQ_ENTRY(gbsim_manifest_file) node;
+};
+
+struct gbsim_module {
+	struct gbsim_manifest_file *file;
 	struct manifest *manifest;
+	struct interface *intf;
+	int impaired;
+	struct gbsim_link link;
+	TAILQ_ENTRY(gbsim_module) node;
 };
 
-static int gbsim_init(struct controller *ctrl)
+/* A message waiting on an impaired link to be delivered to its module */
+struct gbsim_msg {
+	uint64_t time;
+	uint8_t intf_id;
+	uint16_t cport_id;
+	TAILQ_ENTRY(gbsim_msg) node;
+	uint8_t data[];
+};
+
+struct gbsim_controller {
+	const char *manifest_path;
+	unsigned int count;
+	unsigned int stagger;
+	struct gbsim_impairment impairment;
+	TAILQ_HEAD(gbsim_file_head, gbsim_manifest_file) files;
+	TAILQ_HEAD(gbsim_module_head, gbsim_module) modules;
+
+	/* Delivery queue of the impaired links, sorted by delivery time */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	TAILQ_HEAD(gbsim_msg_head, gbsim_msg) msgs;
+	int delivering;
+	int stop;
+};
+
+/* Modules of every gbsim controller, each -m registering one */
+static unsigned int gbsim_module_count;
+
+static uint64_t gbsim_now(void)
 {
-	/* TODO: check if the manifest is valid here */
-	return 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void gbsim_exit(struct controller * ctrl)
+static int gbsim_impairment_is_set(const struct gbsim_impairment *impairment)
+{
+	return impairment->delay || impairment->jitter || impairment->rate ||
+	       impairment->loss || impairment->reorder;
+}
+
+/* Uniform in [0, 1) */
+static double gbsim_random(unsigned int *seed)
 {
+	return rand_r(seed) / ((double)RAND_MAX + 1);
+}
 
+static int gbsim_random_hit(unsigned int *seed, unsigned int per_million)
+{
+	return per_million && gbsim_random(seed) * PER_MILLION < per_million;
 }
 
-static int manifest_load(struct gbsim_controller *gbsim_ctrl,
-			 struct interface *intf)
+/* Delay of a message, with its jitter, in usecs */
+static uint64_t gbsim_link_delay(struct gbsim_link *link)
 {
-	FILE *f;
-	int ret = 0;
-	uint16_t size, le_size;
-	void *manifest_blob;
+	int i;
+	double jitter;
+	struct gbsim_impairment *impairment = &link->impairment;
+
+	if (!impairment->jitter)
+		return impairment->delay;
+
+	switch (impairment->distribution) {
+	case GBSIM_JITTER_NORMAL:
+		/* Sum of 12 uniforms: close enough to N(0, 1), without libm */
+		jitter = -6;
+		for (i = 0; i < 12; i++)
+			jitter += gbsim_random(&link->seed);
+		break;
+	default:
+		jitter = gbsim_random(&link->seed) * 2 - 1;
+		break;
+	}
+
+	jitter = impairment->delay + jitter * impairment->jitter;
 
-	pr_dbg("Loading the manifest %s\n", gbsim_ctrl->manifest_file);
-	f = fopen(gbsim_ctrl->manifest_file, "r");
-	if (!f) {
-		perror("Failed to open manifest file");
-		return errno;
+	return jitter < 0 ? 0 : (uint64_t)jitter;
+}
+
+static void *gbsim_delivery(void *data)
+{
+	struct timespec ts;
+	struct gbsim_msg *msg;
+	struct gbsim_controller *gbsim_ctrl = data;
+
+	pthread_mutex_lock(&gbsim_ctrl->lock);
+	while (!gbsim_ctrl->stop) {
+		msg = TAILQ_FIRST(&gbsim_ctrl->msgs);
+		if (!msg) {
+			pthread_cond_wait(&gbsim_ctrl->cond, &gbsim_ctrl->lock);
+			continue;
+		}
+
+		if (msg->time > gbsim_now()) {
+			ts.tv_sec = msg->time / 1000000;
+			ts.tv_nsec = (msg->time % 1000000) * 1000;
+			pthread_cond_timedwait(&gbsim_ctrl->cond,
+					       &gbsim_ctrl->lock, &ts);
+			continue;
+		}
+
+		TAILQ_REMOVE(&gbsim_ctrl->msgs, msg, node);
+		pthread_mutex_unlock(&gbsim_ctrl->lock);
+
+		greybus_handler(msg->intf_id, msg->cport_id, (void *)msg->data);
+		free(msg);
+
+		pthread_mutex_lock(&gbsim_ctrl->lock);
 	}
+	pthread_mutex_unlock(&gbsim_ctrl->lock);
 
-	/* Get manifest size to allocate a buffer to store it */
-	if (fread(&le_size, sizeof(le_size), 1, f) != 1) {
-		pr_err("Failed to read manifest size\n");
-		ret = -EINVAL;
-		goto err_close_manifest;
+	return NULL;
+}
+
+static int gbsim_link_send(struct gbsim_controller *gbsim_ctrl,
+			   struct gbsim_module *module, uint16_t cport_id,
+			   void *data, size_t len)
+{
+	uint64_t start;
+	struct gbsim_msg *msg;
+	struct gbsim_msg *prev;
+	struct gbsim_link *link = &module->link;
+
+	msg = malloc(sizeof(*msg) + len);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->intf_id = module->intf->id;
+	msg->cport_id = cport_id;
+	memcpy(msg->data, data, len);
+
+	pthread_mutex_lock(&gbsim_ctrl->lock);
+	if (gbsim_random_hit(&link->seed, link->impairment.loss)) {
+		link->dropped++;
+		pthread_mutex_unlock(&gbsim_ctrl->lock);
+		pr_dbg("gbsim: dropping a message to interface %u\n",
+		       msg->intf_id);
+		free(msg);
+		return 0;
 	}
-	size = le16toh(le_size);
 
-	manifest_blob = malloc(size);
-	if (!manifest_blob) {
-		ret = -ENOMEM;
-		goto err_close_manifest;
+	/* The link sends one message at a time, at its rate */
+	start = gbsim_now();
+	if (start < link->busy_until)
+		start = link->busy_until;
+	link->busy_until = start;
+	if (link->impairment.rate)
+		link->busy_until += (uint64_t)len * 1000000 /
+				    link->impairment.rate;
+	msg->time = link->busy_until;
+
+	/* A reordered message skips the delay, overtaking the others */
+	if (gbsim_random_hit(&link->seed, link->impairment.reorder)) {
+		link->reordered++;
+	} else {
+		msg->time += gbsim_link_delay(link);
+		if (msg->time < link->last_arrival)
+			msg->time = link->last_arrival;
+		link->last_arrival = msg->time;
 	}
+	link->sent++;
 
-	fseek(f, 0, SEEK_SET);
-	if (fread(manifest_blob, 1, size, f) != size) {
-		pr_err("Failed to read manifest\n");
-		ret = -EINVAL;
-		goto err_free_manifest;
+	TAILQ_FOREACH_REVERSE(prev, &gbsim_ctrl->msgs, gbsim_msg_head, node) {
+		if (prev->time <= msg->time)
+			break;
+	}
+	if (prev) {
+		TAILQ_INSERT_AFTER(&gbsim_ctrl->msgs, prev, msg, node);
+	} else {
+		TAILQ_INSERT_HEAD(&gbsim_ctrl->msgs, msg, node);
+		pthread_cond_signal(&gbsim_ctrl->cond);
 	}
+	pthread_mutex_unlock(&gbsim_ctrl->lock);
 
-	gbsim_ctrl->manifest = parse_manifest(manifest_blob, intf->id);
-	if (!gbsim_ctrl->manifest) {
-		pr_err("Failed to parse the manifest");
+	return 0;
+}
+
+static int gbsim_manifest_map(struct gbsim_manifest_file *file)
+{
+	int fd;
+	int ret;
+	void *blob;
+	struct stat st;
+
+	fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		ret = -errno;
+		pr_err("Failed to open the manifest %s: %s\n",
+		       file->path, strerror(-ret));
+		return ret;
+	}
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto err_close;
+	}
+
+	if (!st.st_size) {
+		pr_err("The manifest %s is empty\n", file->path);
 		ret = -EINVAL;
-		goto err_free_manifest;
+		goto err_close;
 	}
 
-	pr_dbg("Manifest loaded\n");
+	blob = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (blob == MAP_FAILED) {
+		ret = -errno;
+		pr_err("Failed to map the manifest %s: %s\n",
+		       file->path, strerror(-ret));
+		goto err_close;
+	}
+	close(fd);
+
+	ret = manifest_check(blob, st.st_size);
+	if (ret) {
+		pr_err("Invalid manifest %s\n", file->path);
+		munmap(blob, st.st_size);
+		return ret;
+	}
+
+	file->blob = blob;
+	file->size = st.st_size;
 
-err_free_manifest:
-	free(manifest_blob);
-err_close_manifest:
-	fclose(f);
+	return 0;
+
+err_close:
+	close(fd);
 
 	return ret;
 }
 
-static int gbsim_hotplug(struct controller * ctrl)
+static void gbsim_manifests_unmap(struct gbsim_controller *gbsim_ctrl)
+{
+	struct gbsim_manifest_file *file;
+
+	TAILQ_FOREACH(file, &gbsim_ctrl->files, node) {
+		if (file->blob)
+			munmap((void *)file->blob, file->size);
+		file->blob = NULL;
+	}
+}
+
+static void gbsim_exit(struct controller *ctrl);
+
+static int gbsim_init(struct controller *ctrl)
+{
+	int ret;
+	pthread_condattr_t attr;
+	struct gbsim_manifest_file *file;
+	struct gbsim_controller *gbsim_ctrl = ctrl->priv;
+
+	/* Reject the malformed manifests before any hotplug */
+	TAILQ_FOREACH(file, &gbsim_ctrl->files, node) {
+		ret = gbsim_manifest_map(file);
+		if (ret)
+			goto err_exit;
+	}
+
+	if (!gbsim_impairment_is_set(&gbsim_ctrl->impairment))
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&gbsim_ctrl->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = pthread_create(&gbsim_ctrl->thread, NULL,
+			     gbsim_delivery, gbsim_ctrl);
+	if (ret) {
+		pthread_cond_destroy(&gbsim_ctrl->cond);
+		ret = -ret;
+		goto err_exit;
+	}
+	gbsim_ctrl->delivering = 1;
+
+	return 0;
+
+err_exit:
+	/* The controller is dropped without a call to its exit() */
+	gbsim_exit(ctrl);
+
+	return ret;
+}
+
+static void gbsim_stop(struct controller *ctrl)
+{
+	struct gbsim_module *module;
+	struct gbsim_controller *gbsim_ctrl = ctrl->priv;
+
+	if (!gbsim_ctrl->delivering)
+		return;
+
+	pthread_mutex_lock(&gbsim_ctrl->lock);
+	gbsim_ctrl->stop = 1;
+	pthread_cond_signal(&gbsim_ctrl->cond);
+	pthread_mutex_unlock(&gbsim_ctrl->lock);
+	pthread_join(gbsim_ctrl->thread, NULL);
+	pthread_cond_destroy(&gbsim_ctrl->cond);
+	gbsim_ctrl->delivering = 0;
+
+	TAILQ_FOREACH(module, &gbsim_ctrl->modules, node) {
+		if (!module->intf)
+			continue;
+		pr_info("gbsim: interface %u: %llu messages sent, "
+			"%llu dropped, %llu reordered\n", module->intf->id,
+			(unsigned long long)module->link.sent,
+			(unsigned long long)module->link.dropped,
+			(unsigned long long)module->link.reordered);
+	}
+}
+
+static void gbsim_exit(struct controller * ctrl)
+{
+	struct gbsim_controller *gbsim_ctrl = ctrl->priv;
+	struct gbsim_manifest_file *file;
+	struct gbsim_module *module;
+	struct gbsim_msg *msg;
+
+	while ((msg = TAILQ_FIRST(&gbsim_ctrl->msgs))) {
+		TAILQ_REMOVE(&gbsim_ctrl->msgs, msg, node);
+		free(msg);
+	}
+
+	while ((module = TAILQ_FIRST(&gbsim_ctrl->modules))) {
+		TAILQ_REMOVE(&gbsim_ctrl->modules, module, node);
+		/* The drivers went away with the interface */
+		if (module->manifest)
+			manifest_free(module->manifest);
+		free(module);
+	}
+
+	gbsim_manifests_unmap(gbsim_ctrl);
+	while ((file = TAILQ_FIRST(&gbsim_ctrl->files))) {
+		TAILQ_REMOVE(&gbsim_ctrl->files, file, node);
+		free(file->path);
+		free(file);
+	}
+
+	pthread_mutex_destroy(&gbsim_ctrl->lock);
+}
+
+static int manifest_load(struct gbsim_module *module,
+			 struct interface *intf)
+{
+	pr_dbg("Loading the manifest %s\n", module->file->path);
+
+	/* The manifest has been checked, and its mapping is shared */
+	module->manifest = parse_manifest(module->file->blob, intf->id);
+	if (!module->manifest) {
+		pr_err("Failed to parse the manifest\n");
+		return -ENOMEM;
+	}
+
+	pr_dbg("Manifest loaded\n");
+
+	return 0;
+}
+
+static int gbsim_module_hotplug(struct controller *ctrl,
+				struct gbsim_module *module, unsigned int index)
 {
 	int ret = 0;
 	struct interface *intf;
-	struct gbsim_controller *gbsim_ctrl = ctrl->priv;
 
-	/* FIXME: use real IDs */
-	intf = interface_create(ctrl, 1, 1, 0x1234, NULL);
+	intf = interface_create(ctrl, GBSIM_VENDOR_ID, GBSIM_PRODUCT_ID,
+				GBSIM_SERIAL_ID + index, module);
 	if (!intf) {
 		pr_err("Failed to create GBSIM interface\n");
 		return -ENOMEM;
 	}
 
-	ret = manifest_load(gbsim_ctrl, intf);
+	ret = manifest_load(module, intf);
 	if (ret < 0)
 		goto err_interface_destroy;
 
+	/* Seed with the interface id, so the runs can be reproduced */
+	module->intf = intf;
+	module->link.seed = intf->id;
+
 	ret = control_register_driver(intf->id);
 	if (ret < 0)
 		goto err_manifest_free;
@@ -124,16 +467,52 @@ static int gbsim_hotplug(struct controller * ctrl)
 err_unregister_driver:
 	control_unregister_driver(intf->id);
 err_manifest_free:
-	manifest_free(gbsim_ctrl->manifest);
+	manifest_free(module->manifest);
+	module->manifest = NULL;
 err_interface_destroy:
+	module->intf = NULL;
 	interface_destroy(intf);
 
 	return ret;
 }
 
+static int gbsim_hotplug(struct controller * ctrl)
+{
+	int ret;
+	int state;
+	unsigned int index = 0;
+	struct gbsim_module *module;
+	struct gbsim_controller *gbsim_ctrl = ctrl->priv;
+
+	TAILQ_FOREACH(module, &gbsim_ctrl->modules, node) {
+		if (index && gbsim_ctrl->stagger)
+			usleep(gbsim_ctrl->stagger * 1000);
+
+		/* Don't leave a module half plugged when exiting */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		ret = gbsim_module_hotplug(ctrl, module, index);
+		pthread_setcancelstate(state, NULL);
+		if (ret) {
+			pr_err("Failed to hotplug the module %u (%s)\n",
+			       index, module->file->path);
+			return ret;
+		}
+		index++;
+	}
+
+	pr_info("gbsim: %u modules plugged\n", index);
+
+	return 0;
+}
+
 static int gbsim_write(struct connection * conn, void *data, size_t len)
 {
 	int ret;
+	struct gbsim_module *module = conn->intf2->priv;
+
+	if (module->impaired)
+		return gbsim_link_send(conn->intf2->ctrl->priv, module,
+				       conn->cport2_id, data, len);
 
 	ret = greybus_handler(conn->intf2->id, conn->cport2_id, data);
 	if (ret)
@@ -142,24 +521,177 @@ static int gbsim_write(struct connection * conn, void *data, size_t len)
 	return 0;
 }
 
+static int gbsim_connection_create(struct connection *conn)
+{
+	return manifest_connect_cport(conn->intf2->id, conn->cport2_id);
+}
+
 struct controller gbsim_controller = {
 	.name = "gbsim",
 	.init = gbsim_init,
 	.exit = gbsim_exit,
+	.connection_create = gbsim_connection_create,
 	.write = gbsim_write,
 	.event_loop = gbsim_hotplug,
+	.event_loop_stop = gbsim_stop,
 };
 
-int register_gbsim_controller(const char *manifest_file)
+static int gbsim_add_modules(struct gbsim_controller *gbsim_ctrl,
+			     const char *manifest_file)
 {
+	unsigned int i;
+	struct gbsim_module *module;
+	struct gbsim_manifest_file *file;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return -ENOMEM;
+
+	file->path = strdup(manifest_file);
+	if (!file->path) {
+		free(file);
+		return -ENOMEM;
+	}
+	TAILQ_INSERT_TAIL(&gbsim_ctrl->files, file, node);
+
+	for (i = 0; i < gbsim_ctrl->count; i++) {
+		module = calloc(1, sizeof(*module));
+		if (!module)
+			return -ENOMEM;
+
+		module->file = file;
+		module->link.impairment = gbsim_ctrl->impairment;
+		module->impaired =
+			gbsim_impairment_is_set(&gbsim_ctrl->impairment);
+		TAILQ_INSERT_TAIL(&gbsim_ctrl->modules, module, node);
+	}
+
+	return 0;
+}
+
+static int manifest_filter(const struct dirent *entry)
+{
+	return entry->d_name[0] != '.';
+}
+
+static int gbsim_add_manifests(struct gbsim_controller *gbsim_ctrl)
+{
+	int i;
+	int n;
+	int ret = 0;
+	struct stat st;
+	struct dirent **entries;
+	char path[PATH_MAX];
+
+	if (stat(gbsim_ctrl->manifest_path, &st)) {
+		ret = -errno;
+		pr_err("Failed to stat %s: %s\n",
+		       gbsim_ctrl->manifest_path, strerror(-ret));
+		return ret;
+	}
+
+	if (!S_ISDIR(st.st_mode))
+		return gbsim_add_modules(gbsim_ctrl, gbsim_ctrl->manifest_path);
+
+	/* Sort the manifests so the interface ids don't change between runs */
+	n = scandir(gbsim_ctrl->manifest_path, &entries,
+		    manifest_filter, alphasort);
+	if (n < 0) {
+		ret = -errno;
+		pr_err("Failed to read %s: %s\n",
+		       gbsim_ctrl->manifest_path, strerror(-ret));
+		return ret;
+	}
+
+	for (i = 0; i < n; i++) {
+		snprintf(path, sizeof(path), "%s/%s",
+			 gbsim_ctrl->manifest_path, entries[i]->d_name);
+		if (!ret && !stat(path, &st) && S_ISREG(st.st_mode))
+			ret = gbsim_add_modules(gbsim_ctrl, path);
+		free(entries[i]);
+	}
+	free(entries);
+
+	return ret;
+}
+
+/* Parse "key=value[,key=value...]", with the delays in msecs */
+int gbsim_parse_impairment(const char *str,
+			   struct gbsim_impairment *impairment)
+{
+	char key[16];
+	char value[16];
+	double number;
+	int n;
+
+	memset(impairment, 0, sizeof(*impairment));
+	while (*str) {
+		if (sscanf(str, "%15[^=]=%15[^,]%n", key, value, &n) != 2)
+			return -EINVAL;
+		str += n;
+		if (*str == ',')
+			str++;
+
+		if (strcmp(key, "jitter-dist") == 0) {
+			if (strcmp(value, "uniform") == 0)
+				impairment->distribution =
+					GBSIM_JITTER_UNIFORM;
+			else if (strcmp(value, "normal") == 0)
+				impairment->distribution =
+					GBSIM_JITTER_NORMAL;
+			else
+				return -EINVAL;
+			continue;
+		}
+
+		if (sscanf(value, "%lf", &number) != 1 || number < 0)
+			return -EINVAL;
+
+		if (strcmp(key, "delay") == 0)
+			impairment->delay = number * 1000;
+		else if (strcmp(key, "jitter") == 0)
+			impairment->jitter = number * 1000;
+		else if (strcmp(key, "rate") == 0)
+			impairment->rate = number * 1000 / 8;
+		else if (strcmp(key, "loss") == 0 && number <= 100)
+			impairment->loss = number * PER_MILLION / 100;
+		else if (strcmp(key, "reorder") == 0 && number <= 100)
+			impairment->reorder = number * PER_MILLION / 100;
+		else
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+int register_gbsim_controller(const char *manifest_path,
+			      unsigned int count, unsigned int stagger,
+			      const struct gbsim_impairment *impairment)
+{
+	int ret;
+	unsigned int modules = 0;
 	struct controller *ctrl;
+	struct gbsim_module *module;
 	struct gbsim_controller *gbsim_ctrl;
 
 	gbsim_ctrl = malloc(sizeof(*gbsim_ctrl));
 	if (!gbsim_ctrl)
 		return -ENOMEM;
 
-	gbsim_ctrl->manifest_file = manifest_file;
+	gbsim_ctrl->manifest_path = manifest_path;
+	gbsim_ctrl->count = count ? count : 1;
+	gbsim_ctrl->stagger = stagger;
+	if (impairment)
+		gbsim_ctrl->impairment = *impairment;
+	else
+		memset(&gbsim_ctrl->impairment, 0,
+		       sizeof(gbsim_ctrl->impairment));
+	TAILQ_INIT(&gbsim_ctrl->files);
+	TAILQ_INIT(&gbsim_ctrl->modules);
+	TAILQ_INIT(&gbsim_ctrl->msgs);
+	pthread_mutex_init(&gbsim_ctrl->lock, NULL);
+	gbsim_ctrl->delivering = 0;
+	gbsim_ctrl->stop = 0;
 
 	ctrl = malloc(sizeof(*ctrl));
 	if (!ctrl) {
@@ -169,7 +701,30 @@ int register_gbsim_controller(const char *manifest_file)
 
 	memcpy(ctrl, &gbsim_controller, sizeof(*ctrl));
 	ctrl->priv = gbsim_ctrl;
+
+	ret = gbsim_add_manifests(gbsim_ctrl);
+	if (ret)
+		goto err_free_modules;
+
+	TAILQ_FOREACH(module, &gbsim_ctrl->modules, node)
+		modules++;
+	if (!modules || modules > GBSIM_MAX_MODULES - gbsim_module_count) {
+		pr_err("Invalid number of gbsim modules: %u (max %u in total, "
+		       "%u already)\n", modules, GBSIM_MAX_MODULES,
+		       gbsim_module_count);
+		ret = -EINVAL;
+		goto err_free_modules;
+	}
+	gbsim_module_count += modules;
+
 	register_controller(ctrl);
 
 	return 0;
+
+err_free_modules:
+	gbsim_exit(ctrl);
+	free(gbsim_ctrl);
+	free(ctrl);
+
+	return ret;
 }
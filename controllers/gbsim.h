@@ -0,0 +1,73 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2017 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _GBSIM_H_
+#define _GBSIM_H_
+
+#include <config.h>
+#include <debug.h>
+
+enum gbsim_jitter {
+	GBSIM_JITTER_UNIFORM,
+	GBSIM_JITTER_NORMAL,
+};
+
+/*
+ * Impairment of the link between gbridge and a simulated module,
+ * applied to the messages sent to the module. The responses are sent
+ * as soon as the module has handled the request, so delay and jitter
+ * are the round trip ones.
+ * Without reordering, the messages are delivered in order, so a jitter
+ * bigger than the gap between two messages delays the second one too.
+ */
+struct gbsim_impairment {
+	unsigned int delay;		/* usecs */
+	unsigned int jitter;		/* usecs */
+	enum gbsim_jitter distribution;
+	unsigned int rate;		/* bytes per second, 0 for no limit */
+	unsigned int loss;		/* per million */
+	unsigned int reorder;		/* per million */
+};
+
+#ifdef GBSIM
+int register_gbsim_controller(const char *manifest_path,
+			      unsigned int count, unsigned int stagger,
+			      const struct gbsim_impairment *impairment);
+int gbsim_parse_impairment(const char *str,
+			   struct gbsim_impairment *impairment);
+#else
+static inline int register_gbsim_controller(const char *manifest_path,
+					    unsigned int count,
+					    unsigned int stagger,
+					    const struct gbsim_impairment *impairment)
+{
+	pr_err("gbsim support has not been compiled.\n");
+
+	return -1;
+}
+
+static inline int gbsim_parse_impairment(const char *str,
+					 struct gbsim_impairment *impairment)
+{
+	pr_err("gbsim support has not been compiled.\n");
+
+	return -1;
+}
+#endif
+
+#endif /* _GBSIM_H_ */
@@ -0,0 +1,722 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <controllers/loopback_probe.h>
+
+#define PROBE_HIST_BUCKETS	32
+#define PROBE_DEFAULT_SIZE	512
+#define PROBE_DEFAULT_TIMEOUT	1000
+#define PROBE_MAX_SIZE		(GB_NETLINK_MTU - \
+				 sizeof(struct gb_operation_msg_hdr) - \
+				 sizeof(struct gb_loopback_transfer_request))
+#define PROBE_MAX_CONCURRENCY	256
+/* Period of the checks while waiting for the module to show up */
+#define PROBE_POLL_INTERVAL	100000
+/* Consecutive send errors after which a probe gives up */
+#define PROBE_MAX_SEND_ERRORS	5
+
+struct probe_slot {
+	uint16_t id;
+	uint64_t sent;
+};
+
+struct probe_stats {
+	uint64_t sent;
+	uint64_t received;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t corrupted;
+	uint64_t latency_min;
+	uint64_t latency_max;
+	uint64_t latency_sum;
+	/* The bucket i counts the latencies below 2^i usecs */
+	uint64_t hist[PROBE_HIST_BUCKETS];
+};
+
+struct loopback_probe {
+	/* The module cport probed */
+	uint8_t intf_id;
+	uint16_t cport_id;
+	/* The local cport it is connected to */
+	uint16_t local_cport_id;
+
+	uint8_t type;
+	size_t size;
+	unsigned int rate;
+	unsigned int concurrency;
+	uint64_t count;
+	uint64_t timeout;
+
+	/* The request payload, also used to check the transfer responses */
+	void *payload;
+	size_t payload_len;
+
+	pthread_t thread;
+	int started;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct probe_slot *slots;
+	unsigned int outstanding;
+	struct probe_stats stats;
+	uint64_t start;
+	uint64_t end;
+
+	TAILQ_ENTRY(loopback_probe) node;
+};
+
+struct probe_controller {
+	struct interface *intf;
+	/* Read by the probes without their lock */
+	atomic_int stop;
+	uint16_t cport_count;
+	TAILQ_HEAD(probe_head, loopback_probe) probes;
+};
+
+static struct controller *probe_ctrl;
+
+static uint64_t probe_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Must be called with probe->lock held */
+static void probe_wait_until(struct loopback_probe *probe, uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000;
+	ts.tv_nsec = (deadline % 1000000) * 1000;
+	pthread_cond_timedwait(&probe->cond, &probe->lock, &ts);
+}
+
+static const char *probe_type_name(uint8_t type)
+{
+	switch (type) {
+	case GB_LOOPBACK_TYPE_PING:
+		return "ping";
+	case GB_LOOPBACK_TYPE_SINK:
+		return "sink";
+	default:
+		return "transfer";
+	}
+}
+
+static struct loopback_probe *probe_get(uint16_t local_cport_id)
+{
+	struct loopback_probe *probe;
+	struct probe_controller *pctrl = probe_ctrl->priv;
+
+	TAILQ_FOREACH(probe, &pctrl->probes, node) {
+		if (probe->local_cport_id == local_cport_id)
+			return probe;
+	}
+
+	return NULL;
+}
+
+/* Must be called with probe->lock held */
+static void probe_slot_remove(struct loopback_probe *probe, unsigned int i)
+{
+	probe->slots[i] = probe->slots[--probe->outstanding];
+	pthread_cond_broadcast(&probe->cond);
+}
+
+/*
+ * Give up the operations sent for longer than the timeout.
+ * Must be called with probe->lock held, and returns the time at which
+ * the oldest operation left will time out.
+ */
+static uint64_t probe_expire(struct loopback_probe *probe)
+{
+	unsigned int i = 0;
+	uint64_t now = probe_now();
+	uint64_t deadline = now + probe->timeout;
+	struct probe_controller *pctrl = probe_ctrl->priv;
+
+	while (i < probe->outstanding) {
+		if (probe->slots[i].sent + probe->timeout > now) {
+			if (probe->slots[i].sent + probe->timeout < deadline)
+				deadline = probe->slots[i].sent +
+					   probe->timeout;
+			i++;
+			continue;
+		}
+
+		greybus_cancel_request(pctrl->intf->id, probe->local_cport_id,
+				       probe->slots[i].id);
+		probe->stats.timeouts++;
+		probe_slot_remove(probe, i);
+	}
+
+	return deadline;
+}
+
+static void probe_record_latency(struct probe_stats *stats, uint64_t latency)
+{
+	int i = 0;
+
+	if (!stats->received || latency < stats->latency_min)
+		stats->latency_min = latency;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+	stats->latency_sum += latency;
+	stats->received++;
+
+	while (i < PROBE_HIST_BUCKETS - 1 && latency >= (1ULL << i))
+		i++;
+	stats->hist[i]++;
+}
+
+static int probe_check_transfer(struct loopback_probe *probe,
+				struct operation *op)
+{
+	size_t len = gb_operation_msg_size(op->resp);
+	struct gb_loopback_transfer_response *resp;
+	struct gb_loopback_transfer_request *req = probe->payload;
+
+	if (len != sizeof(*op->resp) + probe->payload_len)
+		return -EPROTO;
+
+	resp = operation_to_response(op);
+	if (resp->len != req->len)
+		return -EPROTO;
+
+	return memcmp(resp->data, req->data, probe->size) ? -EPROTO : 0;
+}
+
+static int probe_response(struct operation *op)
+{
+	unsigned int i;
+	uint64_t now = probe_now();
+	uint16_t id = le16toh(op->resp->operation_id);
+	struct loopback_probe *probe;
+
+	probe = probe_get(op->cport_id);
+	if (!probe)
+		return -EINVAL;
+
+	pthread_mutex_lock(&probe->lock);
+	for (i = 0; i < probe->outstanding; i++) {
+		if (probe->slots[i].id == id)
+			break;
+	}
+
+	/* The operation has timed out meanwhile */
+	if (i == probe->outstanding) {
+		pthread_mutex_unlock(&probe->lock);
+		return 0;
+	}
+
+	if (op->resp->result) {
+		probe->stats.errors++;
+	} else if (probe->type == GB_LOOPBACK_TYPE_TRANSFER &&
+		   probe_check_transfer(probe, op)) {
+		probe->stats.corrupted++;
+	} else {
+		probe_record_latency(&probe->stats, now - probe->slots[i].sent);
+	}
+	probe_slot_remove(probe, i);
+	pthread_mutex_unlock(&probe->lock);
+
+	return 0;
+}
+
+static struct operation_handler probe_operations[] = {
+	RESPONSE_HANDLER(GB_LOOPBACK_TYPE_PING, probe_response),
+	RESPONSE_HANDLER(GB_LOOPBACK_TYPE_TRANSFER, probe_response),
+	RESPONSE_HANDLER(GB_LOOPBACK_TYPE_SINK, probe_response),
+};
+
+static struct greybus_driver probe_driver = {
+	.name = "loopback probe",
+	.operations = probe_operations,
+	.count = OPERATION_COUNT(probe_operations),
+};
+
+static void probe_report(struct loopback_probe *probe)
+{
+	int i;
+	uint64_t seen = 0;
+	uint64_t p50 = 0, p90 = 0, p99 = 0;
+	struct probe_stats *stats = &probe->stats;
+	double elapsed = (probe->end - probe->start) / 1000000.0;
+
+	if (elapsed <= 0)
+		elapsed = 1e-6;
+
+	pr_info("probe %u:%u: %s of %zu bytes, %llu sent, %llu received "
+		"in %.2f s (%.0f ops/s, %.1f KiB/s)\n",
+		probe->intf_id, probe->cport_id, probe_type_name(probe->type),
+		probe->size, (unsigned long long)stats->sent,
+		(unsigned long long)stats->received, elapsed,
+		stats->received / elapsed,
+		stats->received * probe->size / elapsed / 1024);
+	pr_info("probe %u:%u: %llu errors, %llu timeouts, %llu corrupted\n",
+		probe->intf_id, probe->cport_id,
+		(unsigned long long)stats->errors,
+		(unsigned long long)stats->timeouts,
+		(unsigned long long)stats->corrupted);
+	if (!stats->received)
+		return;
+
+	/* The percentiles are the upper bounds of their bucket */
+	for (i = 0; i < PROBE_HIST_BUCKETS; i++) {
+		seen += stats->hist[i];
+		if (!p50 && seen * 100 >= stats->received * 50)
+			p50 = 1ULL << i;
+		if (!p90 && seen * 100 >= stats->received * 90)
+			p90 = 1ULL << i;
+		if (!p99 && seen * 100 >= stats->received * 99)
+			p99 = 1ULL << i;
+	}
+
+	pr_info("probe %u:%u: latency (usecs) min %llu avg %llu max %llu, "
+		"p50 < %llu, p90 < %llu, p99 < %llu\n",
+		probe->intf_id, probe->cport_id,
+		(unsigned long long)stats->latency_min,
+		(unsigned long long)(stats->latency_sum / stats->received),
+		(unsigned long long)stats->latency_max,
+		(unsigned long long)p50, (unsigned long long)p90,
+		(unsigned long long)p99);
+
+	for (i = 0; i < PROBE_HIST_BUCKETS; i++) {
+		if (!stats->hist[i])
+			continue;
+		pr_info("probe %u:%u: %10llu - %10llu usecs: %llu\n",
+			probe->intf_id, probe->cport_id,
+			i ? 1ULL << (i - 1) : 0ULL, 1ULL << i,
+			(unsigned long long)stats->hist[i]);
+	}
+}
+
+static int probe_send(struct loopback_probe *probe, uint8_t intf_id)
+{
+	int ret;
+	unsigned int i;
+	uint16_t id;
+	struct operation *op;
+
+	op = greybus_alloc_operation(probe->type, probe->payload,
+				     probe->payload_len);
+	if (!op)
+		return -ENOMEM;
+	id = le16toh(op->req->operation_id);
+
+	/* The response may be handled before greybus_send_request_from() */
+	pthread_mutex_lock(&probe->lock);
+	probe->slots[probe->outstanding].id = id;
+	probe->slots[probe->outstanding].sent = probe_now();
+	probe->outstanding++;
+	probe->stats.sent++;
+	pthread_mutex_unlock(&probe->lock);
+
+	ret = greybus_send_request_from(intf_id, probe->local_cport_id, op);
+	if (ret < 0) {
+		pthread_mutex_lock(&probe->lock);
+		probe->stats.errors++;
+		for (i = 0; i < probe->outstanding; i++) {
+			if (probe->slots[i].id == id) {
+				probe_slot_remove(probe, i);
+				break;
+			}
+		}
+		pthread_mutex_unlock(&probe->lock);
+	}
+
+	return ret;
+}
+
+static void *probe_run(void *data)
+{
+	int ret;
+	int send_errors = 0;
+	uint64_t next;
+	uint64_t deadline;
+	struct loopback_probe *probe = data;
+	struct probe_controller *pctrl = probe_ctrl->priv;
+	uint8_t intf_id = pctrl->intf->id;
+
+	pthread_mutex_lock(&probe->lock);
+	while (!pctrl->stop && !get_interface(probe->intf_id))
+		probe_wait_until(probe, probe_now() + PROBE_POLL_INTERVAL);
+	pthread_mutex_unlock(&probe->lock);
+	if (pctrl->stop)
+		return NULL;
+
+	ret = connection_create(intf_id, probe->local_cport_id,
+				probe->intf_id, probe->cport_id);
+	if (ret) {
+		pr_err("probe %u:%u: failed to connect: %d\n",
+		       probe->intf_id, probe->cport_id, ret);
+		return NULL;
+	}
+	pr_info("probe %u:%u: connected, starting\n",
+		probe->intf_id, probe->cport_id);
+
+	probe->start = probe_now();
+	next = probe->start;
+	while (!probe->count || probe->stats.sent < probe->count) {
+		pthread_mutex_lock(&probe->lock);
+		deadline = probe_expire(probe);
+		while (!pctrl->stop &&
+		       probe->outstanding >= probe->concurrency) {
+			probe_wait_until(probe, deadline);
+			deadline = probe_expire(probe);
+		}
+
+		if (probe->rate) {
+			while (!pctrl->stop && probe_now() < next)
+				probe_wait_until(probe, next);
+			next += 1000000 / probe->rate;
+		}
+		pthread_mutex_unlock(&probe->lock);
+		if (pctrl->stop)
+			break;
+
+		ret = probe_send(probe, intf_id);
+		if (ret >= 0) {
+			send_errors = 0;
+			continue;
+		}
+
+		if (!get_interface(probe->intf_id)) {
+			pr_info("probe %u:%u: interface unplugged, stopping\n",
+				probe->intf_id, probe->cport_id);
+			break;
+		}
+
+		if (++send_errors == PROBE_MAX_SEND_ERRORS) {
+			pr_err("probe %u:%u: failed to send: %d, stopping\n",
+			       probe->intf_id, probe->cport_id, ret);
+			break;
+		}
+
+		/* Give the link some time, rather than failing in a loop */
+		pthread_mutex_lock(&probe->lock);
+		deadline = probe_now() + probe->timeout;
+		while (!pctrl->stop && probe_now() < deadline)
+			probe_wait_until(probe, deadline);
+		pthread_mutex_unlock(&probe->lock);
+	}
+
+	/* Wait for the last responses */
+	pthread_mutex_lock(&probe->lock);
+	while (!pctrl->stop && probe->outstanding)
+		probe_wait_until(probe, probe_expire(probe));
+	probe->end = probe_now();
+	pthread_mutex_unlock(&probe->lock);
+
+	probe_report(probe);
+
+	/* The connection went away with the interface */
+	if (get_interface(probe->intf_id))
+		connection_destroy(intf_id, probe->local_cport_id,
+				   probe->intf_id, probe->cport_id);
+
+	return NULL;
+}
+
+static int probe_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void probe_stop(struct controller *ctrl);
+
+static int probe_start(struct controller *ctrl)
+{
+	int ret;
+	struct loopback_probe *probe, *registered;
+	struct probe_controller *pctrl = ctrl->priv;
+
+	/* The local interface is not a module, so it is not hotplugged */
+	pctrl->intf = interface_create(ctrl, 0, 0, 0, NULL);
+	if (!pctrl->intf) {
+		pr_err("Failed to create the probe interface\n");
+		return -ENOMEM;
+	}
+
+	TAILQ_FOREACH(probe, &pctrl->probes, node) {
+		ret = greybus_register_driver(pctrl->intf->id,
+					      probe->local_cport_id,
+					      &probe_driver);
+		if (ret)
+			goto err_stop;
+
+		ret = pthread_create(&probe->thread, NULL, probe_run, probe);
+		if (ret) {
+			pr_err("probe %u:%u: failed to start\n",
+			       probe->intf_id, probe->cport_id);
+			continue;
+		}
+		probe->started = 1;
+	}
+
+	return 0;
+
+err_stop:
+	probe_stop(ctrl);
+	TAILQ_FOREACH(registered, &pctrl->probes, node) {
+		if (registered == probe)
+			break;
+		greybus_unregister_driver(pctrl->intf->id,
+					  registered->local_cport_id);
+	}
+	interface_destroy(pctrl->intf);
+	pctrl->intf = NULL;
+
+	return ret;
+}
+
+static void probe_stop(struct controller *ctrl)
+{
+	struct loopback_probe *probe;
+	struct probe_controller *pctrl = ctrl->priv;
+
+	pctrl->stop = 1;
+	TAILQ_FOREACH(probe, &pctrl->probes, node) {
+		pthread_mutex_lock(&probe->lock);
+		pthread_cond_broadcast(&probe->cond);
+		pthread_mutex_unlock(&probe->lock);
+	}
+
+	TAILQ_FOREACH(probe, &pctrl->probes, node) {
+		if (probe->started)
+			pthread_join(probe->thread, NULL);
+		probe->started = 0;
+	}
+}
+
+static void probe_exit(struct controller *ctrl)
+{
+	struct loopback_probe *probe;
+	struct probe_controller *pctrl = ctrl->priv;
+
+	while ((probe = TAILQ_FIRST(&pctrl->probes))) {
+		TAILQ_REMOVE(&pctrl->probes, probe, node);
+		pthread_cond_destroy(&probe->cond);
+		pthread_mutex_destroy(&probe->lock);
+		free(probe->slots);
+		free(probe->payload);
+		free(probe);
+	}
+}
+
+/* The messages sent by the modules to the local cports */
+static int probe_write(struct connection *conn, void *data, size_t len)
+{
+	return greybus_handler(conn->intf1->id, conn->cport1_id, data);
+}
+
+struct controller loopback_probe_controller = {
+	.name = "loopback probe",
+	.init = probe_init,
+	.exit = probe_exit,
+	.write = probe_write,
+	.event_loop = probe_start,
+	.event_loop_stop = probe_stop,
+};
+
+static struct controller *probe_ctrl_get(void)
+{
+	struct probe_controller *pctrl;
+
+	if (probe_ctrl)
+		return probe_ctrl;
+
+	pctrl = calloc(1, sizeof(*pctrl));
+	if (!pctrl)
+		return NULL;
+	TAILQ_INIT(&pctrl->probes);
+
+	probe_ctrl = malloc(sizeof(*probe_ctrl));
+	if (!probe_ctrl) {
+		free(pctrl);
+		return NULL;
+	}
+
+	memcpy(probe_ctrl, &loopback_probe_controller, sizeof(*probe_ctrl));
+	probe_ctrl->priv = pctrl;
+	register_controller(probe_ctrl);
+
+	return probe_ctrl;
+}
+
+static int probe_parse(const char *spec, struct loopback_probe *probe)
+{
+	char key[16];
+	char value[16];
+	unsigned int intf_id, cport_id;
+	unsigned long long number;
+	int n;
+
+	if (sscanf(spec, "%u:%u%n", &intf_id, &cport_id, &n) != 2 ||
+	    intf_id == AP_INTF_ID || intf_id > UINT8_MAX ||
+	    cport_id >= GB_NETLINK_NUM_CPORT)
+		return -EINVAL;
+	probe->intf_id = intf_id;
+	probe->cport_id = cport_id;
+	spec += n;
+
+	while (*spec == ',') {
+		spec++;
+		if (sscanf(spec, "%15[^=]=%15[^,]%n", key, value, &n) != 2)
+			return -EINVAL;
+		spec += n;
+
+		if (strcmp(key, "type") == 0) {
+			if (strcmp(value, "ping") == 0)
+				probe->type = GB_LOOPBACK_TYPE_PING;
+			else if (strcmp(value, "transfer") == 0)
+				probe->type = GB_LOOPBACK_TYPE_TRANSFER;
+			else if (strcmp(value, "sink") == 0)
+				probe->type = GB_LOOPBACK_TYPE_SINK;
+			else
+				return -EINVAL;
+			continue;
+		}
+
+		if (sscanf(value, "%llu", &number) != 1)
+			return -EINVAL;
+
+		if (strcmp(key, "size") == 0 && number <= PROBE_MAX_SIZE)
+			probe->size = number;
+		else if (strcmp(key, "rate") == 0 && number <= 1000000)
+			probe->rate = number;
+		else if (strcmp(key, "concurrency") == 0 && number &&
+			 number <= PROBE_MAX_CONCURRENCY)
+			probe->concurrency = number;
+		else if (strcmp(key, "count") == 0)
+			probe->count = number;
+		else if (strcmp(key, "timeout") == 0 && number)
+			probe->timeout = number * 1000;
+		else
+			return -EINVAL;
+	}
+
+	return *spec ? -EINVAL : 0;
+}
+
+static int probe_alloc_payload(struct loopback_probe *probe)
+{
+	size_t i;
+	struct gb_loopback_transfer_request *req;
+
+	if (probe->type == GB_LOOPBACK_TYPE_PING) {
+		probe->size = 0;
+		probe->payload_len = 0;
+		probe->payload = NULL;
+		return 0;
+	}
+
+	probe->payload_len = sizeof(*req) + probe->size;
+	probe->payload = malloc(probe->payload_len);
+	if (!probe->payload)
+		return -ENOMEM;
+
+	req = probe->payload;
+	req->len = htole32(probe->size);
+	req->reserved0 = 0;
+	req->reserved1 = 0;
+	for (i = 0; i < probe->size; i++)
+		req->data[i] = i * 7 + 1;
+
+	return 0;
+}
+
+int register_loopback_probe(const char *spec)
+{
+	int ret;
+	pthread_condattr_t attr;
+	struct controller *ctrl;
+	struct loopback_probe *probe;
+	struct probe_controller *pctrl;
+
+	probe = calloc(1, sizeof(*probe));
+	if (!probe)
+		return -ENOMEM;
+
+	probe->type = GB_LOOPBACK_TYPE_TRANSFER;
+	probe->size = PROBE_DEFAULT_SIZE;
+	probe->concurrency = 1;
+	probe->timeout = PROBE_DEFAULT_TIMEOUT * 1000;
+	ret = probe_parse(spec, probe);
+	if (ret) {
+		pr_err("Invalid loopback probe %s\n", spec);
+		goto err_free_probe;
+	}
+
+	ret = probe_alloc_payload(probe);
+	if (ret)
+		goto err_free_probe;
+
+	probe->slots = calloc(probe->concurrency, sizeof(*probe->slots));
+	if (!probe->slots) {
+		ret = -ENOMEM;
+		goto err_free_payload;
+	}
+
+	ctrl = probe_ctrl_get();
+	if (!ctrl) {
+		ret = -ENOMEM;
+		goto err_free_slots;
+	}
+	pctrl = ctrl->priv;
+
+	/* The local cport 0 is left to the control protocol */
+	probe->local_cport_id = ++pctrl->cport_count;
+	if (probe->local_cport_id >= GB_NETLINK_NUM_CPORT) {
+		pr_err("Too many loopback probes\n");
+		ret = -EINVAL;
+		goto err_free_slots;
+	}
+
+	pthread_mutex_init(&probe->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&probe->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	TAILQ_INSERT_TAIL(&pctrl->probes, probe, node);
+
+	return 0;
+
+err_free_slots:
+	free(probe->slots);
+err_free_payload:
+	free(probe->payload);
+err_free_probe:
+	free(probe);
+
+	return ret;
+}
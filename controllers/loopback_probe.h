@@ -0,0 +1,38 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LOOPBACK_PROBE_H_
+#define _LOOPBACK_PROBE_H_
+
+/*
+ * The loopback probe sends loopback operations from gbridge itself to the
+ * loopback cport of a module, and reports the round trip latency and the
+ * throughput. It owns a local interface, which is not hotplugged, and
+ * connects one of its cports to each cport probed, like the AP would.
+ *
+ * The spec is "intf:cport[,key=value...]", with the keys:
+ * - type: ping, transfer (the default) or sink
+ * - size: the payload size of the transfer and sink operations
+ * - rate: the operations per second, 0 (the default) for no limit
+ * - concurrency: the operations sent without waiting for their response
+ * - count: the operations to send, 0 (the default) to run until exit
+ * - timeout: the msecs after which an operation is considered lost
+ */
+int register_loopback_probe(const char *spec);
+
+#endif /* _LOOPBACK_PROBE_H_ */
@@ -0,0 +1,571 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <framing.h>
+#include <controllers/shm.h>
+
+#define SHM_RING_SIZE		(64 * 1024)
+#define SHM_CONNECT_RETRIES	10
+/*
+ * The module doesn't report its IDs: the path of its socket, given with
+ * -s, tells it apart (see shm_hotplug())
+ */
+#define SHM_VENDOR_ID		1
+#define SHM_PRODUCT_ID		1
+/* In ms, how long a writer waits for the module to make room in the ring */
+#define SHM_PUSH_TIMEOUT	1000
+
+#define SHM_ALIGN(len)		(((len) + 7) & ~7)
+
+struct controller shm_controller;
+
+struct shm_ring_desc {
+	struct shm_ring *ring;
+	/* ring->size is shared with the module, so it can't be trusted */
+	uint32_t size;
+	int efd;
+	/* Notified by the consumer, once full is set */
+	int room_efd;
+};
+
+struct shm_connection {
+	void *mem;
+	size_t mem_size;
+	int memfd;
+	pthread_mutex_t tx_lock;
+	struct shm_ring_desc tx;
+	struct shm_ring_desc rx;
+};
+
+struct shm_device {
+	int sock;
+};
+
+struct shm_controller {
+	const char *socket_path;
+};
+
+static int shm_busy_poll_us;
+
+void shm_set_busy_poll(int usecs)
+{
+	shm_busy_poll_us = usecs;
+}
+
+static size_t shm_ring_mem_size(uint32_t size)
+{
+	return sizeof(struct shm_ring) + size;
+}
+
+static void shm_ring_init(struct shm_ring *ring, uint32_t size)
+{
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->waiting, 0);
+	atomic_init(&ring->full, 0);
+	ring->size = size;
+}
+
+static uint64_t shm_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Wait for the consumer to make room in the ring, until deadline */
+static int shm_ring_room_wait(struct shm_ring_desc *desc, uint64_t deadline)
+{
+	int ret;
+	uint64_t now;
+	uint64_t value;
+	struct pollfd pfd;
+
+	now = shm_now_us();
+	if (now >= deadline)
+		return -ETIMEDOUT;
+
+	pfd.fd = desc->room_efd;
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, (deadline - now + 999) / 1000);
+	if (ret < 0)
+		return errno == EINTR ? 0 : -errno;
+	if (ret == 0)
+		return -ETIMEDOUT;
+
+	if (read(desc->room_efd, &value, sizeof(value)) < 0 && errno != EINTR)
+		return -errno;
+
+	return 0;
+}
+
+static int shm_ring_push(struct shm_ring_desc *desc, void *data, size_t len)
+{
+	int ret;
+	struct shm_ring *ring = desc->ring;
+	uint32_t size = desc->size;
+	uint32_t head, tail, pos, contiguous, need;
+	uint64_t deadline = 0;
+	uint64_t one = 1;
+
+	need = SHM_ALIGN(sizeof(uint32_t) + len);
+	if (need > size / 2)
+		return -EMSGSIZE;
+
+	while (1) {
+		head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		tail = atomic_load(&ring->tail);
+		pos = head % size;
+		contiguous = size - pos;
+
+		if (contiguous < need) {
+			if (size - (head - tail) < contiguous + need)
+				goto full;
+			*(uint32_t *)&ring->data[pos] = SHM_RING_WRAP;
+			head += contiguous;
+			pos = 0;
+		} else if (size - (head - tail) < need) {
+			goto full;
+		}
+
+		*(uint32_t *)&ring->data[pos] = len;
+		memcpy(&ring->data[pos + sizeof(uint32_t)], data, len);
+		atomic_store(&ring->head, head + need);
+		break;
+full:
+		/* Pairs with the consumer checking full once it moved tail */
+		if (!deadline) {
+			deadline = shm_now_us() + SHM_PUSH_TIMEOUT * 1000;
+			atomic_store(&ring->full, 1);
+			continue;
+		}
+
+		ret = shm_ring_room_wait(desc, deadline);
+		if (ret) {
+			atomic_store(&ring->full, 0);
+			pr_err("The shared memory ring is still full: %d\n",
+			       ret);
+			return ret;
+		}
+	}
+
+	if (deadline)
+		atomic_store(&ring->full, 0);
+
+	/* Pairs with the consumer setting waiting before to sleep */
+	if (atomic_load(&ring->waiting)) {
+		if (write(desc->efd, &one, sizeof(one)) != sizeof(one))
+			return -errno;
+	}
+
+	return len;
+}
+
+static int shm_ring_empty(struct shm_ring *ring)
+{
+	return atomic_load(&ring->head) ==
+		atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+static int shm_ring_wait(struct shm_connection *sconn)
+{
+	int ret;
+	uint64_t value;
+	uint64_t deadline;
+	struct shm_ring *ring = sconn->rx.ring;
+
+	if (shm_busy_poll_us) {
+		deadline = shm_now_us() + shm_busy_poll_us;
+		do {
+			if (!shm_ring_empty(ring))
+				return 0;
+		} while (shm_now_us() < deadline);
+	}
+
+	while (shm_ring_empty(ring)) {
+		atomic_store(&ring->waiting, 1);
+		if (shm_ring_empty(ring)) {
+			ret = read(sconn->rx.efd, &value, sizeof(value));
+			if (ret < 0 && errno != EINTR) {
+				atomic_store(&ring->waiting, 0);
+				pr_err("Failed to wait for the ring: %d\n", -errno);
+				return -ENOTCONN;
+			}
+		}
+		atomic_store(&ring->waiting, 0);
+	}
+
+	return 0;
+}
+
+static int shm_ring_pop(struct shm_connection *sconn, void *data, size_t len)
+{
+	int ret;
+	struct shm_ring *ring = sconn->rx.ring;
+	uint32_t size = sconn->rx.size;
+	uint32_t tail, pos, msg_len;
+	uint64_t one = 1;
+
+	while (1) {
+		ret = shm_ring_wait(sconn);
+		if (ret)
+			return ret;
+
+		tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		pos = tail % size;
+		msg_len = *(uint32_t *)&ring->data[pos];
+		if (msg_len != SHM_RING_WRAP)
+			break;
+
+		atomic_store_explicit(&ring->tail, tail + size - pos,
+				      memory_order_release);
+	}
+
+	if (msg_len > size - pos - sizeof(uint32_t)) {
+		pr_err("Invalid message length in the ring: %u\n", msg_len);
+		return -EPROTO;
+	}
+
+	if (msg_len > len) {
+		pr_err("Message to big\n");
+		ret = -EMSGSIZE;
+	} else {
+		memcpy(data, &ring->data[pos + sizeof(uint32_t)], msg_len);
+		ret = msg_len;
+	}
+
+	/* Pairs with the producer setting full before to check the ring */
+	atomic_store(&ring->tail, tail + SHM_ALIGN(sizeof(uint32_t) + msg_len));
+	if (atomic_load(&ring->full) &&
+	    write(sconn->rx.room_efd, &one, sizeof(one)) != sizeof(one))
+		pr_err("Failed to notify the module of room in the ring\n");
+
+	return ret;
+}
+
+static int shm_send_msg(int sock, struct shm_msg *msg, int *fds, int nfds)
+{
+	struct msghdr msgh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * SHM_MSG_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(*msg);
+
+	memset(&msgh, 0, sizeof(msgh));
+	msgh.msg_iov = &iov;
+	msgh.msg_iovlen = 1;
+
+	if (nfds) {
+		msgh.msg_control = control.buf;
+		msgh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msgh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	if (sendmsg(sock, &msgh, MSG_NOSIGNAL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int shm_connection_create(struct connection *conn)
+{
+	int ret;
+	int fds[SHM_MSG_MAX_FDS];
+	struct shm_msg msg;
+	struct shm_connection *sconn;
+	struct shm_device *sd = conn->intf2->priv;
+	size_t ring_mem_size = shm_ring_mem_size(SHM_RING_SIZE);
+
+	sconn = malloc(sizeof(*sconn));
+	if (!sconn)
+		return -ENOMEM;
+
+	sconn->mem_size = 2 * ring_mem_size;
+	pthread_mutex_init(&sconn->tx_lock, NULL);
+
+	sconn->memfd = memfd_create("gbridge-shm", MFD_CLOEXEC);
+	if (sconn->memfd < 0) {
+		ret = -errno;
+		goto err_free_sconn;
+	}
+
+	if (ftruncate(sconn->memfd, sconn->mem_size)) {
+		ret = -errno;
+		goto err_close_memfd;
+	}
+
+	sconn->mem = mmap(NULL, sconn->mem_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED, sconn->memfd, 0);
+	if (sconn->mem == MAP_FAILED) {
+		ret = -errno;
+		goto err_close_memfd;
+	}
+
+	sconn->tx.ring = sconn->mem;
+	sconn->rx.ring = (struct shm_ring *)((uint8_t *)sconn->mem +
+					     ring_mem_size);
+	shm_ring_init(sconn->tx.ring, SHM_RING_SIZE);
+	shm_ring_init(sconn->rx.ring, SHM_RING_SIZE);
+	sconn->tx.size = SHM_RING_SIZE;
+	sconn->rx.size = SHM_RING_SIZE;
+
+	sconn->tx.efd = eventfd(0, EFD_CLOEXEC);
+	if (sconn->tx.efd < 0) {
+		ret = -errno;
+		goto err_munmap;
+	}
+
+	sconn->rx.efd = eventfd(0, EFD_CLOEXEC);
+	if (sconn->rx.efd < 0) {
+		ret = -errno;
+		goto err_close_tx_efd;
+	}
+
+	sconn->tx.room_efd = eventfd(0, EFD_CLOEXEC);
+	if (sconn->tx.room_efd < 0) {
+		ret = -errno;
+		goto err_close_rx_efd;
+	}
+
+	sconn->rx.room_efd = eventfd(0, EFD_CLOEXEC);
+	if (sconn->rx.room_efd < 0) {
+		ret = -errno;
+		goto err_close_tx_room_efd;
+	}
+
+	msg.type = SHM_MSG_CONN_CREATE;
+	msg.pad = 0;
+	msg.cport_id = conn->cport2_id;
+	msg.ring_size = SHM_RING_SIZE;
+	fds[0] = sconn->memfd;
+	fds[1] = sconn->tx.efd;
+	fds[2] = sconn->rx.efd;
+	fds[3] = sconn->tx.room_efd;
+	fds[4] = sconn->rx.room_efd;
+	ret = shm_send_msg(sd->sock, &msg, fds, SHM_MSG_MAX_FDS);
+	if (ret) {
+		pr_err("Failed to send the rings to the module: %d\n", ret);
+		goto err_close_rx_room_efd;
+	}
+
+	conn->priv = sconn;
+
+	return 0;
+
+err_close_rx_room_efd:
+	close(sconn->rx.room_efd);
+err_close_tx_room_efd:
+	close(sconn->tx.room_efd);
+err_close_rx_efd:
+	close(sconn->rx.efd);
+err_close_tx_efd:
+	close(sconn->tx.efd);
+err_munmap:
+	munmap(sconn->mem, sconn->mem_size);
+err_close_memfd:
+	close(sconn->memfd);
+err_free_sconn:
+	free(sconn);
+
+	return ret;
+}
+
+static int shm_connection_destroy(struct connection *conn)
+{
+	struct shm_msg msg;
+	struct shm_connection *sconn = conn->priv;
+	struct shm_device *sd = conn->intf2->priv;
+
+	msg.type = SHM_MSG_CONN_DESTROY;
+	msg.pad = 0;
+	msg.cport_id = conn->cport2_id;
+	msg.ring_size = 0;
+	shm_send_msg(sd->sock, &msg, NULL, 0);
+
+	conn->priv = NULL;
+	close(sconn->rx.room_efd);
+	close(sconn->tx.room_efd);
+	close(sconn->rx.efd);
+	close(sconn->tx.efd);
+	munmap(sconn->mem, sconn->mem_size);
+	close(sconn->memfd);
+	pthread_mutex_destroy(&sconn->tx_lock);
+	free(sconn);
+
+	return 0;
+}
+
+static int shm_write(struct connection *conn, void *data, size_t len)
+{
+	int ret;
+	struct shm_connection *sconn = conn->priv;
+
+	/* The ring has a single producer but many threads may write */
+	pthread_mutex_lock(&sconn->tx_lock);
+	ret = shm_ring_push(&sconn->tx, data, len);
+	pthread_mutex_unlock(&sconn->tx_lock);
+
+	return ret;
+}
+
+static int shm_read(struct connection *conn, void *data, size_t len)
+{
+	return shm_ring_pop(conn->priv, data, len);
+}
+
+static int shm_hotplug(struct controller *ctrl)
+{
+	int ret;
+	int retries = SHM_CONNECT_RETRIES;
+	struct sockaddr_un addr;
+	struct shm_device *sd;
+	struct interface *intf;
+	struct shm_controller *shm_ctrl = ctrl->priv;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, shm_ctrl->socket_path,
+		sizeof(addr.sun_path) - 1);
+
+	sd = malloc(sizeof(*sd));
+	if (!sd)
+		return -ENOMEM;
+
+	sd->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sd->sock < 0) {
+		ret = -errno;
+		goto err_free_sd;
+	}
+
+	pr_info("Trying to connect to module at %s\n", addr.sun_path);
+	do {
+		ret = connect(sd->sock, (struct sockaddr *)&addr, sizeof(addr));
+		if (ret && retries-- == 0) {
+			ret = -errno;
+			pr_err("Failed to connect to %s: %d\n",
+			       addr.sun_path, ret);
+			goto err_close_sock;
+		}
+		if (ret)
+			sleep(1);
+	} while (ret);
+
+	intf = interface_create(ctrl, SHM_VENDOR_ID, SHM_PRODUCT_ID,
+				crc32c(0, addr.sun_path,
+				       strlen(addr.sun_path)), sd);
+	if (!intf) {
+		ret = -ENOMEM;
+		goto err_close_sock;
+	}
+
+	ret = interface_hotplug(intf);
+	if (ret < 0) {
+		interface_destroy(intf);
+		return ret;
+	}
+
+	return 0;
+
+err_close_sock:
+	close(sd->sock);
+err_free_sd:
+	free(sd);
+
+	return ret;
+}
+
+static void shm_interface_destroy(struct interface *intf)
+{
+	struct shm_device *sd = intf->priv;
+
+	close(sd->sock);
+	free(sd);
+}
+
+static int shm_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void shm_exit(struct controller *ctrl)
+{
+	free(ctrl->priv);
+}
+
+struct controller shm_controller = {
+	.name = "shm",
+	.init = shm_init,
+	.exit = shm_exit,
+	.event_loop = shm_hotplug,
+	.connection_create = shm_connection_create,
+	.connection_destroy = shm_connection_destroy,
+	.write = shm_write,
+	.read = shm_read,
+	.interface_destroy = shm_interface_destroy,
+};
+
+int register_shm_controller(const char *socket_path)
+{
+	struct controller *ctrl;
+	struct shm_controller *shm_ctrl;
+
+	shm_ctrl = malloc(sizeof(*shm_ctrl));
+	if (!shm_ctrl)
+		return -ENOMEM;
+
+	shm_ctrl->socket_path = socket_path;
+
+	ctrl = malloc(sizeof(*ctrl));
+	if (!ctrl) {
+		free(shm_ctrl);
+		return -ENOMEM;
+	}
+
+	memcpy(ctrl, &shm_controller, sizeof(*ctrl));
+	ctrl->priv = shm_ctrl;
+	register_controller(ctrl);
+
+	return 0;
+}
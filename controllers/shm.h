@@ -0,0 +1,95 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+#include <config.h>
+#include <debug.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Shared memory transport
+ *
+ * The module listens on a SOCK_SEQPACKET unix socket.
+ * For each connection, gbridge sends a struct shm_msg with five file
+ * descriptors attached (SCM_RIGHTS):
+ * - a memfd holding two rings, gbridge to module first, then module
+ *   to gbridge; each one is sizeof(struct shm_ring) + ring_size long,
+ * - the eventfd used to notify the module,
+ * - the eventfd used to notify gbridge,
+ * - the eventfd used by the module to notify gbridge of room in the
+ *   gbridge to module ring,
+ * - the eventfd used by gbridge to notify the module of room in the
+ *   module to gbridge ring.
+ *
+ * A ring has one producer and one consumer.
+ * head and tail are free running indexes, only written by the producer
+ * and the consumer respectively. Each message is stored as a 32 bits length
+ * followed by the message, aligned on 8 bytes. If a message doesn't fit
+ * before the end of the ring, SHM_RING_WRAP is written as length and the
+ * message is stored at the beginning of the ring.
+ * A consumer that is going to sleep sets waiting before to check the ring
+ * one last time. The producer only rings the doorbell when waiting is set.
+ * Likewise, a producer that finds the ring full sets full before to check
+ * it one last time, and the consumer only notifies it of room, once it has
+ * moved tail, when full is set. The producer gives up after a timeout.
+ */
+
+#define SHM_MSG_CONN_CREATE	0x01
+#define SHM_MSG_CONN_DESTROY	0x02
+
+#define SHM_MSG_MAX_FDS		5
+
+#define SHM_RING_WRAP		0xffffffff
+#define SHM_CACHELINE_SIZE	64
+
+struct shm_msg {
+	uint8_t type;
+	uint8_t pad;
+	uint16_t cport_id;
+	uint32_t ring_size;
+};
+
+struct shm_ring {
+	_Atomic uint32_t head __attribute__((aligned(SHM_CACHELINE_SIZE)));
+	_Atomic uint32_t tail __attribute__((aligned(SHM_CACHELINE_SIZE)));
+	_Atomic uint32_t waiting __attribute__((aligned(SHM_CACHELINE_SIZE)));
+	_Atomic uint32_t full __attribute__((aligned(SHM_CACHELINE_SIZE)));
+	uint32_t size;
+	uint8_t data[] __attribute__((aligned(SHM_CACHELINE_SIZE)));
+};
+
+#ifdef HAVE_SHM
+int register_shm_controller(const char *socket_path);
+void shm_set_busy_poll(int usecs);
+#else
+static inline int register_shm_controller(const char *socket_path)
+{
+	pr_err("Shared memory support has not been compiled.\n");
+
+	return -1;
+}
+
+static inline void shm_set_busy_poll(int usecs)
+{
+}
+#endif
+
+#endif /* _SHM_H_ */
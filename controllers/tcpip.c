@@ -17,11 +17,16 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -35,32 +40,124 @@
 #include <debug.h>
 #include <gbridge.h>
 #include <controller.h>
+#include <compress.h>
+#include <controllers/tcpip.h>
+
+/* Number of connection attempts for a module only known from the cache */
+#define TCPIP_CACHE_RETRIES	3
+
+/* Serial number of the modules that don't publish one */
+#define TCPIP_DEFAULT_SERIAL_ID	0x1234
+
+#define TCPIP_RX_BUF_SIZE	(4 * GB_NETLINK_MTU)
 
 struct tcpip_connection {
 	int sock;
+	size_t rx_start;
+	size_t rx_end;
+	uint8_t rx_buf[TCPIP_RX_BUF_SIZE];
+};
+
+/*
+ * Module identity, as published in the TXT record of the module.
+ * A non zero entry in ports overrides the default port (port + cport id)
+ * used to connect the cport.
+ */
+struct tcpip_ids {
+	uint32_t vendor_id;
+	uint32_t product_id;
+	uint64_t serial_id;
+	uint16_t ports[GB_NETLINK_NUM_CPORT];
+	int compress;
+	uint32_t manifest_crc;
 };
 
 struct tcpip_device {
+	/*
+	 * The avahi service, NULL for a module listed or only known from
+	 * the cache. Only the modules discovered by avahi are cached.
+	 */
+	char *name;
+	/* Set with name, but read by the connections without the lock */
+	atomic_int discovered;
 	char *host_name;
 	char addr[AVAHI_ADDRESS_STR_MAX];
 	int port;
+	int retries;
+	struct tcpip_ids ids;
 };
 
 struct tcpip_controller {
 	AvahiClient *client;
 	AvahiSimplePoll *simple_poll;
+	const char *config_file;
+	const char *cache_file;
+	/* The cache is replayed by its thread, while avahi browses */
+	pthread_t cache_thread;
+	int cache_run;
+	/* Protect the interfaces, walked by the avahi callbacks too */
+	pthread_mutex_t lock;
 };
 
+static const char *tcpip_config_file;
+static const char *tcpip_cache_file;
+
+int tcpip_set_config_file(const char *file_name)
+{
+	tcpip_config_file = file_name;
+
+	return 0;
+}
+
+int tcpip_set_cache_file(const char *file_name)
+{
+	tcpip_cache_file = file_name;
+
+	return 0;
+}
+
+/*
+ * A module only known from the cache is gone if it can't be reached: drop
+ * it, so avahi can hotplug it again once it is back, maybe elsewhere.
+ * The lock is held by the unplug thread while it waits for the connection.
+ */
+static void tcpip_cache_drop(struct interface *intf)
+{
+	struct tcpip_device *td = intf->priv;
+
+	if (td->retries < 0 || atomic_load(&td->discovered))
+		return;
+
+	pr_info("Dropping cached module at %s:%d\n", td->addr, td->port);
+	interface_unplug_queue(intf);
+}
+
 static int tcpip_connection_create(struct connection *conn)
 {
 	int ret;
+	int port;
+	int retries;
 	struct sockaddr_in serv_addr;
 	struct tcpip_connection *tconn;
 	struct tcpip_device *td = conn->intf2->priv;
 
+	if (conn->cport2_id >= GB_NETLINK_NUM_CPORT)
+		return -EINVAL;
+
+	port = td->ids.ports[conn->cport2_id];
+	if (!port)
+		port = td->port + conn->cport2_id;
+
 	tconn = malloc(sizeof(*tconn));
 	if (!tconn)
 		return -ENOMEM;
+	tconn->rx_start = 0;
+	tconn->rx_end = 0;
+
+#ifdef HAVE_LIBLZ4
+	/* The module has advertised it */
+	conn->compress = td->ids.compress ? COMPRESS_ON : COMPRESS_OFF;
+#endif
 
 	tconn->sock = socket(AF_INET, SOCK_STREAM, 0);
 	if (tconn->sock < 0) {
@@ -71,14 +168,26 @@ static int tcpip_connection_create(struct connection *conn)
 
 	memset(&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(td->port + conn->cport2_id);
+	serv_addr.sin_port = htons(port);
 	serv_addr.sin_addr.s_addr = inet_addr(td->addr);
 
-	pr_info("Trying to connect to module at %s:%d\n", td->addr, td->port);
+	pr_info("Trying to connect to module at %s:%d\n", td->addr, port);
+	retries = td->retries;
 	do {
 		ret = connect(tconn->sock,
 			      (struct sockaddr *)&serv_addr,
 			      sizeof(struct sockaddr));
+		/* Give up if the module is unplugged meanwhile */
+		if (ret && (retries-- == 0 || conn->intf2->unplugged)) {
+			pr_err("Failed to connect to module at %s:%d\n",
+			       td->addr, port);
+			conn->priv = NULL;
+			close(tconn->sock);
+			free(tconn);
+			if (!conn->intf2->unplugged)
+				tcpip_cache_drop(conn->intf2);
+			return -ECONNREFUSED;
+		}
 		if (ret)
 			sleep(1);
 	} while (ret);
@@ -98,41 +207,358 @@ static int tcpip_connection_destroy(struct connection *conn)
 	return 0;
 }
 
-static void tcpip_hotplug(struct controller *ctrl, const char *host_name,
-			  const AvahiAddress *address, uint16_t port)
+static struct interface *tcpip_find(struct controller *ctrl,
+				     const char *addr, int port)
+{
+	struct interface *intf;
+	struct tcpip_device *td;
+
+	TAILQ_FOREACH(intf, &ctrl->interfaces, node) {
+		td = intf->priv;
+		if (td->port == port && strcmp(td->addr, addr) == 0)
+			return intf;
+	}
+
+	return NULL;
+}
+
+static struct interface *tcpip_find_service(struct controller *ctrl,
+					    const char *name)
 {
 	struct interface *intf;
 	struct tcpip_device *td;
 
+	TAILQ_FOREACH(intf, &ctrl->interfaces, node) {
+		td = intf->priv;
+		if (td->name && strcmp(td->name, name) == 0)
+			return intf;
+	}
+
+	return NULL;
+}
+
+static void tcpip_ids_init(struct tcpip_ids *ids)
+{
+	memset(ids, 0, sizeof(*ids));
+
+	/* For the modules that don't publish their IDs in the TXT record */
+	ids->vendor_id = 1;
+	ids->product_id = 1;
+	ids->serial_id = TCPIP_DEFAULT_SERIAL_ID;
+}
+
+/*
+ * Parse a cport map, formatted as a comma separated list of cport:port,
+ * e.g. "1:4243,2:4250". "-" stands for an empty map.
+ */
+static int tcpip_parse_cport_map(const char *map, uint16_t *ports)
+{
+	unsigned int cport_id, port;
+	int n;
+
+	if (strcmp(map, "-") == 0)
+		return 0;
+
+	while (*map) {
+		if (sscanf(map, "%u:%u%n", &cport_id, &port, &n) != 2)
+			return -EINVAL;
+		if (cport_id >= GB_NETLINK_NUM_CPORT || port > UINT16_MAX)
+			return -EINVAL;
+		ports[cport_id] = port;
+
+		map += n;
+		if (*map == ',')
+			map++;
+		else if (*map)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void tcpip_print_cport_map(FILE *f, uint16_t *ports)
+{
+	int i;
+	int empty = 1;
+
+	for (i = 0; i < GB_NETLINK_NUM_CPORT; i++) {
+		if (!ports[i])
+			continue;
+		fprintf(f, "%s%d:%u", empty ? "" : ",", i, ports[i]);
+		empty = 0;
+	}
+
+	if (empty)
+		fprintf(f, "-");
+}
+
+/*
+ * The TXT record may provide the following keys:
+ * vendor, product, serial: the module IDs, reported in hotplug event
+ * cports: the cport map (see tcpip_parse_cport_map)
+ * compression: "lz4" if the module accepts compressed messages
+ * manifest: the CRC32C of the manifest, in hex (see manifest_cache.h)
+ */
+static void tcpip_parse_txt(AvahiStringList *txt, struct tcpip_ids *ids)
+{
+	AvahiStringList *l;
+	char *key, *value;
+
+	for (l = txt; l; l = avahi_string_list_get_next(l)) {
+		if (avahi_string_list_get_pair(l, &key, &value, NULL) < 0)
+			continue;
+		if (!value) {
+			avahi_free(key);
+			continue;
+		}
+
+		if (strcmp(key, "vendor") == 0)
+			ids->vendor_id = strtoul(value, NULL, 0);
+		else if (strcmp(key, "product") == 0)
+			ids->product_id = strtoul(value, NULL, 0);
+		else if (strcmp(key, "serial") == 0)
+			ids->serial_id = strtoull(value, NULL, 0);
+		else if (strcmp(key, "cports") == 0 &&
+			 tcpip_parse_cport_map(value, ids->ports))
+			pr_err("Invalid cport map: %s\n", value);
+		else if (strcmp(key, "compression") == 0)
+			ids->compress = strcmp(value, "lz4") == 0;
+		else if (strcmp(key, "manifest") == 0)
+			ids->manifest_crc = strtoul(value, NULL, 16);
+
+		avahi_free(key);
+		avahi_free(value);
+	}
+}
+
+/* Called locked */
+static void tcpip_cache_save(struct controller *ctrl)
+{
+	FILE *f;
+	char tmp_file[PATH_MAX];
+	struct interface *intf;
+	struct tcpip_device *td;
+	struct tcpip_controller *tcpip_ctrl = ctrl->priv;
+
+	if (!tcpip_ctrl->cache_file)
+		return;
+
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", tcpip_ctrl->cache_file);
+	f = fopen(tmp_file, "w");
+	if (!f) {
+		perror("Failed to open the module cache");
+		return;
+	}
+
+	TAILQ_FOREACH(intf, &ctrl->interfaces, node) {
+		td = intf->priv;
+		if (!td->name)
+			continue;
+		fprintf(f, "%s %d %s 0x%x 0x%x 0x%llx ",
+			td->addr, td->port, td->host_name,
+			td->ids.vendor_id, td->ids.product_id,
+			(unsigned long long)td->ids.serial_id);
+		tcpip_print_cport_map(f, td->ids.ports);
+		fprintf(f, "%s\n", td->ids.compress ? " lz4" : "");
+	}
+	fclose(f);
+
+	if (rename(tmp_file, tcpip_ctrl->cache_file))
+		perror("Failed to update the module cache");
+}
+
+/* Called locked */
+static int tcpip_hotplug(struct controller *ctrl, const char *name,
+			 const char *host_name, const char *addr,
+			 uint16_t port, int retries,
+			 const struct tcpip_ids *ids)
+{
+	struct interface *intf;
+	struct tcpip_device *td;
+
+	intf = tcpip_find(ctrl, addr, port);
+	if (intf) {
+		pr_dbg("Module at %s:%d is already known\n", addr, port);
+		/* A cached module is unplugged once its service is removed */
+		td = intf->priv;
+		if (name && !td->name) {
+			td->name = strdup(name);
+			atomic_store(&td->discovered, !!td->name);
+		}
+		return -EEXIST;
+	}
+
 	td = malloc(sizeof(*td));
 	if (!td)
 		goto exit;
 
 	td->port = port;
-	avahi_address_snprint(td->addr, sizeof(td->addr), address);
+	td->retries = retries;
+	td->ids = *ids;
+	strncpy(td->addr, addr, sizeof(td->addr) - 1);
+	td->addr[sizeof(td->addr) - 1] = '\0';
+	td->name = NULL;
+	if (name) {
+		td->name = strdup(name);
+		if (!td->name)
+			goto err_free_td;
+	}
+	atomic_init(&td->discovered, !!name);
 	td->host_name = malloc(strlen(host_name) + 1);
 	if (!td->host_name)
-		goto err_free_td;
+		goto err_free_name;
 	strcpy(td->host_name, host_name);
 
-	/* FIXME: use real IDs */
-	intf = interface_create(ctrl, 1, 1, 0x1234, td);
+	intf = interface_create(ctrl, ids->vendor_id, ids->product_id,
+				ids->serial_id, td);
 	if (!intf)
 		goto err_free_host_name;
 
-	if (interface_hotplug(intf))
-		goto err_intf_destroy;
+	/* The default IDs are shared by the modules: they can't be cached */
+	intf->manifest_crc = ids->manifest_crc;
+	intf->manifest_cache = ids->serial_id != TCPIP_DEFAULT_SERIAL_ID ||
+			       ids->manifest_crc;
 
-	return;
+	if (interface_hotplug(intf)) {
+		/* tcpip_intf_destroy() releases the device */
+		interface_destroy(intf);
+		goto exit;
+	}
+
+	return 0;
 
-err_intf_destroy:
-	interface_destroy(intf);
 err_free_host_name:
 	free(td->host_name);
+err_free_name:
+	free(td->name);
 err_free_td:
 	free(td);
 exit:
 	pr_err("Failed to hotplug of TCP/IP module\n");
+
+	return -ENOMEM;
+}
+
+static int tcpip_resolve(const char *host_name, char *addr, size_t len)
+{
+	int ret;
+	struct addrinfo hints;
+	struct addrinfo *res;
+	struct sockaddr_in *sin;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	ret = getaddrinfo(host_name, NULL, &hints, &res);
+	if (ret) {
+		pr_err("Failed to resolve %s: %s\n",
+		       host_name, gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	sin = (struct sockaddr_in *)res->ai_addr;
+	inet_ntop(AF_INET, &sin->sin_addr, addr, len);
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+/*
+ * The config file lists one module per line, as host:port.
+ * Empty lines and lines starting with '#' are ignored.
+ */
+static void tcpip_config_discovery(struct controller *ctrl,
+				   const char *file_name)
+{
+	FILE *f;
+	int port;
+	char line[256];
+	char host_name[256];
+	char addr[AVAHI_ADDRESS_STR_MAX];
+	struct tcpip_ids ids;
+	struct tcpip_controller *tcpip_ctrl = ctrl->priv;
+
+	f = fopen(file_name, "r");
+	if (!f) {
+		perror("Failed to open the module list");
+		return;
+	}
+
+	tcpip_ids_init(&ids);
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		if (sscanf(line, "%255[^:]:%d", host_name, &port) != 2) {
+			pr_err("Invalid module entry: %s", line);
+			continue;
+		}
+
+		if (tcpip_resolve(host_name, addr, sizeof(addr)))
+			continue;
+
+		pthread_mutex_lock(&tcpip_ctrl->lock);
+		tcpip_hotplug(ctrl, NULL, host_name, addr, port, -1, &ids);
+		pthread_mutex_unlock(&tcpip_ctrl->lock);
+	}
+
+	fclose(f);
+}
+
+/*
+ * The cache holds the modules previously resolved by avahi, so they can be
+ * hotplugged before the mDNS browser has seen them again. It is replayed
+ * by its own thread, while avahi browses.
+ */
+static void *tcpip_cache_discovery(void *data)
+{
+	FILE *f;
+	int port;
+	char line[512];
+	char host_name[256];
+	char map[256];
+	char compression[16];
+	char addr[AVAHI_ADDRESS_STR_MAX];
+	unsigned long long serial_id;
+	struct tcpip_ids ids;
+	struct controller *ctrl = data;
+	struct tcpip_controller *tcpip_ctrl = ctrl->priv;
+
+	f = fopen(tcpip_ctrl->cache_file, "r");
+	if (!f)
+		return NULL;
+
+	while (fgets(line, sizeof(line), f)) {
+		tcpip_ids_init(&ids);
+		compression[0] = '\0';
+		if (sscanf(line, "%39s %d %255s %" SCNx32 " %" SCNx32
+			   " %llx %255s %15s",
+			   addr, &port, host_name, &ids.vendor_id,
+			   &ids.product_id, &serial_id, map, compression) < 7 ||
+		    tcpip_parse_cport_map(map, ids.ports)) {
+			pr_err("Invalid cache entry: %s", line);
+			continue;
+		}
+		ids.serial_id = serial_id;
+		ids.compress = strcmp(compression, "lz4") == 0;
+
+		pthread_mutex_lock(&tcpip_ctrl->lock);
+		if (!tcpip_ctrl->cache_run) {
+			pthread_mutex_unlock(&tcpip_ctrl->lock);
+			break;
+		}
+		pr_dbg("Using cached module %s at %s:%d\n",
+		       host_name, addr, port);
+		tcpip_hotplug(ctrl, NULL, host_name, addr, port,
+			      TCPIP_CACHE_RETRIES, &ids);
+		pthread_mutex_unlock(&tcpip_ctrl->lock);
+	}
+
+	fclose(f);
+
+	return NULL;
 }
 
 static void resolve_callback(AvahiServiceResolver *r,
@@ -149,8 +575,12 @@ static void resolve_callback(AvahiServiceResolver *r,
 			     AvahiLookupResultFlags flags,
 			     void* userdata)
 {
+	int ret;
 	AvahiClient *c;
 	struct controller *ctrl = userdata;
+	struct tcpip_controller *tcpip_ctrl = ctrl->priv;
+	char addr[AVAHI_ADDRESS_STR_MAX];
+	struct tcpip_ids ids;
 
 	switch (event) {
 	case AVAHI_RESOLVER_FAILURE:
@@ -162,7 +592,16 @@ static void resolve_callback(AvahiServiceResolver *r,
 		break;
 
 	case AVAHI_RESOLVER_FOUND:
-		tcpip_hotplug(ctrl, host_name, address, port);
+		avahi_address_snprint(addr, sizeof(addr), address);
+		tcpip_ids_init(&ids);
+		tcpip_parse_txt(txt, &ids);
+		pthread_mutex_lock(&tcpip_ctrl->lock);
+		/* A cached module is known already, but now discovered */
+		ret = tcpip_hotplug(ctrl, name, host_name, addr, port, -1,
+				    &ids);
+		if (!ret || ret == -EEXIST)
+			tcpip_cache_save(ctrl);
+		pthread_mutex_unlock(&tcpip_ctrl->lock);
 		break;
 	}
 
@@ -183,6 +622,7 @@ static void browse_callback(AvahiServiceBrowser *b,
 	struct tcpip_controller *tcpip_ctrl = ctrl->priv;
 	AvahiClient *c = tcpip_ctrl->client;
 	AvahiServiceResolver *r;
+	struct interface *intf;
 
 	switch (event) {
 	case AVAHI_BROWSER_FAILURE:
@@ -205,7 +645,14 @@ static void browse_callback(AvahiServiceBrowser *b,
 		return;
 
 	case AVAHI_BROWSER_REMOVE:
-		/* TODO */
+		pthread_mutex_lock(&tcpip_ctrl->lock);
+		intf = tcpip_find_service(ctrl, name);
+		if (intf) {
+			pr_info("Module %s removed\n", name);
+			interface_hot_unplug(intf);
+			tcpip_cache_save(ctrl);
+		}
+		pthread_mutex_unlock(&tcpip_ctrl->lock);
 		return;
 
 	default:
@@ -228,6 +675,11 @@ static void client_callback(AvahiClient *c,
 
 static void tcpip_intf_destroy(struct interface *intf)
 {
+	struct tcpip_device *td = intf->priv;
+
+	free(td->name);
+	free(td->host_name);
+	free(td);
 }
 
 static int avahi_discovery(struct controller *ctrl)
@@ -239,10 +691,24 @@ static int avahi_discovery(struct controller *ctrl)
 	int ret = 0;
 	int error;
 
+	if (tcpip_ctrl->cache_file) {
+		tcpip_ctrl->cache_run = 1;
+		ret = pthread_create(&tcpip_ctrl->cache_thread, NULL,
+				     tcpip_cache_discovery, ctrl);
+		if (ret) {
+			pr_err("Failed to create the cache thread\n");
+			tcpip_ctrl->cache_run = 0;
+			ret = 0;
+		}
+	}
+	if (tcpip_ctrl->config_file)
+		tcpip_config_discovery(ctrl, tcpip_ctrl->config_file);
+
 	simple_poll = avahi_simple_poll_new();
 	if (!simple_poll) {
 		pr_err("Failed to create simple poll object\n");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto err_cache_stop;
 	}
 
 	client = avahi_client_new(avahi_simple_poll_get(simple_poll),
@@ -273,6 +739,15 @@ err_client_free:
 	avahi_client_free(client);
 err_simple_pool_free:
 	avahi_simple_poll_free(simple_poll);
+err_cache_stop:
+	pthread_mutex_lock(&tcpip_ctrl->lock);
+	if (tcpip_ctrl->cache_run) {
+		tcpip_ctrl->cache_run = 0;
+		pthread_mutex_unlock(&tcpip_ctrl->lock);
+		pthread_join(tcpip_ctrl->cache_thread, NULL);
+	} else {
+		pthread_mutex_unlock(&tcpip_ctrl->lock);
+	}
 
 	return ret;
 }
@@ -281,7 +756,8 @@ static void avahi_discovery_stop(struct controller *ctrl)
 {
 	struct tcpip_controller *tcpip_ctrl = ctrl->priv;
 
-	avahi_simple_poll_quit(tcpip_ctrl->simple_poll);
+	if (tcpip_ctrl->simple_poll)
+		avahi_simple_poll_quit(tcpip_ctrl->simple_poll);
 }
 
 static int tcpip_write(struct connection *conn, void *data, size_t len)
@@ -291,11 +767,70 @@ static int tcpip_write(struct connection *conn, void *data, size_t len)
 	return write(tconn->sock, data, len);
 }
 
+/* Read as much as possible, so several messages may need a single read() */
+static int tcpip_fill(struct tcpip_connection *tconn, size_t len)
+{
+	int ret;
+
+	if (tconn->rx_start == tconn->rx_end) {
+		tconn->rx_start = 0;
+		tconn->rx_end = 0;
+	} else if (tconn->rx_start + len > TCPIP_RX_BUF_SIZE) {
+		memmove(tconn->rx_buf, tconn->rx_buf + tconn->rx_start,
+			tconn->rx_end - tconn->rx_start);
+		tconn->rx_end -= tconn->rx_start;
+		tconn->rx_start = 0;
+	}
+
+	while (tconn->rx_end - tconn->rx_start < len) {
+		ret = read(tconn->sock, tconn->rx_buf + tconn->rx_end,
+			   TCPIP_RX_BUF_SIZE - tconn->rx_end);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ECONNRESET)
+				return -ENOTCONN;
+			return -errno;
+		}
+		/* The module has closed its socket */
+		if (ret == 0)
+			return -ENOTCONN;
+		tconn->rx_end += ret;
+	}
+
+	return 0;
+}
+
+/*
+ * TCP is a stream: return one message at a time, as the compressed ones
+ * must be given whole to the decoder.
+ */
 static int tcpip_read(struct connection *conn, void *data, size_t len)
 {
+	int ret;
+	size_t size;
 	struct tcpip_connection *tconn = conn->priv;
 
-	return read(tconn->sock, data, len);
+	ret = tcpip_fill(tconn, sizeof(struct gb_operation_msg_hdr));
+	if (ret)
+		return ret;
+
+	size = gb_operation_msg_size(tconn->rx_buf + tconn->rx_start);
+	if (size < sizeof(struct gb_operation_msg_hdr) ||
+	    size > len || size > GB_NETLINK_MTU) {
+		/* The stream can't be resynchronized */
+		pr_err("Invalid message size %zu\n", size);
+		return -ENOTCONN;
+	}
+
+	ret = tcpip_fill(tconn, size);
+	if (ret)
+		return ret;
+
+	memcpy(data, tconn->rx_buf + tconn->rx_start, size);
+	tconn->rx_start += size;
+
+	return size;
 }
 
 static int tcpip_init(struct controller *ctrl)
@@ -307,12 +842,22 @@ static int tcpip_init(struct controller *ctrl)
 		return -ENOMEM;
 	 ctrl->priv = tcpip_ctrl;
 
+	tcpip_ctrl->simple_poll = NULL;
+	tcpip_ctrl->config_file = tcpip_config_file;
+	tcpip_ctrl->cache_file = tcpip_cache_file;
+	tcpip_ctrl->cache_run = 0;
+	pthread_mutex_init(&tcpip_ctrl->lock, NULL);
+	ctrl->interfaces_lock = &tcpip_ctrl->lock;
+
 	return 0;
 }
 
 static void tcpip_exit(struct controller *ctrl)
 {
-	free(ctrl->priv);
+	struct tcpip_controller *tcpip_ctrl = ctrl->priv;
+
+	pthread_mutex_destroy(&tcpip_ctrl->lock);
+	free(tcpip_ctrl);
 }
 
 
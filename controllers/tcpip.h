@@ -0,0 +1,44 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TCPIP_H_
+#define _TCPIP_H_
+
+#include <config.h>
+#include <debug.h>
+
+#ifdef HAVE_TCPIP
+int tcpip_set_config_file(const char *file_name);
+int tcpip_set_cache_file(const char *file_name);
+#else
+static inline int tcpip_set_config_file(const char *file_name)
+{
+	pr_err("TCP/IP support has not been compiled.\n");
+
+	return -1;
+}
+
+static inline int tcpip_set_cache_file(const char *file_name)
+{
+	pr_err("TCP/IP support has not been compiled.\n");
+
+	return -1;
+}
+#endif
+
+#endif /* _TCPIP_H_ */
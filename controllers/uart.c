@@ -19,50 +19,106 @@
 #include <debug.h>
 #include <gbridge.h>
 #include <controller.h>
+#include <compress.h>
 #include <controllers/uart.h>
+#include <framing.h>
+#include <segment.h>
+#include <txqueue.h>
 
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/uio.h>
+
+/* Large enough to hold a few messages received in a single read() */
+#define UART_RX_BUF_SIZE	(4 * GB_NETLINK_MTU)
 
 struct controller uart_controller;
 
 struct uart_controller {
 	int fd;
+	const char *file_name;
+	enum uart_framing framing;
+	int rx_discard;
+	size_t rx_start;
+	size_t rx_end;
+	uint8_t rx_buf[UART_RX_BUF_SIZE];
+	/* Messages of the last frame not yet given to the reader */
+	size_t rx_frame_start;
+	size_t rx_frame_end;
+	uint8_t rx_frame[GB_NETLINK_MTU];
+
+	struct tx_queue tx_queue;
+	struct tx_queue_aggregation aggregation;
+	uint8_t tx_frame[GB_NETLINK_MTU];
+	uint8_t tx_buf[TX_QUEUE_BURST_MAX * FRAME_MAX_SIZE(GB_NETLINK_MTU)];
 };
 
-int register_uart_controller(const char *file_name, int baudrate)
+int register_uart_controller(const char *file_name, int baudrate,
+			     enum uart_framing framing,
+			     const struct tx_queue_aggregation *aggregation,
+			     size_t mtu, int compress)
 {
 	int ret;
 	struct termios tio;
 	struct controller *ctrl;
 	struct uart_controller *uart_ctrl;
 
+	if (mtu && (mtu < SEGMENT_MIN_MTU || mtu > GB_NETLINK_MTU)) {
+		pr_err("%s: mtu must be between %d and %d\n", file_name,
+		       SEGMENT_MIN_MTU, GB_NETLINK_MTU);
+		return -EINVAL;
+	}
+
 	uart_ctrl = malloc(sizeof(*uart_ctrl));
 	if (!uart_ctrl)
 		return -ENOMEM;
+	uart_ctrl->file_name = file_name;
+	uart_ctrl->framing = framing;
+	uart_ctrl->rx_discard = 0;
+	uart_ctrl->rx_start = 0;
+	uart_ctrl->rx_end = 0;
+	uart_ctrl->rx_frame_start = 0;
+	uart_ctrl->rx_frame_end = 0;
+	uart_ctrl->aggregation = *aggregation;
+
+	/* Don't wait for the carrier, then switch back to blocking mode */
+	uart_ctrl->fd = open(file_name, O_RDWR | O_NOCTTY | O_NDELAY);
+	if (uart_ctrl->fd < 0) {
+		ret = -errno;
+		free(uart_ctrl);
+		return ret;
+	}
+	fcntl(uart_ctrl->fd, F_SETFL, 0);
 
 	tcgetattr(uart_ctrl->fd, &tio);
-	cfsetospeed(&tio, baudrate);
-	cfsetispeed(&tio, baudrate);
-	tio.c_cflag = CS8 | CREAD;
+	tio.c_cflag = CS8 | CREAD | CLOCAL;
 	tio.c_iflag = IGNBRK;
 	tio.c_lflag = 0;
 	tio.c_oflag = 0;
+	/* read() returns as soon as some data is available */
+	tio.c_cc[VMIN] = 1;
+	tio.c_cc[VTIME] = 0;
 
-	uart_ctrl->fd = open(file_name, O_RDWR | O_NOCTTY | O_NDELAY);
-	if (uart_ctrl->fd < 0) {
+	ret = tcsetattr(uart_ctrl->fd, TCSANOW, &tio);
+	if (ret < 0) {
+		ret = -errno;
+		close(uart_ctrl->fd);
 		free(uart_ctrl);
-		return uart_ctrl->fd;
+		return ret;
 	}
 
-	ret = tcsetattr(uart_ctrl->fd, TCSANOW, &tio);
+	ret = uart_set_baudrate(uart_ctrl->fd, baudrate);
 	if (ret < 0) {
+		pr_err("Failed to set %s baudrate to %d: %d\n",
+		       file_name, baudrate, ret);
 		close(uart_ctrl->fd);
 		free(uart_ctrl);
+		return ret;
 	}
 
 	ctrl = malloc(sizeof(*ctrl));
@@ -74,20 +130,48 @@ int register_uart_controller(const char *file_name, int baudrate)
 
 	memcpy(ctrl, &uart_controller, sizeof(*ctrl));
 	ctrl->priv = uart_ctrl;
+	ctrl->mtu = mtu;
+	ctrl->compress = compress ? COMPRESS_OFFERED : COMPRESS_OFF;
 	register_controller(ctrl);
 
 	return 0;
 }
 
+static int uart_flush(void *priv, struct iovec *iov, int count);
+
 static int uart_init(struct controller * ctrl)
 {
+	int ret;
+	struct uart_controller *uart_ctrl = ctrl->priv;
+
+	ret = tx_queue_init(&uart_ctrl->tx_queue, uart_ctrl->file_name,
+			    uart_flush, uart_ctrl);
+	if (ret)
+		return ret;
+
+	tx_queue_set_aggregation(&uart_ctrl->tx_queue, &uart_ctrl->aggregation);
+
 	return 0;
 }
 
 static void uart_exit(struct controller * ctrl)
 {
+	struct tx_queue_stats stats;
 	struct uart_controller *uart_ctrl = ctrl->priv;
 
+	/* Make sure everything has been sent before to close the UART */
+	tx_queue_drain(&uart_ctrl->tx_queue);
+	tcdrain(uart_ctrl->fd);
+	tx_queue_get_stats(&uart_ctrl->tx_queue, &stats);
+	tx_queue_exit(&uart_ctrl->tx_queue);
+
+	pr_info("%s: %llu messages (%llu bytes) sent in %llu writes, "
+		"%llu errors, max queue depth %u\n", uart_ctrl->file_name,
+		(unsigned long long)stats.msgs,
+		(unsigned long long)stats.bytes,
+		(unsigned long long)stats.bursts,
+		(unsigned long long)stats.errors, stats.max_depth);
+
 	close(uart_ctrl->fd);
 	free(uart_ctrl);
 }
@@ -111,66 +195,307 @@ static int uart_hotplug(struct controller *ctrl)
 	return 0;
 }
 
+static int uart_write_all(struct uart_controller *ctrl,
+			  uint8_t *data, size_t len)
+{
+	int ret;
+
+	while (len) {
+		ret = write(ctrl->fd, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * With aggregation, consecutive messages are packed in the same frame,
+ * as long as the frame payload fits in GB_NETLINK_MTU.
+ * Returns the number of messages encoded.
+ */
+static int uart_encode_aggregate(struct uart_controller *ctrl,
+				 struct iovec *iov, int count, size_t *len)
+{
+	int i;
+	size_t size = 0;
+
+	for (i = 0; i < count; i++) {
+		if (size + iov[i].iov_len > GB_NETLINK_MTU)
+			break;
+		memcpy(ctrl->tx_frame + size, iov[i].iov_base, iov[i].iov_len);
+		size += iov[i].iov_len;
+	}
+
+	*len += frame_encode(ctrl->tx_frame, size, ctrl->tx_buf + *len);
+
+	return i;
+}
+
+/* Called by the TX queue thread to write a burst of messages */
+static int uart_flush(void *priv, struct iovec *iov, int count)
+{
+	int i;
+	size_t len = 0;
+	struct uart_controller *ctrl = priv;
+
+	if (ctrl->framing == UART_FRAMING_NONE)
+		return tx_writev_all(ctrl->fd, iov, count);
+
+	for (i = 0; i < count; ) {
+		if (ctrl->aggregation.delay) {
+			i += uart_encode_aggregate(ctrl, iov + i, count - i,
+						   &len);
+			continue;
+		}
+
+		len += frame_encode(iov[i].iov_base, iov[i].iov_len,
+				    ctrl->tx_buf + len);
+		i++;
+	}
+
+	return uart_write_all(ctrl, ctrl->tx_buf, len);
+}
+
 static int uart_write(struct connection * conn, void *data, size_t len)
 {
-	struct uart_controller *ctrl = conn->intf->ctrl->priv;
+	struct uart_controller *ctrl = conn->intf2->ctrl->priv;
+
+	if (len > GB_NETLINK_MTU)
+		return -EMSGSIZE;
 
 	cport_pack(data, conn->cport2_id);
-	return write(ctrl->fd, data, len);
+	return tx_queue_push(&ctrl->tx_queue, data, len);
 }
 
-static int _uart_read(struct uart_controller *ctrl,
-		      void *data, size_t len)
+/*
+ * Wait for data and read as much as possible, so a single read() may
+ * return many messages.
+ */
+static int uart_fill(struct uart_controller *ctrl)
 {
 	int ret;
-	uint8_t *p_data = data;
+	struct pollfd pfd;
+
+	if (ctrl->rx_start == ctrl->rx_end) {
+		ctrl->rx_start = 0;
+		ctrl->rx_end = 0;
+	} else if (ctrl->rx_end == UART_RX_BUF_SIZE) {
+		memmove(ctrl->rx_buf, ctrl->rx_buf + ctrl->rx_start,
+			ctrl->rx_end - ctrl->rx_start);
+		ctrl->rx_end -= ctrl->rx_start;
+		ctrl->rx_start = 0;
+	}
 
-	while (len) {
-		ret = read(ctrl->fd, p_data, len);
-		if (ret == 0 || ret == -EAGAIN ||
-		    (ret == -1 && errno == -EAGAIN ))
-			usleep(10);
-		else if (ret < -1)
+	pfd.fd = ctrl->fd;
+	pfd.events = POLLIN;
+	do {
+		ret = poll(&pfd, 1, -1);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL))
+		return -ENOTCONN;
+
+	ret = read(ctrl->fd, ctrl->rx_buf + ctrl->rx_end,
+		   UART_RX_BUF_SIZE - ctrl->rx_end);
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		/* The USB adapter of the UART has been unplugged */
+		if (errno == EIO || errno == ENXIO || errno == ENODEV)
+			return -ENOTCONN;
+		return -errno;
+	}
+	if (ret == 0)
+		return -ENOTCONN;
+
+	ctrl->rx_end += ret;
+
+	return 0;
+}
+
+static int _uart_read(struct uart_controller *ctrl, size_t len)
+{
+	int ret;
+
+	while (ctrl->rx_end - ctrl->rx_start < len) {
+		ret = uart_fill(ctrl);
+		if (ret)
 			return ret;
-		else {
-			len -= ret;
-			p_data += ret;
+	}
+
+	return 0;
+}
+
+static int uart_drop(struct uart_controller *ctrl, size_t len)
+{
+	int ret;
+	size_t count;
+
+	while (len) {
+		if (ctrl->rx_start == ctrl->rx_end) {
+			ret = uart_fill(ctrl);
+			if (ret)
+				return ret;
 		}
+
+		count = ctrl->rx_end - ctrl->rx_start;
+		if (count > len)
+			count = len;
+		ctrl->rx_start += count;
+		len -= count;
 	}
 
 	return 0;
 }
 
+/*
+ * Read the next valid frame. Corrupted frames are dropped, and the reader
+ * resynchronizes on the next delimiter.
+ */
+static int uart_read_frame(struct uart_controller *ctrl,
+			   void *data, size_t len)
+{
+	int ret;
+	uint8_t *frame;
+	uint8_t *delimiter;
+	size_t frame_len;
+
+	while (1) {
+		frame = ctrl->rx_buf + ctrl->rx_start;
+		delimiter = memchr(frame, FRAME_DELIMITER,
+				   ctrl->rx_end - ctrl->rx_start);
+		if (!delimiter) {
+			if (ctrl->rx_start == 0 &&
+			    ctrl->rx_end == UART_RX_BUF_SIZE) {
+				pr_err("Frame to big, dropping it\n");
+				ctrl->rx_start = ctrl->rx_end;
+				ctrl->rx_discard = 1;
+			}
+
+			ret = uart_fill(ctrl);
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		frame_len = delimiter - frame;
+		ctrl->rx_start += frame_len + 1;
+		if (ctrl->rx_discard) {
+			ctrl->rx_discard = 0;
+			continue;
+		}
+		if (!frame_len)
+			continue;
+
+		ret = frame_decode(frame, frame_len, data, len);
+		if (ret < 0) {
+			pr_err("Dropping corrupted frame: %d\n", ret);
+			continue;
+		}
+
+		return ret;
+	}
+}
+
+/*
+ * A frame holds one or more messages (see uart_encode_aggregate()).
+ * Return the next one, reading a new frame when the last one is consumed.
+ */
+static int uart_read_frame_msg(struct uart_controller *ctrl,
+			       void *data, size_t len)
+{
+	int ret;
+	size_t size;
+	uint8_t *msg;
+
+	while (1) {
+		if (ctrl->rx_frame_start == ctrl->rx_frame_end) {
+			ret = uart_read_frame(ctrl, ctrl->rx_frame,
+					      sizeof(ctrl->rx_frame));
+			if (ret < 0)
+				return ret;
+			ctrl->rx_frame_start = 0;
+			ctrl->rx_frame_end = ret;
+		}
+
+		msg = ctrl->rx_frame + ctrl->rx_frame_start;
+		size = ctrl->rx_frame_end - ctrl->rx_frame_start;
+		if (size >= sizeof(struct gb_operation_msg_hdr) &&
+		    gb_operation_msg_size(msg) >=
+		    sizeof(struct gb_operation_msg_hdr) &&
+		    gb_operation_msg_size(msg) <= size)
+			break;
+
+		pr_err("Dropping frame with invalid message size\n");
+		ctrl->rx_frame_start = ctrl->rx_frame_end;
+	}
+
+	size = gb_operation_msg_size(msg);
+	ctrl->rx_frame_start += size;
+	if (size > len)
+		return -EMSGSIZE;
+	memcpy(data, msg, size);
+
+	return size;
+}
+
 static int uart_read(struct interface * intf,
 		     uint16_t * cport_id, void *data, size_t len)
 {
 	int ret;
-	uint8_t *p_data = data;
+	size_t size;
+	uint8_t *p_data;
 	struct uart_controller *ctrl = intf->ctrl->priv;
 
-	ret = _uart_read(ctrl, p_data, sizeof(struct gb_operation_msg_hdr));
+	if (ctrl->framing == UART_FRAMING_COBS) {
+		ret = uart_read_frame_msg(ctrl, data, len);
+		if (ret < 0)
+			return ret;
+
+		*cport_id = cport_unpack(data);
+		return ret;
+	}
+
+	ret = _uart_read(ctrl, sizeof(struct gb_operation_msg_hdr));
 	if (ret) {
 		pr_err("Failed to get header\n");
 		return ret;
 	}
 
-	ret = gb_operation_msg_size(data);
-	if (ret > len) {
+	p_data = ctrl->rx_buf + ctrl->rx_start;
+	size = gb_operation_msg_size(p_data);
+	if (size < sizeof(struct gb_operation_msg_hdr)) {
+		pr_err("Invalid message size\n");
+		uart_drop(ctrl, sizeof(struct gb_operation_msg_hdr));
+		return -EPROTO;
+	}
+
+	if (size > len || size > UART_RX_BUF_SIZE) {
 		pr_err("Message to big\n");
-		return -EMSGSIZE;	/* FIXME: drop remaining data */
+		uart_drop(ctrl, size);
+		return -EMSGSIZE;
 	}
 
-	p_data += sizeof(struct gb_operation_msg_hdr);
-	len = ret - sizeof(struct gb_operation_msg_hdr);
-	ret = _uart_read(ctrl, p_data, len);
+	ret = _uart_read(ctrl, size);
 	if (ret) {
 		pr_err("Failed to get the payload\n");
 		return ret;
 	}
 
+	p_data = ctrl->rx_buf + ctrl->rx_start;
+	memcpy(data, p_data, size);
+	ctrl->rx_start += size;
+
 	*cport_id = cport_unpack(data);
 
-	return len + sizeof(struct gb_operation_msg_hdr);
+	return size;
 }
 
 struct controller uart_controller = {
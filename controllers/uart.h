@@ -21,11 +21,26 @@
 
 #include <config.h>
 #include <debug.h>
+#include <txqueue.h>
+
+enum uart_framing {
+	UART_FRAMING_NONE,	/* Raw Greybus messages */
+	UART_FRAMING_COBS,	/* COBS frames with a CRC32C, see framing.h */
+};
 
 #ifdef HAVE_UART
-int register_uart_controller(const char *file_name, int baudrate);
+int register_uart_controller(const char *file_name, int baudrate,
+			     enum uart_framing framing,
+			     const struct tx_queue_aggregation *aggregation,
+			     size_t mtu, int compress);
+int uart_set_baudrate(int fd, int baudrate);
 #else
-int register_uart_controller(const char *file_name, int baudrate)
+static inline int register_uart_controller(const char *file_name,
+					   int baudrate,
+					   enum uart_framing framing,
+					   const struct tx_queue_aggregation
+					   *aggregation,
+					   size_t mtu, int compress)
 {
 	pr_err("UART support has not been compiled.\n");
 
@@ -0,0 +1,53 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ * Author: Alexandre Bailon <abailon@baylibre.com>
+ * Copyright (c) 2016 Alexandre Bailon
+ */
+
+/*
+ * struct termios2 can't be used with the glibc termios.h,
+ * so it lives in its own file.
+ */
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+#include <debug.h>
+
+int uart_set_baudrate(int fd, int baudrate)
+{
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -errno;
+
+	/* BOTHER takes the rate as is, standard or not */
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baudrate;
+	tio.c_ospeed = baudrate;
+
+	if (ioctl(fd, TCSETS2, &tio) < 0)
+		return -errno;
+
+	if (ioctl(fd, TCGETS2, &tio) < 0)
+		return -errno;
+
+	if (tio.c_ospeed != baudrate)
+		pr_warn("Baudrate set to %u instead of %d\n",
+			tio.c_ospeed, baudrate);
+
+	return 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <framing.h>
+#include <controllers/unix_socket.h>
+
+/*
+ * A module may create its socket before calling listen(),
+ * so give it some time before giving up.
+ */
+#define UNIX_CONNECT_RETRIES	10
+#define UNIX_CONNECT_DELAY	100000
+
+#define INOTIFY_BUF_SIZE	(sizeof(struct inotify_event) + NAME_MAX + 1)
+
+/* The modules don't report their IDs, see unix_serial_id() */
+#define UNIX_VENDOR_ID		1
+#define UNIX_PRODUCT_ID		1
+
+struct controller unix_controller;
+
+struct unix_device {
+	char *name;
+	int sock;
+};
+
+struct unix_controller {
+	const char *dir;
+	int inotify_fd;
+	/* Protect the interfaces, which may be unplugged meanwhile */
+	pthread_mutex_t lock;
+};
+
+static struct controller *unix_default_ctrl;
+
+static int unix_is_connected(struct controller *ctrl, const char *name)
+{
+	int ret = 0;
+	struct interface *intf;
+	struct unix_device *ud;
+	struct unix_controller *unix_ctrl = ctrl->priv;
+
+	pthread_mutex_lock(&unix_ctrl->lock);
+	TAILQ_FOREACH(intf, &ctrl->interfaces, node) {
+		ud = intf->priv;
+		if (strcmp(ud->name, name) == 0) {
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&unix_ctrl->lock);
+
+	return ret;
+}
+
+/*
+ * The path of its socket tells a module apart, and stays the same when
+ * the module reconnects.
+ */
+static uint64_t unix_serial_id(struct unix_controller *unix_ctrl,
+			       const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", unix_ctrl->dir, name);
+
+	return crc32c(0, path, strlen(path));
+}
+
+static int unix_hotplug(struct controller *ctrl, const char *name, int sock)
+{
+	int ret;
+	struct unix_device *ud;
+	struct interface *intf;
+	struct unix_controller *unix_ctrl = ctrl->priv;
+
+	ud = malloc(sizeof(*ud));
+	if (!ud)
+		return -ENOMEM;
+
+	ud->sock = sock;
+	ud->name = strdup(name);
+	if (!ud->name) {
+		ret = -ENOMEM;
+		goto err_free_ud;
+	}
+
+	pthread_mutex_lock(&unix_ctrl->lock);
+
+	intf = interface_create(ctrl, UNIX_VENDOR_ID, UNIX_PRODUCT_ID,
+				unix_serial_id(unix_ctrl, name), ud);
+	if (!intf) {
+		ret = -ENOMEM;
+		goto err_unlock;
+	}
+
+	ret = interface_hotplug(intf);
+	if (ret < 0)
+		goto err_intf_destroy;
+
+	pthread_mutex_unlock(&unix_ctrl->lock);
+	pr_info("Module %s connected\n", name);
+
+	return 0;
+
+err_intf_destroy:
+	/* The socket is closed by the caller */
+	ud->sock = -1;
+	interface_destroy(intf);
+	pthread_mutex_unlock(&unix_ctrl->lock);
+	return ret;
+err_unlock:
+	pthread_mutex_unlock(&unix_ctrl->lock);
+	free(ud->name);
+err_free_ud:
+	free(ud);
+
+	return ret;
+}
+
+static int unix_connect(struct controller *ctrl, const char *name)
+{
+	int ret;
+	int sock;
+	int retries = UNIX_CONNECT_RETRIES;
+	struct sockaddr_un addr;
+	struct unix_controller *unix_ctrl = ctrl->priv;
+
+	if (unix_is_connected(ctrl, name))
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s",
+		       unix_ctrl->dir, name);
+	if (ret >= sizeof(addr.sun_path)) {
+		pr_err("Socket path too long: %s/%s\n", unix_ctrl->dir, name);
+		return -ENAMETOOLONG;
+	}
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		pr_err("Can't create socket\n");
+		return -errno;
+	}
+
+	pr_info("Trying to connect to module at %s\n", addr.sun_path);
+	do {
+		ret = connect(sock, (struct sockaddr *)&addr, sizeof(addr));
+		if (ret && (errno != ECONNREFUSED || retries-- == 0)) {
+			ret = -errno;
+			pr_err("Failed to connect to %s: %d\n",
+			       addr.sun_path, ret);
+			close(sock);
+			return ret;
+		}
+		if (ret)
+			usleep(UNIX_CONNECT_DELAY);
+	} while (ret);
+
+	ret = unix_hotplug(ctrl, name, sock);
+	if (ret)
+		close(sock);
+
+	return ret;
+}
+
+static int unix_is_socket(const char *dir, const char *name)
+{
+	struct stat st;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (stat(path, &st))
+		return 0;
+
+	return S_ISSOCK(st.st_mode);
+}
+
+static int unix_scan(struct controller *ctrl)
+{
+	DIR *dir;
+	struct dirent *entry;
+	struct unix_controller *unix_ctrl = ctrl->priv;
+
+	dir = opendir(unix_ctrl->dir);
+	if (!dir) {
+		perror("Failed to open the module directory");
+		return -errno;
+	}
+
+	while ((entry = readdir(dir))) {
+		if (!unix_is_socket(unix_ctrl->dir, entry->d_name))
+			continue;
+		unix_connect(ctrl, entry->d_name);
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+static int unix_discovery(struct controller *ctrl)
+{
+	int ret;
+	char *p;
+	char buf[INOTIFY_BUF_SIZE * 16]
+		__attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *event;
+	struct unix_controller *unix_ctrl = ctrl->priv;
+
+	if (!unix_ctrl->dir)
+		return 0;
+
+	/* Watch the directory first to not miss the modules created meanwhile */
+	ret = inotify_add_watch(unix_ctrl->inotify_fd, unix_ctrl->dir,
+				IN_CREATE | IN_MOVED_TO);
+	if (ret < 0) {
+		perror("Failed to watch the module directory");
+		return -errno;
+	}
+
+	ret = unix_scan(ctrl);
+	if (ret)
+		return ret;
+
+	while (1) {
+		ret = read(unix_ctrl->inotify_fd, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Failed to read inotify events");
+			return -errno;
+		}
+
+		for (p = buf; p < buf + ret;
+		     p += sizeof(struct inotify_event) + event->len) {
+			event = (struct inotify_event *)p;
+			if (!event->len)
+				continue;
+			if (!unix_is_socket(unix_ctrl->dir, event->name))
+				continue;
+			unix_connect(ctrl, event->name);
+		}
+	}
+
+	return 0;
+}
+
+int unix_socketpair_hotplug(const char *name, int *module_fd)
+{
+	int ret;
+	int sv[2];
+
+	if (!unix_default_ctrl) {
+		pr_err("No unix controller registered\n");
+		return -ENODEV;
+	}
+
+	ret = socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+	if (ret) {
+		perror("Failed to create the socket pair");
+		return -errno;
+	}
+
+	ret = unix_hotplug(unix_default_ctrl, name, sv[0]);
+	if (ret) {
+		close(sv[0]);
+		close(sv[1]);
+		return ret;
+	}
+
+	*module_fd = sv[1];
+
+	return 0;
+}
+
+static void unix_interface_destroy(struct interface *intf)
+{
+	struct unix_device *ud = intf->priv;
+
+	if (ud->sock >= 0)
+		close(ud->sock);
+	free(ud->name);
+	free(ud);
+}
+
+static int unix_write(struct connection *conn, void *data, size_t len)
+{
+	struct unix_device *ud = conn->intf2->priv;
+
+	cport_pack(data, conn->cport2_id);
+	return send(ud->sock, data, len, MSG_NOSIGNAL);
+}
+
+static int unix_read(struct interface *intf,
+		     uint16_t *cport_id, void *data, size_t len)
+{
+	int ret;
+	struct unix_device *ud = intf->priv;
+
+	ret = recv(ud->sock, data, len, MSG_TRUNC);
+	if (ret < 0 && errno != ECONNRESET)
+		return -errno;
+
+	if (ret <= 0) {
+		pr_info("Module %s disconnected\n", ud->name);
+		return -ENOTCONN;
+	}
+
+	if (ret > len) {
+		pr_err("Message to big\n");
+		return -EMSGSIZE;
+	}
+
+	if (ret < sizeof(struct gb_operation_msg_hdr) ||
+	    gb_operation_msg_size(data) != ret) {
+		pr_err("Invalid message size\n");
+		return -EPROTO;
+	}
+
+	*cport_id = cport_unpack(data);
+
+	return ret;
+}
+
+static int unix_init(struct controller *ctrl)
+{
+	struct unix_controller *unix_ctrl = ctrl->priv;
+
+	unix_ctrl->inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (unix_ctrl->inotify_fd < 0) {
+		perror("Failed to init inotify");
+		return -errno;
+	}
+
+	return 0;
+}
+
+static void unix_exit(struct controller *ctrl)
+{
+	struct unix_controller *unix_ctrl = ctrl->priv;
+
+	if (unix_default_ctrl == ctrl)
+		unix_default_ctrl = NULL;
+
+	close(unix_ctrl->inotify_fd);
+	pthread_mutex_destroy(&unix_ctrl->lock);
+	free(unix_ctrl);
+}
+
+struct controller unix_controller = {
+	.name = "unix",
+	.init = unix_init,
+	.exit = unix_exit,
+	.event_loop = unix_discovery,
+	.write = unix_write,
+	.intf_read = unix_read,
+	.interface_destroy = unix_interface_destroy,
+};
+
+int register_unix_controller(const char *dir)
+{
+	struct controller *ctrl;
+	struct unix_controller *unix_ctrl;
+
+	unix_ctrl = malloc(sizeof(*unix_ctrl));
+	if (!unix_ctrl)
+		return -ENOMEM;
+
+	unix_ctrl->dir = dir;
+	unix_ctrl->inotify_fd = -1;
+	pthread_mutex_init(&unix_ctrl->lock, NULL);
+
+	ctrl = malloc(sizeof(*ctrl));
+	if (!ctrl) {
+		free(unix_ctrl);
+		return -ENOMEM;
+	}
+
+	memcpy(ctrl, &unix_controller, sizeof(*ctrl));
+	ctrl->priv = unix_ctrl;
+	ctrl->interfaces_lock = &unix_ctrl->lock;
+	register_controller(ctrl);
+
+	if (!unix_default_ctrl)
+		unix_default_ctrl = ctrl;
+
+	return 0;
+}
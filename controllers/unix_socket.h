@@ -0,0 +1,49 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _UNIX_SOCKET_H_
+#define _UNIX_SOCKET_H_
+
+#include <config.h>
+#include <debug.h>
+
+#ifdef HAVE_UNIX_SOCKET
+int register_unix_controller(const char *dir);
+/*
+ * Hotplug a module connected through a socket pair.
+ * The module end of the pair is returned in module_fd.
+ * Must be called once the controllers have been initialized.
+ */
+int unix_socketpair_hotplug(const char *name, int *module_fd);
+#else
+static inline int register_unix_controller(const char *dir)
+{
+	pr_err("Unix socket support has not been compiled.\n");
+
+	return -1;
+}
+
+static inline int unix_socketpair_hotplug(const char *name, int *module_fd)
+{
+	pr_err("Unix socket support has not been compiled.\n");
+
+	return -1;
+}
+#endif
+
+#endif /* _UNIX_SOCKET_H_ */
@@ -0,0 +1,237 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/vm_sockets.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <controllers/vsock.h>
+
+/* The modules don't report their IDs, see vsock_serial_id() */
+#define VSOCK_VENDOR_ID		1
+#define VSOCK_PRODUCT_ID	1
+
+struct controller vsock_controller;
+
+struct vsock_connection {
+	int sock;
+};
+
+struct vsock_device {
+	unsigned int cid;
+	unsigned int port;
+	TAILQ_ENTRY(vsock_device) node;
+};
+
+struct vsock_controller {
+	TAILQ_HEAD(vsock_head, vsock_device) devices;
+};
+
+static int vsock_connection_create(struct connection *conn)
+{
+	int ret;
+	struct sockaddr_vm addr;
+	struct vsock_connection *vconn;
+	struct vsock_device *vd = conn->intf2->priv;
+
+	vconn = malloc(sizeof(*vconn));
+	if (!vconn)
+		return -ENOMEM;
+
+	vconn->sock = socket(AF_VSOCK, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (vconn->sock < 0) {
+		pr_err("Can't create socket\n");
+		ret = -errno;
+		free(vconn);
+		return ret;
+	}
+	conn->priv = vconn;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.svm_family = AF_VSOCK;
+	addr.svm_cid = vd->cid;
+	addr.svm_port = vd->port + conn->cport2_id;
+
+	pr_info("Trying to connect to module at %u:%u\n",
+		vd->cid, addr.svm_port);
+	do {
+		ret = connect(vconn->sock, (struct sockaddr *)&addr,
+			      sizeof(addr));
+		if (ret)
+			sleep(1);
+	} while (ret);
+	pr_info("Connected to module\n");
+
+	return 0;
+}
+
+static int vsock_connection_destroy(struct connection *conn)
+{
+	struct vsock_connection *vconn = conn->priv;
+
+	conn->priv = NULL;
+	close(vconn->sock);
+	free(vconn);
+
+	return 0;
+}
+
+/* The cid and the port of a module tell it apart */
+static uint64_t vsock_serial_id(const struct vsock_device *vd)
+{
+	return (uint64_t)vd->cid << 32 | vd->port;
+}
+
+static int vsock_hotplug(struct controller *ctrl)
+{
+	int ret;
+	struct interface *intf;
+	struct vsock_device *vd;
+	struct vsock_controller *vsock_ctrl = ctrl->priv;
+
+	TAILQ_FOREACH(vd, &vsock_ctrl->devices, node) {
+		intf = interface_create(ctrl, VSOCK_VENDOR_ID, VSOCK_PRODUCT_ID,
+					vsock_serial_id(vd), vd);
+		if (!intf) {
+			pr_err("Failed to create vsock interface\n");
+			continue;
+		}
+
+		ret = interface_hotplug(intf);
+		if (ret < 0) {
+			pr_err("Failed to hotplug vsock module %u:%u\n",
+			       vd->cid, vd->port);
+			interface_destroy(intf);
+		}
+	}
+
+	return 0;
+}
+
+static int vsock_write(struct connection *conn, void *data, size_t len)
+{
+	struct vsock_connection *vconn = conn->priv;
+
+	return write(vconn->sock, data, len);
+}
+
+static int vsock_read(struct connection *conn, void *data, size_t len)
+{
+	int ret;
+	struct vsock_connection *vconn = conn->priv;
+
+	do {
+		ret = read(vconn->sock, data, len);
+	} while (ret < 0 && errno == EINTR);
+
+	/* The module has closed its socket, or is gone */
+	if (ret == 0 || (ret < 0 && errno == ECONNRESET))
+		return -ENOTCONN;
+
+	return ret < 0 ? -errno : ret;
+}
+
+static int vsock_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void vsock_exit(struct controller *ctrl)
+{
+	struct vsock_device *vd, *tmp;
+	struct vsock_controller *vsock_ctrl = ctrl->priv;
+
+	TAILQ_FOREACH_SAFE(vd, &vsock_ctrl->devices, node, tmp) {
+		TAILQ_REMOVE(&vsock_ctrl->devices, vd, node);
+		free(vd);
+	}
+	free(vsock_ctrl);
+}
+
+struct controller vsock_controller = {
+	.name = "vsock",
+	.init = vsock_init,
+	.exit = vsock_exit,
+	.connection_create = vsock_connection_create,
+	.connection_destroy = vsock_connection_destroy,
+	.event_loop = vsock_hotplug,
+	.write = vsock_write,
+	.read = vsock_read,
+};
+
+static struct controller *vsock_ctrl_get(void)
+{
+	static struct controller *ctrl;
+	struct vsock_controller *vsock_ctrl;
+
+	if (ctrl)
+		return ctrl;
+
+	vsock_ctrl = malloc(sizeof(*vsock_ctrl));
+	if (!vsock_ctrl)
+		return NULL;
+	TAILQ_INIT(&vsock_ctrl->devices);
+
+	ctrl = malloc(sizeof(*ctrl));
+	if (!ctrl) {
+		free(vsock_ctrl);
+		return NULL;
+	}
+
+	memcpy(ctrl, &vsock_controller, sizeof(*ctrl));
+	ctrl->priv = vsock_ctrl;
+	register_controller(ctrl);
+
+	return ctrl;
+}
+
+int register_vsock_module(const char *address)
+{
+	unsigned int cid, port;
+	struct controller *ctrl;
+	struct vsock_device *vd;
+	struct vsock_controller *vsock_ctrl;
+
+	if (sscanf(address, "%u:%u", &cid, &port) != 2) {
+		pr_err("Invalid vsock address %s, expected cid:port\n",
+		       address);
+		return -EINVAL;
+	}
+
+	ctrl = vsock_ctrl_get();
+	if (!ctrl)
+		return -ENOMEM;
+	vsock_ctrl = ctrl->priv;
+
+	vd = malloc(sizeof(*vd));
+	if (!vd)
+		return -ENOMEM;
+
+	vd->cid = cid;
+	vd->port = port;
+	TAILQ_INSERT_TAIL(&vsock_ctrl->devices, vd, node);
+
+	return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _VSOCK_H_
+#define _VSOCK_H_
+
+#include <config.h>
+#include <debug.h>
+
+#ifdef HAVE_VSOCK
+int register_vsock_module(const char *address);
+#else
+static inline int register_vsock_module(const char *address)
+{
+	pr_err("vsock support has not been compiled.\n");
+
+	return -1;
+}
+#endif
+
+#endif /* _VSOCK_H_ */
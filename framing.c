@@ -0,0 +1,198 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#ifdef __ARM_FEATURE_CRC32
+#include <arm_acle.h>
+#endif
+
+#include <framing.h>
+
+#define CRC32C_POLY	0x82f63b78
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_table_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_table_init);
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc;
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+	}
+	crc = crc64;
+	while (len--)
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+
+	return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		crc = crc32c_hw(crc, data, len);
+	else
+		crc = crc32c_sw(crc, data, len);
+#elif defined(__ARM_FEATURE_CRC32)
+	crc = crc32c_hw(crc, data, len);
+#else
+	crc = crc32c_sw(crc, data, len);
+#endif
+
+	return ~crc;
+}
+
+size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	size_t i;
+	uint8_t *code = dst;
+	uint8_t *p = dst + 1;
+
+	*code = 1;
+	for (i = 0; i < len; i++) {
+		if (src[i] != 0) {
+			*p++ = src[i];
+			(*code)++;
+		}
+
+		if (src[i] == 0 || *code == 0xff) {
+			code = p++;
+			*code = 1;
+		}
+	}
+
+	return p - dst;
+}
+
+int cobs_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t max_len)
+{
+	uint8_t code;
+	size_t i = 0;
+	size_t n = 0;
+
+	while (i < len) {
+		code = src[i++];
+		if (code == 0 || i + code - 1 > len)
+			return -EINVAL;
+
+		if (n + code - 1 > max_len)
+			return -EMSGSIZE;
+		memcpy(dst + n, src + i, code - 1);
+		n += code - 1;
+		i += code - 1;
+
+		if (code != 0xff && i < len) {
+			if (n >= max_len)
+				return -EMSGSIZE;
+			dst[n++] = 0;
+		}
+	}
+
+	return n;
+}
+
+size_t frame_encode(const void *data, size_t len, uint8_t *frame)
+{
+	size_t n;
+	uint32_t crc;
+	uint8_t tmp[len + FRAME_CRC_SIZE];
+
+	crc = htole32(crc32c(0, data, len));
+	memcpy(tmp, data, len);
+	memcpy(tmp + len, &crc, FRAME_CRC_SIZE);
+
+	n = cobs_encode(tmp, len + FRAME_CRC_SIZE, frame);
+	frame[n++] = FRAME_DELIMITER;
+
+	return n;
+}
+
+/*
+ * Decode a frame, without its delimiter.
+ * Returns the size of the data, or a negative error if the frame is corrupted.
+ */
+int frame_decode(const uint8_t *frame, size_t len,
+		 void *data, size_t max_len)
+{
+	int ret;
+	uint32_t crc;
+	uint8_t tmp[max_len + FRAME_CRC_SIZE];
+
+	ret = cobs_decode(frame, len, tmp, sizeof(tmp));
+	if (ret < 0)
+		return ret;
+	if (ret < FRAME_CRC_SIZE)
+		return -EINVAL;
+
+	ret -= FRAME_CRC_SIZE;
+	memcpy(&crc, tmp + ret, FRAME_CRC_SIZE);
+	if (le32toh(crc) != crc32c(0, tmp, ret))
+		return -EBADMSG;
+
+	memcpy(data, tmp, ret);
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FRAMING_H_
+#define _FRAMING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Frames are used on links that don't preserve the message boundaries.
+ * A frame is the COBS encoding of the data followed by its CRC32C
+ * (little endian), terminated by a 0x00 delimiter.
+ * Because COBS never produces 0x00, a receiver that lost some bytes
+ * resynchronizes on the next delimiter.
+ */
+#define FRAME_DELIMITER		0x00
+#define FRAME_CRC_SIZE		4
+
+/* Worst case size of the frame holding len bytes */
+#define FRAME_MAX_SIZE(len)					\
+	((len) + FRAME_CRC_SIZE + ((len) + FRAME_CRC_SIZE) / 254 + 2)
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+
+size_t cobs_encode(const uint8_t *src, size_t len, uint8_t *dst);
+int cobs_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t max_len);
+
+size_t frame_encode(const void *data, size_t len, uint8_t *frame);
+int frame_decode(const uint8_t *frame, size_t len,
+		 void *data, size_t max_len);
+
+#endif /* _FRAMING_H_ */
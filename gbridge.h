@@ -46,10 +46,12 @@
 #endif
 
 int svc_init(void);
+void svc_exit(void);
 int svc_register_driver();
 int svc_send_module_inserted_event(uint8_t intf_id,
 				   uint32_t vendor_id,
 				   uint32_t product_id, uint64_t serial_number);
+int svc_send_module_removed_event(uint8_t intf_id);
 void svc_watchdog_disable(void);
 
 #endif /* _GBRIDGE_H_ */
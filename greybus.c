@@ -17,6 +17,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -27,7 +28,10 @@
 
 #include "controller.h"
 
+/* The requests sent, waiting for their response */
 static TAILQ_HEAD(operation_head, operation) operations;
+static pthread_mutex_t operations_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t operation_id;
 
 enum gb_operation_result {
 	GB_OP_SUCCESS		= 0x00,
@@ -71,31 +75,10 @@ uint8_t greybus_errno_to_result(int err)
 	}
 }
 
-static struct operation *_greybus_alloc_operation(struct gb_operation_msg_hdr
-						  *hdr)
-{
-	struct operation *op;
-
-	op = malloc(sizeof(*op));
-	if (!op)
-		return NULL;
-
-	op->req = malloc(gb_operation_msg_size(hdr));
-	if (!op->req) {
-		free(op);
-		return NULL;
-	}
-
-	op->resp = NULL;
-	memcpy(op->req, hdr, gb_operation_msg_size(hdr));
-
-	return op;
-}
-
 struct operation *greybus_alloc_operation(uint8_t type,
 					  void *payload, size_t len)
 {
-	uint16_t id = 0;
+	uint16_t id;
 	struct operation *op;
 
 	op = malloc(sizeof(*op));
@@ -108,8 +91,12 @@ struct operation *greybus_alloc_operation(uint8_t type,
 		return NULL;
 	}
 
-	if (++id == 0)
-		++id;
+	/* The id 0 is reserved to the unidirectional operations */
+	pthread_mutex_lock(&operations_lock);
+	if (++operation_id == 0)
+		++operation_id;
+	id = operation_id;
+	pthread_mutex_unlock(&operations_lock);
 
 	op->resp = NULL;
 	op->req->type = type;
@@ -149,28 +136,159 @@ int greybus_alloc_response(struct operation *op, size_t size)
 	return 0;
 }
 
+/*
+ * Build the response over the request buffer, for the handlers whose
+ * response is laid out like the request, such as loopback transfers.
+ * The payload is then left as is, and nothing is allocated nor copied.
+ */
+int greybus_alloc_response_in_place(struct operation *op, size_t size)
+{
+	size += sizeof(*op->resp);
+	if (size > gb_operation_msg_size(op->req))
+		return greybus_alloc_response(op, size - sizeof(*op->resp));
+
+	op->resp = op->req;
+	op->resp->size = htole16(size);
+	op->resp->type |= OP_RESPONSE;
+	op->resp->result = 0;
+	op->resp->pad[0] = 0;
+	op->resp->pad[1] = 0;
+
+	return 0;
+}
+
 static void greybus_free_operation(struct operation *op)
 {
+	if (op->resp != op->req)
+		free(op->resp);
 	free(op->req);
-	free(op->resp);
 	free(op);
 }
 
+/* Must be called with operations_lock held, id being little endian */
+static struct operation *greybus_find_operation(uint8_t intf_id,
+						uint16_t cport_id,
+						uint16_t id)
+{
+	struct operation *op;
+	TAILQ_FOREACH(op, &operations, cnode) {
+		if (op->req->operation_id == id) {
+			if (op->intf_id == intf_id &&
+			    op->cport_id == cport_id) {
+				return op;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void greybus_queue_operation(uint8_t intf_id, uint16_t cport_id,
+				    struct operation *op)
+{
+	op->intf_id = intf_id;
+	op->cport_id = cport_id;
+
+	pthread_mutex_lock(&operations_lock);
+	TAILQ_INSERT_TAIL(&operations, op, cnode);
+	pthread_mutex_unlock(&operations_lock);
+}
+
+/* Give up waiting for the response of a request, e.g. on timeout */
+int greybus_cancel_request(uint8_t intf_id, uint16_t cport_id, uint16_t id)
+{
+	struct operation *op;
+
+	pthread_mutex_lock(&operations_lock);
+	op = greybus_find_operation(intf_id, cport_id, htole16(id));
+	if (op)
+		TAILQ_REMOVE(&operations, op, cnode);
+	pthread_mutex_unlock(&operations_lock);
+
+	if (!op)
+		return -ENOENT;
+
+	greybus_free_operation(op);
+
+	return 0;
+}
+
+/*
+ * The request is sent from a copy: op is queued meanwhile, and the other
+ * end, e.g. a gbsim module, may build its response over the message
+ * written (see greybus_alloc_response_in_place()).
+ */
+static int greybus_write_request(uint8_t intf_id, uint16_t cport_id,
+				 struct operation *op, int len)
+{
+	uint8_t buffer[GB_NETLINK_MTU];
+
+	if (len > GB_NETLINK_MTU)
+		return -EMSGSIZE;
+
+	memcpy(buffer, op->req, len);
+
+	return controller_write(intf_id, cport_id, buffer, len);
+}
+
 int greybus_send_request(uint8_t intf_id, uint16_t cport_id,
 			 struct operation *op)
 {
 	int len;
 	int ret;
+	uint16_t id = le16toh(op->req->operation_id);
 
 	len = gb_operation_msg_size(op->req);
 	pr_dump(op->req, len);
 
-	op->intf_id = intf_id;
-	op->cport_id = cport_id;
-	TAILQ_INSERT_TAIL(&operations, op, cnode);
-	ret = controller_write(intf_id, cport_id, op->req, len);
-	if (ret < 0)
+	/*
+	 * The response may be handled, and op freed, before
+	 * controller_write() returns.
+	 */
+	greybus_queue_operation(intf_id, cport_id, op);
+	ret = greybus_write_request(intf_id, cport_id, op, len);
+	if (ret < 0) {
+		greybus_cancel_request(intf_id, cport_id, id);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Send a request from a local cport, such as the loopback probe one, to
+ * the other end of its connection. The response is handled by the driver
+ * registered on the local cport.
+ */
+int greybus_send_request_from(uint8_t intf_id, uint16_t cport_id,
+			      struct operation *op)
+{
+	int len;
+	int ret;
+	struct connection *conn;
+	uint16_t id = le16toh(op->req->operation_id);
+
+	conn = get_connection(intf_id, cport_id);
+	if (!conn) {
+		greybus_free_operation(op);
+		return -EINVAL;
+	}
+
+	len = gb_operation_msg_size(op->req);
+	pr_dump(op->req, len);
+
+	greybus_queue_operation(intf_id, cport_id, op);
+	if (conn->intf1->id == intf_id && conn->cport1_id == cport_id)
+		ret = greybus_write_request(conn->intf2->id, conn->cport2_id,
+					    op, len);
+	else
+		ret = greybus_write_request(conn->intf1->id, conn->cport1_id,
+					    op, len);
+	put_connection(conn);
+	if (ret < 0) {
+		greybus_cancel_request(intf_id, cport_id, id);
 		return ret;
+	}
 
 	return 0;
 }
@@ -191,26 +309,13 @@ static int greybus_send_response(uint8_t intf_id, uint16_t cport_id,
 
 	ret = controller_write(conn->intf1->id, conn->cport1_id,
 			       op->resp, len);
+	put_connection(conn);
 	if (ret < 0)
 		return ret;
 
 	return 0;
 }
 
-struct operation *greybus_find_operation(uint16_t cport_id, uint8_t id)
-{
-	struct operation *op;
-	TAILQ_FOREACH(op, &operations, cnode) {
-		if (op->req->operation_id == id) {
-			if (op->cport_id == cport_id) {
-				return op;
-			}
-		}
-	}
-
-	return NULL;
-}
-
 int compare_operation(const void *a, const void *b)
 {
 	const struct operation_handler *handler_a = a;
@@ -220,17 +325,46 @@ int compare_operation(const void *a, const void *b)
 		(handler_a->id < handler_b->id);
 }
 
-int _greybus_handler(struct greybus_driver *driver, struct operation *op)
+/*
+ * Send a response that doesn't depend on the request, such as a canned
+ * one, from the stack: only its header is filled in.
+ */
+static int greybus_send_constant_response(uint8_t intf_id, uint16_t cport_id,
+					  struct gb_operation_msg_hdr *req,
+					  uint8_t result,
+					  const void *payload, size_t len)
+{
+	struct operation op;
+	uint8_t buffer[sizeof(*op.resp) + GREYBUS_CANNED_PAYLOAD_MAX];
+
+	op.req = req;
+	op.resp = (struct gb_operation_msg_hdr *)buffer;
+	op.resp->size = htole16(sizeof(*op.resp) + len);
+	op.resp->operation_id = req->operation_id;
+	op.resp->type = req->type | OP_RESPONSE;
+	op.resp->result = result;
+	op.resp->pad[0] = 0;
+	op.resp->pad[1] = 0;
+	if (len)
+		memcpy(op.resp + 1, payload, len);
+
+	return greybus_send_response(intf_id, cport_id, &op);
+}
+
+static struct operation_handler *
+greybus_find_handler(struct greybus_driver *driver, uint8_t type)
 {
 	struct operation_handler key;
-	struct operation_handler *handler;
 
-	if (op->resp)
-		key.id = op->resp->type;
-	else
-		key.id = op->req->type;
-	handler = bsearch(&key, driver->operations, driver->count,
-			  sizeof(struct operation_handler), compare_operation);
+	key.id = type;
+	return bsearch(&key, driver->operations, driver->count,
+		       sizeof(struct operation_handler), compare_operation);
+}
+
+static int greybus_call_handler(struct greybus_driver *driver,
+				struct operation_handler *handler,
+				struct operation *op)
+{
 	if (!handler) {
 		pr_err("No handler registered for operation type 0x%02x"
 			" in %s driver\n", op->req->type, driver->name);
@@ -246,12 +380,28 @@ int _greybus_handler(struct greybus_driver *driver, struct operation *op)
 	return handler->callback(op);
 }
 
+int _greybus_handler(struct greybus_driver *driver, struct operation *op)
+{
+	uint8_t type;
+
+	if (op->resp)
+		type = op->resp->type;
+	else
+		type = op->req->type;
+
+	return greybus_call_handler(driver, greybus_find_handler(driver, type),
+				    op);
+}
+
 int greybus_handler(uint8_t intf2_id, uint16_t cport_id,
 		    struct gb_operation_msg_hdr *hdr)
 {
 	int ret;
 	struct operation *op;
+	struct operation request;
 	struct interface *intf2;
+	struct greybus_driver *driver;
+	struct operation_handler *handler;
 
 	pr_dump(hdr, gb_operation_msg_size(hdr));
 
@@ -267,38 +417,141 @@ int greybus_handler(uint8_t intf2_id, uint16_t cport_id,
 	}
 
 	if (hdr->type & OP_RESPONSE) {
-		op = greybus_find_operation(cport_id, hdr->operation_id);
+		pthread_mutex_lock(&operations_lock);
+		op = greybus_find_operation(intf2_id, cport_id,
+					    hdr->operation_id);
+		if (op)
+			TAILQ_REMOVE(&operations, op, cnode);
+		pthread_mutex_unlock(&operations_lock);
 		if (!op) {
 			pr_err("Invalid response id %d on cport %d\n",
 			       le16toh(hdr->operation_id), cport_id);
 			return -EINVAL;
 		}
-		TAILQ_REMOVE(&operations, op, cnode);
-		if (_greybus_alloc_response(op, hdr))
+		if (_greybus_alloc_response(op, hdr)) {
+			greybus_free_operation(op);
 			return -ENOMEM;
+		}
 
 		ret = _greybus_handler(intf2->gb_drivers[cport_id], op);
-	} else {
-		op = _greybus_alloc_operation(hdr);
-		if (!op)
-			return -ENOMEM;
+		greybus_free_operation(op);
 
-		op->intf_id = intf2_id;
-		op->cport_id = cport_id;
-		ret = _greybus_handler(intf2->gb_drivers[cport_id], op);
-		if (!op->resp) {
-			if (greybus_alloc_response(op, 0)) {
-				pr_err("Failed to alloc greybus response\n");
-				ret = -ENOMEM;
-				goto free_op;
-			}
-		}
-		op->resp->result = greybus_errno_to_result(ret);
+		return ret;
+	}
+
+	/* The request doesn't outlive the handler, so it is not copied */
+	op = &request;
+	op->req = hdr;
+	op->resp = NULL;
+	op->intf_id = intf2_id;
+	op->cport_id = cport_id;
+
+	driver = intf2->gb_drivers[cport_id];
+	handler = greybus_find_handler(driver, hdr->type);
+	if (handler && handler->response) {
+		ret = handler->callback ? handler->callback(op) : 0;
+		if (!ret)
+			return greybus_send_constant_response(intf2_id,
+						cport_id, hdr, GB_OP_SUCCESS,
+						handler->response,
+						handler->response_size);
+		return greybus_send_constant_response(intf2_id, cport_id, hdr,
+						greybus_errno_to_result(ret),
+						NULL, 0);
+	}
+
+	ret = greybus_call_handler(driver, handler, op);
+	if (ret == -EINPROGRESS)
+		return 0;
+	if (!op->resp)
+		return greybus_send_constant_response(intf2_id, cport_id, hdr,
+						      greybus_errno_to_result(ret),
+						      NULL, 0);
+	op->resp->result = greybus_errno_to_result(ret);
+
+	ret = greybus_send_response(intf2_id, cport_id, op);
+	if (op->resp != op->req)
+		free(op->resp);
+
+	return ret;
+}
 
-		ret = greybus_send_response(intf2_id, cport_id, op);
+/*
+ * Fail the requests waiting for a response on the cport, e.g. because
+ * its connection is destroyed: their handler gets a response without
+ * payload, whose result matches err.
+ */
+void greybus_fail_operations(uint8_t intf_id, uint16_t cport_id, int err)
+{
+	struct operation *op, *tmp;
+	struct interface *intf;
+	struct greybus_driver *driver = NULL;
+	struct gb_operation_msg_hdr hdr;
+	TAILQ_HEAD(, operation) failed = TAILQ_HEAD_INITIALIZER(failed);
+
+	pthread_mutex_lock(&operations_lock);
+	TAILQ_FOREACH_SAFE(op, &operations, cnode, tmp) {
+		if (op->intf_id != intf_id || op->cport_id != cport_id)
+			continue;
+		TAILQ_REMOVE(&operations, op, cnode);
+		TAILQ_INSERT_TAIL(&failed, op, cnode);
 	}
+	pthread_mutex_unlock(&operations_lock);
 
- free_op:
+	intf = get_interface(intf_id);
+	if (intf && cport_id < GB_NETLINK_NUM_CPORT)
+		driver = intf->gb_drivers[cport_id];
+
+	while ((op = TAILQ_FIRST(&failed))) {
+		TAILQ_REMOVE(&failed, op, cnode);
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.size = htole16(sizeof(hdr));
+		hdr.operation_id = op->req->operation_id;
+		hdr.type = op->req->type | OP_RESPONSE;
+		hdr.result = greybus_errno_to_result(err);
+		if (driver && !_greybus_alloc_response(op, &hdr))
+			_greybus_handler(driver, op);
+		greybus_free_operation(op);
+	}
+}
+
+struct operation *greybus_defer_operation(struct operation *op)
+{
+	struct operation *deferred;
+	size_t len = gb_operation_msg_size(op->req);
+
+	deferred = malloc(sizeof(*deferred));
+	if (!deferred)
+		return NULL;
+
+	deferred->req = malloc(len);
+	if (!deferred->req) {
+		free(deferred);
+		return NULL;
+	}
+
+	memcpy(deferred->req, op->req, len);
+	deferred->resp = NULL;
+	deferred->intf_id = op->intf_id;
+	deferred->cport_id = op->cport_id;
+
+	return deferred;
+}
+
+int greybus_complete_operation(struct operation *op, int result)
+{
+	int ret;
+
+	if (!op->resp) {
+		ret = greybus_send_constant_response(op->intf_id, op->cport_id,
+						op->req,
+						greybus_errno_to_result(result),
+						NULL, 0);
+	} else {
+		op->resp->result = greybus_errno_to_result(result);
+		ret = greybus_send_response(op->intf_id, op->cport_id, op);
+	}
 	greybus_free_operation(op);
 
 	return ret;
@@ -330,6 +583,13 @@ int greybus_register_driver(uint8_t intf_id, uint16_t cport_id,
 	}
 
 	for (i = 0; i < driver->count; i++) {
+		if (driver->operations[id].response_size >
+		    GREYBUS_CANNED_PAYLOAD_MAX) {
+			pr_err("The canned response of %s is too big\n",
+			       driver->operations[id].name);
+			return -EINVAL;
+		}
+
 		if (driver->operations[id].id < id_min) {
 			pr_err("Operations must sorted by operation id\n");
 			return -EINVAL;
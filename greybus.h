@@ -16,11 +16,16 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <endian.h>
+#include <stddef.h>
 #include <sys/queue.h>
 
 #ifndef _GREYBUS_H_
 #define _GREYBUS_H_
 
+/* Largest payload of a canned response, see REQUEST_CANNED_HANDLER */
+#define GREYBUS_CANNED_PAYLOAD_MAX	16
+
 struct operation {
 	struct gb_operation_msg_hdr *req;
 	struct gb_operation_msg_hdr *resp;
@@ -34,6 +39,9 @@ struct operation_handler {
 	uint8_t id;
 	operation_handler_t *callback;
 	const char *name;
+	/* Payload of a constant response, sent without calling callback */
+	const void *response;
+	size_t response_size;
 };
 
 struct greybus_driver {
@@ -61,6 +69,30 @@ static inline int greybus_empty_callback(struct operation *op)
 		.name = #operation_id,					\
 	}
 
+/*
+ * The response to the request never changes: it is given as a type and
+ * the initializers of its fields, e.g. .status = GB_CONTROL_INTF_PM_OK.
+ * The handler only fills in the header, and sends it without allocating.
+ * The little endian fields must be initialized with GB_LE16 or GB_LE32.
+ */
+#define REQUEST_CANNED_HANDLER(operation_id, response_type, ...)	\
+	REQUEST_CANNED_HANDLER_CB(operation_id, NULL, response_type,	\
+				  __VA_ARGS__)
+
+/*
+ * Same, with a callback looking at the request first. The canned response
+ * is only sent if it returns 0.
+ */
+#define REQUEST_CANNED_HANDLER_CB(operation_id, operation_handler,	\
+				  response_type, ...)			\
+	{								\
+		.id = operation_id,					\
+		.callback = operation_handler,				\
+		.name = #operation_id,					\
+		.response = &(const response_type) { __VA_ARGS__ },	\
+		.response_size = sizeof(response_type),			\
+	}
+
 #define REQUEST_NO_HANDLER(operation_id)				\
 	{								\
 		.id = operation_id,					\
@@ -82,6 +114,14 @@ static inline int greybus_empty_callback(struct operation *op)
 		.name = #operation_id,					\
 	}
 
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define GB_LE16(x)	((uint16_t)(x))
+#define GB_LE32(x)	((uint32_t)(x))
+#else
+#define GB_LE16(x)	((uint16_t)((((x) & 0xff) << 8) | (((x) >> 8) & 0xff)))
+#define GB_LE32(x)	(((uint32_t)GB_LE16(x) << 16) | GB_LE16((x) >> 16))
+#endif
+
 #define OPERATION_COUNT(operations) (sizeof(operations)/sizeof(operations[0]))
 
 #define operation_to_request(op)	\
@@ -98,12 +138,29 @@ int greybus_init(void);
 struct operation *greybus_alloc_operation(uint8_t type,
 					  void *payload, size_t len);
 int greybus_alloc_response(struct operation *op, size_t size);
+int greybus_alloc_response_in_place(struct operation *op, size_t size);
 int greybus_register_driver(uint8_t intf_id, uint16_t cport_id,
 			    struct greybus_driver *driver);
 void greybus_unregister_driver(uint8_t intf_id, uint16_t cport_id);
+/*
+ * A request is handled from hdr, which may be overwritten by its response:
+ * the caller must not use it afterwards.
+ */
 int greybus_handler(uint8_t intf_id, uint16_t cport_id,
 		    struct gb_operation_msg_hdr *hdr);
+/*
+ * A handler that can't answer right away, e.g. because it would block the
+ * caller of greybus_handler(), takes a copy of the operation and returns
+ * -EINPROGRESS. The response is sent by greybus_complete_operation(),
+ * which frees the copy.
+ */
+struct operation *greybus_defer_operation(struct operation *op);
+int greybus_complete_operation(struct operation *op, int result);
 int greybus_send_request(uint8_t intf_id, uint16_t cport_id,
 			 struct operation *op);
+int greybus_send_request_from(uint8_t intf_id, uint16_t cport_id,
+			      struct operation *op);
+int greybus_cancel_request(uint8_t intf_id, uint16_t cport_id, uint16_t id);
+void greybus_fail_operations(uint8_t intf_id, uint16_t cport_id, int err);
 
 #endif /* _GREYBUS_H_ */
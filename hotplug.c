@@ -0,0 +1,396 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2017 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <hotplug.h>
+
+/* Secs after which a module stuck in a phase is given up */
+#define HOTPLUG_TIMEOUT		30
+
+struct hotplug {
+	uint8_t intf_id;
+	uint32_t vendor_id;
+	uint32_t product_id;
+	uint64_t serial_id;
+	enum hotplug_phase phase;
+	/* usecs, at the start of each phase */
+	uint64_t time[HOTPLUG_PHASES];
+	/* MODULE_INSERTED is being sent, the entry is freed once it's done */
+	int sending;
+	int removed;
+	TAILQ_ENTRY(hotplug) node;
+};
+
+struct hotplug_stats {
+	unsigned int count[HOTPLUG_PHASES];
+	uint64_t total[HOTPLUG_PHASES];
+	uint64_t max[HOTPLUG_PHASES];
+	unsigned int enumerated;
+	unsigned int stalled;
+	unsigned int max_active;
+};
+
+static const char *phase_names[HOTPLUG_PHASES] = {
+	[HOTPLUG_QUEUED] = "queued",
+	[HOTPLUG_INSERTED] = "activate",
+	[HOTPLUG_ACTIVATED] = "control",
+	[HOTPLUG_CONTROL] = "manifest",
+	[HOTPLUG_MANIFEST] = "bundles",
+};
+
+static TAILQ_HEAD(hotplug_head, hotplug) hotplugs =
+	TAILQ_HEAD_INITIALIZER(hotplugs);
+static unsigned int hotplug_max = HOTPLUG_MAX_DEFAULT;
+/* Number of modules between MODULE_INSERTED and their manifest */
+static unsigned int active;
+static struct hotplug_stats stats;
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hotplug_cond;
+static pthread_cond_t hotplug_sent_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t hotplug_thread;
+static int hotplug_run;
+
+static uint64_t hotplug_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int holds_slot(enum hotplug_phase phase)
+{
+	return phase >= HOTPLUG_INSERTED && phase < HOTPLUG_MANIFEST;
+}
+
+void hotplug_set_max(unsigned int max)
+{
+	hotplug_max = max ? max : 1;
+}
+
+static struct hotplug *hotplug_find(uint8_t intf_id)
+{
+	struct hotplug *hp;
+
+	TAILQ_FOREACH(hp, &hotplugs, node) {
+		if (hp->intf_id == intf_id)
+			return hp;
+	}
+
+	return NULL;
+}
+
+static void hotplug_remove(struct hotplug *hp)
+{
+	if (holds_slot(hp->phase)) {
+		active--;
+		if (hotplug_run)
+			pthread_cond_signal(&hotplug_cond);
+	}
+
+	TAILQ_REMOVE(&hotplugs, hp, node);
+	if (hp->sending)
+		hp->removed = 1;
+	else
+		free(hp);
+}
+
+static void hotplug_report(struct hotplug *hp)
+{
+	uint64_t *t = hp->time;
+
+	pr_info("Interface %u enumerated in %llu ms (queued %llu, "
+		"activate %llu, control %llu, manifest %llu, bundles %llu)\n",
+		hp->intf_id,
+		(unsigned long long)(t[HOTPLUG_READY] - t[HOTPLUG_QUEUED]) / 1000,
+		(unsigned long long)(t[HOTPLUG_INSERTED] - t[HOTPLUG_QUEUED]) / 1000,
+		(unsigned long long)(t[HOTPLUG_ACTIVATED] - t[HOTPLUG_INSERTED]) / 1000,
+		(unsigned long long)(t[HOTPLUG_CONTROL] - t[HOTPLUG_ACTIVATED]) / 1000,
+		(unsigned long long)(t[HOTPLUG_MANIFEST] - t[HOTPLUG_CONTROL]) / 1000,
+		(unsigned long long)(t[HOTPLUG_READY] - t[HOTPLUG_MANIFEST]) / 1000);
+}
+
+/* Called locked. The phases skipped last 0. */
+static void hotplug_advance(struct hotplug *hp, enum hotplug_phase phase,
+			    uint64_t now)
+{
+	int p;
+	uint64_t duration;
+
+	if (phase <= hp->phase)
+		return;
+
+	duration = now - hp->time[hp->phase];
+	stats.count[hp->phase]++;
+	stats.total[hp->phase] += duration;
+	if (duration > stats.max[hp->phase])
+		stats.max[hp->phase] = duration;
+
+	if (!holds_slot(hp->phase) && holds_slot(phase)) {
+		active++;
+		if (active > stats.max_active)
+			stats.max_active = active;
+	} else if (holds_slot(hp->phase) && !holds_slot(phase)) {
+		active--;
+		if (hotplug_run)
+			pthread_cond_signal(&hotplug_cond);
+	}
+
+	if (hp->phase < HOTPLUG_MANIFEST && phase >= HOTPLUG_MANIFEST)
+		stats.enumerated++;
+
+	for (p = hp->phase + 1; p <= phase; p++)
+		hp->time[p] = now;
+	hp->phase = phase;
+
+	if (phase == HOTPLUG_READY) {
+		hotplug_report(hp);
+		hotplug_remove(hp);
+	}
+}
+
+/*
+ * Called locked. A module without any bundle connection is done, one
+ * stuck earlier has failed: either way, its slot is given back.
+ */
+static void hotplug_expire(uint64_t now)
+{
+	struct hotplug *hp, *tmp;
+
+	TAILQ_FOREACH_SAFE(hp, &hotplugs, node, tmp) {
+		if (hp->phase == HOTPLUG_QUEUED || hp->sending ||
+		    now - hp->time[hp->phase] < HOTPLUG_TIMEOUT * 1000000ULL)
+			continue;
+
+		if (hp->phase != HOTPLUG_MANIFEST) {
+			pr_err("The enumeration of interface %u is stalled (%s)\n",
+			       hp->intf_id, phase_names[hp->phase]);
+			stats.stalled++;
+		}
+		hotplug_remove(hp);
+	}
+}
+
+/*
+ * Called locked. The lock is dropped while the event is sent, as the
+ * netlink thread needs it to report the progress of the interfaces:
+ * hotplug_cancel() waits for the event to be sent meanwhile, so the
+ * kernel can't get MODULE_REMOVED first.
+ */
+static int hotplug_insert(struct hotplug *hp, uint64_t now)
+{
+	int ret;
+
+	hotplug_advance(hp, HOTPLUG_INSERTED, now);
+	hp->sending = 1;
+	pthread_mutex_unlock(&hotplug_lock);
+	ret = svc_send_module_inserted_event(hp->intf_id, hp->vendor_id,
+					     hp->product_id, hp->serial_id);
+	pthread_mutex_lock(&hotplug_lock);
+	hp->sending = 0;
+	pthread_cond_broadcast(&hotplug_sent_cond);
+
+	if (hp->removed) {
+		free(hp);
+	} else if (ret < 0) {
+		pr_err("Failed to send the hotplug event of interface %u\n",
+		       hp->intf_id);
+		hotplug_remove(hp);
+	}
+
+	return ret;
+}
+
+/* Send the MODULE_INSERTED events queued, as the slots are given back */
+static void *hotplug_thread_fn(void *data)
+{
+	uint64_t now;
+	struct timespec ts;
+	struct hotplug *hp;
+
+	pthread_mutex_lock(&hotplug_lock);
+	while (hotplug_run) {
+		now = hotplug_now();
+		hotplug_expire(now);
+
+		TAILQ_FOREACH(hp, &hotplugs, node) {
+			if (hp->phase == HOTPLUG_QUEUED)
+				break;
+		}
+
+		if (hp && active < hotplug_max) {
+			hotplug_insert(hp, now);
+			continue;
+		}
+
+		/* Wake up every second, to expire the stalled modules */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec++;
+		pthread_cond_timedwait(&hotplug_cond, &hotplug_lock, &ts);
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return NULL;
+}
+
+/* Called locked */
+static int hotplug_thread_start(void)
+{
+	int ret;
+	pthread_condattr_t attr;
+
+	if (hotplug_run)
+		return 0;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&hotplug_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	hotplug_run = 1;
+	ret = pthread_create(&hotplug_thread, NULL, hotplug_thread_fn, NULL);
+	if (ret) {
+		pthread_cond_destroy(&hotplug_cond);
+		hotplug_run = 0;
+		return -ret;
+	}
+
+	return 0;
+}
+
+/*
+ * The event is sent right away if a slot is free, and its error
+ * returned. Otherwise, it is sent later by the hotplug thread.
+ */
+int hotplug_queue(struct interface *intf)
+{
+	int ret;
+	uint64_t now;
+	struct hotplug *hp;
+	struct hotplug *queued;
+
+	hp = malloc(sizeof(*hp));
+	if (!hp)
+		return -ENOMEM;
+
+	now = hotplug_now();
+	hp->intf_id = intf->id;
+	hp->vendor_id = intf->vendor_id;
+	hp->product_id = intf->product_id;
+	hp->serial_id = intf->serial_id;
+	hp->phase = HOTPLUG_QUEUED;
+	hp->time[HOTPLUG_QUEUED] = now;
+	hp->sending = 0;
+	hp->removed = 0;
+
+	pthread_mutex_lock(&hotplug_lock);
+	hotplug_expire(now);
+
+	TAILQ_FOREACH(queued, &hotplugs, node) {
+		if (queued->phase == HOTPLUG_QUEUED)
+			break;
+	}
+
+	TAILQ_INSERT_TAIL(&hotplugs, hp, node);
+	if (!queued && active < hotplug_max) {
+		ret = hotplug_insert(hp, now);
+		pthread_mutex_unlock(&hotplug_lock);
+		return ret;
+	}
+
+	pr_dbg("Interface %u queued for hotplug\n", intf->id);
+	ret = hotplug_thread_start();
+	if (ret) {
+		pr_err("Failed to create the hotplug thread\n");
+		hotplug_remove(hp);
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return ret;
+}
+
+void hotplug_event(uint8_t intf_id, enum hotplug_phase phase)
+{
+	struct hotplug *hp;
+
+	pthread_mutex_lock(&hotplug_lock);
+	hp = hotplug_find(intf_id);
+	if (hp)
+		hotplug_advance(hp, phase, hotplug_now());
+	pthread_mutex_unlock(&hotplug_lock);
+}
+
+int hotplug_cancel(uint8_t intf_id)
+{
+	int queued = 0;
+	struct hotplug *hp;
+
+	pthread_mutex_lock(&hotplug_lock);
+	while ((hp = hotplug_find(intf_id)) && hp->sending)
+		pthread_cond_wait(&hotplug_sent_cond, &hotplug_lock);
+	if (hp) {
+		queued = hp->phase == HOTPLUG_QUEUED;
+		hotplug_remove(hp);
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	return queued;
+}
+
+void hotplug_exit(void)
+{
+	int p;
+	struct hotplug *hp;
+
+	pthread_mutex_lock(&hotplug_lock);
+	if (hotplug_run) {
+		hotplug_run = 0;
+		pthread_cond_signal(&hotplug_cond);
+		pthread_mutex_unlock(&hotplug_lock);
+		pthread_join(hotplug_thread, NULL);
+		pthread_mutex_lock(&hotplug_lock);
+		pthread_cond_destroy(&hotplug_cond);
+	}
+
+	while ((hp = TAILQ_FIRST(&hotplugs)))
+		hotplug_remove(hp);
+	pthread_mutex_unlock(&hotplug_lock);
+
+	if (!stats.count[HOTPLUG_QUEUED])
+		return;
+
+	pr_info("hotplug: %u modules enumerated, %u stalled, "
+		"up to %u at once\n",
+		stats.enumerated, stats.stalled, stats.max_active);
+	for (p = HOTPLUG_QUEUED; p < HOTPLUG_READY; p++) {
+		if (!stats.count[p])
+			continue;
+		pr_info("hotplug: %-8s avg %llu ms, max %llu ms\n",
+			phase_names[p],
+			(unsigned long long)(stats.total[p] / stats.count[p]) / 1000,
+			(unsigned long long)stats.max[p] / 1000);
+	}
+}
@@ -0,0 +1,59 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2017 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _HOTPLUG_H_
+#define _HOTPLUG_H_
+
+#include <stdint.h>
+
+/*
+ * The hotplug pipeline bounds the number of modules being enumerated at
+ * once: the MODULE_INSERTED event of the other ones is queued, and sent
+ * once a module has been enumerated, i.e. once its manifest has been
+ * received by the kernel.
+ * The enumeration of each module is followed through its phases, which
+ * are timed. A phase starts with the event that ends the previous one.
+ */
+enum hotplug_phase {
+	HOTPLUG_QUEUED,		/* Waiting for MODULE_INSERTED to be sent */
+	HOTPLUG_INSERTED,	/* Waiting for the interface activation */
+	HOTPLUG_ACTIVATED,	/* Waiting for the control connection */
+	HOTPLUG_CONTROL,	/* Waiting for the manifest */
+	HOTPLUG_MANIFEST,	/* Waiting for a bundle connection */
+	HOTPLUG_READY,
+	HOTPLUG_PHASES,
+};
+
+/* Default number of modules enumerated at once */
+#define HOTPLUG_MAX_DEFAULT	4
+
+struct interface;
+
+void hotplug_set_max(unsigned int max);
+/* Called by interface_hotplug() */
+int hotplug_queue(struct interface *intf);
+/* Move the interface to phase, if it is not already past it */
+void hotplug_event(uint8_t intf_id, enum hotplug_phase phase);
+/*
+ * Stop following the interface, e.g. when it is destroyed. Return 1 if
+ * its MODULE_INSERTED event had not been sent yet.
+ */
+int hotplug_cancel(uint8_t intf_id);
+void hotplug_exit(void);
+
+#endif /* _HOTPLUG_H_ */
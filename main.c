@@ -18,13 +18,33 @@
 
 #include <errno.h>
 #include <signal.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <debug.h>
 #include <controller.h>
+#include <hotplug.h>
+#include <manifest_cache.h>
 
 #include "gbridge.h"
+#include "controllers/bluetooth.h"
+#include "controllers/gbsim.h"
+#include "controllers/loopback_probe.h"
+#include "controllers/shm.h"
+#include "controllers/tcpip.h"
 #include "controllers/uart.h"
+#include "controllers/unix_socket.h"
+#include "controllers/vsock.h"
+
+struct uart_options {
+	const char *device;
+	int baudrate;
+	int framing;
+	int aggregate;
+	struct tx_queue_aggregation aggregation;
+	int mtu;
+	int compress;
+};
 
 int run;
 
@@ -32,10 +52,60 @@ static void help(void)
 {
 	printf("gbridge: Greybus bridge application\n"
 		"\t-h: Print the help\n"
+		"\t-E count: enumerate up to count modules at once (default 4)\n"
 #ifdef HAVE_UART
 		"uart options:\n"
-		"\t-p uart_device: set the uart device\n"
-		"\t-b baudrate: set the uart baudrate\n"
+		"\t-p uart_device: add an uart device (may be repeated)\n"
+		"\t-b baudrate: set the baudrate of the last uart added\n"
+		"\t-f framing: set the framing (none or cobs) of the last uart\n"
+		"\t-a usecs[,bytes]: aggregate the messages of the last uart\n"
+		"\t-l mtu: split the messages bigger than mtu (last uart)\n"
+#ifdef HAVE_LIBLZ4
+		"\t-z: offer compression on the connections of the last uart\n"
+#endif
+		"\t-b, -f, -a, -l and -z given before any -p set the default\n"
+#endif
+#ifdef HAVE_LIBBLUETOOTH
+		"bluetooth options:\n"
+		"\t-A usecs[,bytes]: aggregate the messages sent to the modules\n"
+#ifdef HAVE_LIBLZ4
+		"\t-Z: offer compression on the connections of the modules\n"
+#endif
+#endif
+#ifdef HAVE_TCPIP
+		"tcpip options:\n"
+		"\t-t file: hotplug the modules listed (host:port) in file\n"
+		"\t-T file: use file to cache the modules found by avahi\n"
+#endif
+#ifdef HAVE_UNIX_SOCKET
+		"unix socket options:\n"
+		"\t-u dir: connect the modules listening in dir\n"
+#endif
+#ifdef HAVE_SHM
+		"shared memory options:\n"
+		"\t-s socket: connect the module listening on socket\n"
+		"\t-y usecs: busy poll the rings for usecs before to sleep\n"
+#endif
+#ifdef HAVE_VSOCK
+		"vsock options:\n"
+		"\t-v cid:port: connect the module listening at cid:port\n"
+#endif
+		"loopback probe options:\n"
+		"\t-P intf:cport[,key=value...]: send loopback operations to\n"
+		"\t\tthe cport and report the latency and the throughput:\n"
+		"\t\ttype (ping, transfer or sink), size (bytes),\n"
+		"\t\trate (ops/s), concurrency, count, timeout (msecs)\n"
+#ifdef GBSIM
+		"gbsim options:\n"
+		"\t-m manifest: simulate the modules of a manifest, or of each\n"
+		"\t\tmanifest of a directory (may be repeated)\n"
+		"\t-M count: simulate count modules per manifest\n"
+		"\t-H msecs: wait msecs between two hotplugs (0 for a burst)\n"
+		"\t-I key=value[,...]: impair the links to the modules:\n"
+		"\t\tdelay and jitter (msecs), jitter-dist (uniform or\n"
+		"\t\tnormal), rate (kbit/s), loss and reorder (percent)\n"
+		"\t-M, -H and -I apply to every following -m, until they\n"
+		"\t\tare given again\n"
 #endif
 		);
 }
@@ -48,31 +118,170 @@ static void signal_handler(int sig)
 int main(int argc, char *argv[])
 {
 	int c;
+	int i;
 	int ret;
 
+	int busy_poll;
 	int baudrate = 115200;
-	const char *uart = NULL;
+	enum uart_framing framing = UART_FRAMING_NONE;
+	struct tx_queue_aggregation aggregation = { 0, 0 };
+	struct tx_queue_aggregation bt_aggregation;
+	int mtu = 0;
+	int compress = 0;
+	struct uart_options *uarts = NULL;
+	struct uart_options *uart = NULL;
+	int uart_count = 0;
+	unsigned int hotplug_max;
+	unsigned int gbsim_count = 1;
+	unsigned int gbsim_stagger = 0;
+	struct gbsim_impairment gbsim_impairment = { 0 };
 
 	signal(SIGINT, signal_handler);
 	signal(SIGHUP, signal_handler);
 	signal(SIGTERM, signal_handler);
+	/* A module closing its socket must only fail the write */
+	signal(SIGPIPE, SIG_IGN);
 
 	register_controllers();
 
-	while ((c = getopt(argc, argv, "p:b:m:")) != -1) {
+	while ((c = getopt(argc, argv, "p:b:f:a:l:zA:Zm:M:H:I:P:t:T:u:s:y:v:E:")) != -1) {
 		switch(c) {
 		case 'p':
-			uart = optarg;
+			uart = realloc(uarts, (uart_count + 1) * sizeof(*uarts));
+			if (!uart)
+				return -ENOMEM;
+			uarts = uart;
+			uart = &uarts[uart_count++];
+			uart->device = optarg;
+			uart->baudrate = -1;
+			uart->framing = -1;
+			uart->aggregate = 0;
+			uart->mtu = -1;
+			uart->compress = -1;
 			break;
 		case 'b':
-			if (sscanf(optarg, "%u", &baudrate) != 1) {
+			if (sscanf(optarg, "%u", uart ? &uart->baudrate
+						      : &baudrate) != 1) {
+				help();
+				return -EINVAL;
+			}
+			break;
+		case 'f':
+			if (strcmp(optarg, "cobs") == 0) {
+				ret = UART_FRAMING_COBS;
+			} else if (strcmp(optarg, "none") == 0) {
+				ret = UART_FRAMING_NONE;
+			} else {
+				help();
+				return -EINVAL;
+			}
+
+			if (uart)
+				uart->framing = ret;
+			else
+				framing = ret;
+			break;
+		case 'a':
+			ret = tx_queue_parse_aggregation(optarg, uart ?
+							 &uart->aggregation :
+							 &aggregation);
+			if (ret) {
+				help();
+				return ret;
+			}
+			if (uart)
+				uart->aggregate = 1;
+			break;
+		case 'l':
+			if (sscanf(optarg, "%u", uart ? &uart->mtu
+						      : &mtu) != 1) {
 				help();
 				return -EINVAL;
 			}
 			break;
+		case 'z':
+#ifdef HAVE_LIBLZ4
+			if (uart)
+				uart->compress = 1;
+			else
+				compress = 1;
+			break;
+#else
+			pr_err("You must build gbridge with lz4 enabled\n");
+			return -EINVAL;
+#endif
+		case 'A':
+			ret = tx_queue_parse_aggregation(optarg,
+							 &bt_aggregation);
+			if (ret) {
+				help();
+				return ret;
+			}
+			ret = bluetooth_set_aggregation(&bt_aggregation);
+			if (ret)
+				return ret;
+			break;
+		case 'Z':
+#ifdef HAVE_LIBLZ4
+			ret = bluetooth_set_compression(1);
+			if (ret)
+				return ret;
+			break;
+#else
+			pr_err("You must build gbridge with lz4 enabled\n");
+			return -EINVAL;
+#endif
+		case 't':
+			ret = tcpip_set_config_file(optarg);
+			if (ret)
+				return ret;
+			break;
+		case 'T':
+			ret = tcpip_set_cache_file(optarg);
+			if (ret)
+				return ret;
+			break;
+		case 'u':
+			ret = register_unix_controller(optarg);
+			if (ret)
+				return ret;
+			break;
+		case 's':
+			ret = register_shm_controller(optarg);
+			if (ret)
+				return ret;
+			break;
+		case 'y':
+			if (sscanf(optarg, "%d", &busy_poll) != 1) {
+				help();
+				return -EINVAL;
+			}
+			shm_set_busy_poll(busy_poll);
+			break;
+		case 'v':
+			ret = register_vsock_module(optarg);
+			if (ret)
+				return ret;
+			break;
+		case 'E':
+			if (sscanf(optarg, "%u", &hotplug_max) != 1) {
+				help();
+				return -EINVAL;
+			}
+			hotplug_set_max(hotplug_max);
+			break;
+		case 'P':
+			ret = register_loopback_probe(optarg);
+			if (ret) {
+				help();
+				return ret;
+			}
+			break;
 		case 'm':
 #ifdef GBSIM
-			ret = register_gbsim_controller(optarg);
+			ret = register_gbsim_controller(optarg, gbsim_count,
+							gbsim_stagger,
+							&gbsim_impairment);
 			if (ret)
 				return ret;
 			break;
@@ -80,6 +289,25 @@ int main(int argc, char *argv[])
 			pr_err("You must build gbridge with gbsim enabled\n");
 			return -EINVAL;
 #endif
+		case 'M':
+			if (sscanf(optarg, "%u", &gbsim_count) != 1) {
+				help();
+				return -EINVAL;
+			}
+			break;
+		case 'H':
+			if (sscanf(optarg, "%u", &gbsim_stagger) != 1) {
+				help();
+				return -EINVAL;
+			}
+			break;
+		case 'I':
+			ret = gbsim_parse_impairment(optarg, &gbsim_impairment);
+			if (ret) {
+				help();
+				return ret;
+			}
+			break;
 		default:
 			help();
 			return -EINVAL;
@@ -92,17 +320,36 @@ int main(int argc, char *argv[])
 		return ret;
 	}
 
-	if (uart) {
-		ret = register_uart_controller(uart, baudrate);
+	for (i = 0; i < uart_count; i++) {
+		uart = &uarts[i];
+		if (uart->baudrate < 0)
+			uart->baudrate = baudrate;
+		if (uart->framing < 0)
+			uart->framing = framing;
+		if (!uart->aggregate)
+			uart->aggregation = aggregation;
+		if (uart->mtu < 0)
+			uart->mtu = mtu;
+		if (uart->compress < 0)
+			uart->compress = compress;
+
+		ret = register_uart_controller(uart->device, uart->baudrate,
+					       uart->framing,
+					       &uart->aggregation, uart->mtu,
+					       uart->compress);
 		if (ret)
 			return ret;
 	}
+	/* The options have been copied by the controllers */
+	free(uarts);
 
 	run = 1;
 	controllers_init();
 	while(run)
 		sleep(1);
 	controllers_exit();
+	hotplug_exit();
+	manifest_cache_exit();
 
 	return 0;
 }
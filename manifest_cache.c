@@ -0,0 +1,478 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2017 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <debug.h>
+#include <controller.h>
+#include <framing.h>
+#include <manifest_cache.h>
+
+/* Number of manifests kept, the least recently used ones are dropped */
+#define MANIFEST_CACHE_MAX		64
+
+/*
+ * The operation id of the checks. The kernel numbers the operations of
+ * a connection from 1, so it only reaches it after a long time.
+ */
+#define MANIFEST_CACHE_OP_ID		0xffff
+
+/* In secs */
+#define MANIFEST_CACHE_CHECK_DELAY	5
+#define MANIFEST_CACHE_CHECK_TIMEOUT	10
+
+struct manifest_cache_entry {
+	uint32_t vendor_id;
+	uint32_t product_id;
+	uint64_t serial_id;
+	uint32_t crc;
+	uint16_t size;
+	TAILQ_ENTRY(manifest_cache_entry) node;
+	uint8_t manifest[];
+};
+
+/* A manifest served from the cache, to fetch again from the module */
+struct manifest_cache_check {
+	uint8_t intf_id;
+	uint32_t vendor_id;
+	uint32_t product_id;
+	uint64_t serial_id;
+	int sent;
+	/* The manifest has changed: the module is to be enumerated again */
+	int changed;
+	time_t deadline;
+	TAILQ_ENTRY(manifest_cache_check) node;
+};
+
+struct manifest_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t checked;
+	uint64_t changed;
+};
+
+static TAILQ_HEAD(entry_head, manifest_cache_entry) entries =
+	TAILQ_HEAD_INITIALIZER(entries);
+static unsigned int entry_count;
+static TAILQ_HEAD(check_head, manifest_cache_check) checks =
+	TAILQ_HEAD_INITIALIZER(checks);
+static struct manifest_cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t check_cond;
+static pthread_t check_thread;
+static int check_run;
+
+static time_t manifest_cache_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static int intf_match(const struct interface *intf, uint32_t vendor_id,
+		      uint32_t product_id, uint64_t serial_id)
+{
+	return intf->vendor_id == vendor_id &&
+	       intf->product_id == product_id &&
+	       intf->serial_id == serial_id;
+}
+
+/* The manifest of intf, if its CRC matches the one advertised */
+static struct manifest_cache_entry *entry_find(struct interface *intf)
+{
+	struct manifest_cache_entry *entry;
+
+	TAILQ_FOREACH(entry, &entries, node) {
+		if (!intf_match(intf, entry->vendor_id, entry->product_id,
+				entry->serial_id))
+			continue;
+		if (intf->manifest_crc && intf->manifest_crc != entry->crc)
+			return NULL;
+		return entry;
+	}
+
+	return NULL;
+}
+
+static void entry_remove(struct manifest_cache_entry *entry)
+{
+	TAILQ_REMOVE(&entries, entry, node);
+	entry_count--;
+	free(entry);
+}
+
+/* Record the manifest of intf, replacing the previous one */
+static void entry_store(struct interface *intf, const void *manifest,
+			uint16_t size, uint32_t crc)
+{
+	struct manifest_cache_entry *entry;
+
+	TAILQ_FOREACH(entry, &entries, node) {
+		if (intf_match(intf, entry->vendor_id, entry->product_id,
+			       entry->serial_id)) {
+			entry_remove(entry);
+			break;
+		}
+	}
+
+	if (entry_count == MANIFEST_CACHE_MAX)
+		entry_remove(TAILQ_LAST(&entries, entry_head));
+
+	entry = malloc(sizeof(*entry) + size);
+	if (!entry)
+		return;
+
+	entry->vendor_id = intf->vendor_id;
+	entry->product_id = intf->product_id;
+	entry->serial_id = intf->serial_id;
+	entry->crc = crc;
+	entry->size = size;
+	memcpy(entry->manifest, manifest, size);
+	TAILQ_INSERT_HEAD(&entries, entry, node);
+	entry_count++;
+}
+
+static struct manifest_cache_check *check_find(struct interface *intf)
+{
+	struct manifest_cache_check *check;
+
+	TAILQ_FOREACH(check, &checks, node) {
+		if (check->intf_id == intf->id &&
+		    intf_match(intf, check->vendor_id, check->product_id,
+			       check->serial_id))
+			return check;
+	}
+
+	return NULL;
+}
+
+static void check_remove(struct manifest_cache_check *check)
+{
+	TAILQ_REMOVE(&checks, check, node);
+	free(check);
+}
+
+static int check_send(uint8_t intf_id)
+{
+	struct gb_operation_msg_hdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.size = htole16(sizeof(hdr));
+	hdr.operation_id = htole16(MANIFEST_CACHE_OP_ID);
+	hdr.type = GB_CONTROL_TYPE_GET_MANIFEST;
+
+	return controller_write(intf_id, CONTROL_CPORT, &hdr, sizeof(hdr));
+}
+
+static void *manifest_cache_check_thread(void *data)
+{
+	int ret;
+	int changed;
+	time_t now;
+	time_t next;
+	uint8_t intf_id;
+	struct timespec ts;
+	struct manifest_cache_check *check, *tmp;
+
+	pthread_mutex_lock(&cache_lock);
+	while (check_run) {
+		now = manifest_cache_now();
+		next = now + MANIFEST_CACHE_CHECK_TIMEOUT;
+		changed = 0;
+		TAILQ_FOREACH_SAFE(check, &checks, node, tmp) {
+			if (check->changed) {
+				changed = 1;
+				intf_id = check->intf_id;
+				check_remove(check);
+				break;
+			}
+
+			if (check->deadline > now) {
+				if (check->deadline < next)
+					next = check->deadline;
+				continue;
+			}
+
+			if (check->sent) {
+				pr_err("No answer to the manifest check of interface %u\n",
+				       check->intf_id);
+				check_remove(check);
+				continue;
+			}
+
+			check->sent = 1;
+			check->deadline = now + MANIFEST_CACHE_CHECK_TIMEOUT;
+			intf_id = check->intf_id;
+			break;
+		}
+
+		if (!check) {
+			ts.tv_sec = next;
+			ts.tv_nsec = 0;
+			pthread_cond_timedwait(&check_cond, &cache_lock, &ts);
+			continue;
+		}
+
+		/*
+		 * The kernel has enumerated the module with the manifest of
+		 * the cache, which has been updated since.
+		 */
+		if (changed) {
+			pthread_mutex_unlock(&cache_lock);
+			interface_replug(intf_id);
+			pthread_mutex_lock(&cache_lock);
+			continue;
+		}
+
+		/* The response may be received before the write returns */
+		pthread_mutex_unlock(&cache_lock);
+		ret = check_send(intf_id);
+		pthread_mutex_lock(&cache_lock);
+		if (ret < 0) {
+			TAILQ_FOREACH(check, &checks, node) {
+				if (check->intf_id == intf_id) {
+					check_remove(check);
+					break;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return NULL;
+}
+
+/* Called locked */
+static void check_schedule(struct interface *intf)
+{
+	int ret;
+	pthread_condattr_t attr;
+	struct manifest_cache_check *check;
+
+	if (check_find(intf))
+		return;
+
+	if (!check_run) {
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&check_cond, &attr);
+		pthread_condattr_destroy(&attr);
+
+		check_run = 1;
+		ret = pthread_create(&check_thread, NULL,
+				     manifest_cache_check_thread, NULL);
+		if (ret) {
+			pr_err("Failed to create the manifest check thread\n");
+			pthread_cond_destroy(&check_cond);
+			check_run = 0;
+			return;
+		}
+	}
+
+	check = malloc(sizeof(*check));
+	if (!check)
+		return;
+
+	check->intf_id = intf->id;
+	check->vendor_id = intf->vendor_id;
+	check->product_id = intf->product_id;
+	check->serial_id = intf->serial_id;
+	check->sent = 0;
+	check->changed = 0;
+	check->deadline = manifest_cache_now() + MANIFEST_CACHE_CHECK_DELAY;
+	TAILQ_INSERT_TAIL(&checks, check, node);
+	pthread_cond_signal(&check_cond);
+}
+
+int manifest_cache_request(struct connection *conn,
+			   const void *data, size_t len)
+{
+	int ret;
+	size_t resp_len;
+	struct interface *intf = conn->intf2;
+	struct manifest_cache_check *check;
+	struct manifest_cache_entry *entry;
+	const struct gb_operation_msg_hdr *hdr = data;
+	struct gb_operation_msg_hdr *resp;
+	struct gb_control_get_manifest_size_response *size_resp;
+	uint8_t buffer[GB_NETLINK_MTU];
+
+	if (!intf->manifest_cache || conn->cport2_id != CONTROL_CPORT ||
+	    len < sizeof(*hdr))
+		return 0;
+
+	/* The checks go through here too */
+	if (check_run && pthread_equal(pthread_self(), check_thread))
+		return 0;
+
+	pthread_mutex_lock(&cache_lock);
+	/* The kernel has caught up with the id of the check: give it up */
+	check = check_find(intf);
+	if (check && hdr->operation_id == htole16(MANIFEST_CACHE_OP_ID))
+		check_remove(check);
+
+	if (hdr->type != GB_CONTROL_TYPE_GET_MANIFEST_SIZE &&
+	    hdr->type != GB_CONTROL_TYPE_GET_MANIFEST) {
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	entry = entry_find(intf);
+	if (!entry) {
+		if (hdr->type == GB_CONTROL_TYPE_GET_MANIFEST)
+			stats.misses++;
+		pthread_mutex_unlock(&cache_lock);
+		return 0;
+	}
+
+	TAILQ_REMOVE(&entries, entry, node);
+	TAILQ_INSERT_HEAD(&entries, entry, node);
+
+	resp = (struct gb_operation_msg_hdr *)buffer;
+	memset(resp, 0, sizeof(*resp));
+	resp->operation_id = hdr->operation_id;
+	resp->type = OP_RESPONSE | hdr->type;
+	if (hdr->type == GB_CONTROL_TYPE_GET_MANIFEST_SIZE) {
+		size_resp = (void *)(resp + 1);
+		size_resp->size = htole16(entry->size);
+		resp_len = sizeof(*resp) + sizeof(*size_resp);
+	} else {
+		memcpy(resp + 1, entry->manifest, entry->size);
+		resp_len = sizeof(*resp) + entry->size;
+		stats.hits++;
+		if (!intf->manifest_crc)
+			check_schedule(intf);
+	}
+	resp->size = htole16(resp_len);
+	pthread_mutex_unlock(&cache_lock);
+
+	pr_dbg("Answered the manifest request of interface %u from the cache\n",
+	       intf->id);
+	ret = controller_write(conn->intf1->id, conn->cport1_id,
+			       buffer, resp_len);
+
+	return ret < 0 ? ret : 1;
+}
+
+int manifest_cache_response(struct connection *conn,
+			    const void *data, size_t len)
+{
+	int consumed;
+	uint32_t crc;
+	uint16_t size;
+	struct interface *intf = conn->intf2;
+	struct manifest_cache_check *check;
+	struct manifest_cache_entry *entry;
+	const struct gb_operation_msg_hdr *hdr = data;
+
+	if (!intf->manifest_cache || conn->cport2_id != CONTROL_CPORT ||
+	    len < sizeof(*hdr) ||
+	    hdr->type != (OP_RESPONSE | GB_CONTROL_TYPE_GET_MANIFEST))
+		return 0;
+
+	pthread_mutex_lock(&cache_lock);
+	check = check_find(intf);
+	consumed = check && check->sent &&
+		   hdr->operation_id == htole16(MANIFEST_CACHE_OP_ID);
+
+	if (hdr->result || len == sizeof(*hdr) || len > GB_NETLINK_MTU)
+		goto out_remove;
+
+	size = len - sizeof(*hdr);
+
+	crc = crc32c(0, hdr + 1, size);
+	if (intf->manifest_crc && intf->manifest_crc != crc) {
+		pr_err("The manifest of interface %u doesn't match its CRC\n",
+		       intf->id);
+		goto out_remove;
+	}
+
+	entry = entry_find(intf);
+	if (entry && entry->size == size && entry->crc == crc &&
+	    !memcmp(entry->manifest, hdr + 1, size)) {
+		if (consumed)
+			stats.checked++;
+		goto out_remove;
+	}
+
+	entry_store(intf, hdr + 1, size, crc);
+	/* The check thread plugs the module again, this is its connection */
+	if (consumed) {
+		pr_info("The manifest of interface %u has changed\n", intf->id);
+		stats.changed++;
+		check->changed = 1;
+		pthread_cond_signal(&check_cond);
+		goto out;
+	}
+
+out_remove:
+	if (consumed)
+		check_remove(check);
+out:
+	pthread_mutex_unlock(&cache_lock);
+
+	return consumed;
+}
+
+void manifest_cache_cancel(uint8_t intf_id)
+{
+	struct manifest_cache_check *check, *tmp;
+
+	pthread_mutex_lock(&cache_lock);
+	TAILQ_FOREACH_SAFE(check, &checks, node, tmp) {
+		if (check->intf_id == intf_id)
+			check_remove(check);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void manifest_cache_exit(void)
+{
+	struct manifest_cache_check *check;
+	struct manifest_cache_entry *entry;
+
+	pthread_mutex_lock(&cache_lock);
+	if (check_run) {
+		check_run = 0;
+		pthread_cond_signal(&check_cond);
+		pthread_mutex_unlock(&cache_lock);
+		pthread_join(check_thread, NULL);
+		pthread_mutex_lock(&cache_lock);
+		pthread_cond_destroy(&check_cond);
+	}
+
+	while ((check = TAILQ_FIRST(&checks)))
+		check_remove(check);
+	while ((entry = TAILQ_FIRST(&entries)))
+		entry_remove(entry);
+	pthread_mutex_unlock(&cache_lock);
+
+	if (stats.hits || stats.misses)
+		pr_info("manifest cache: %llu hits, %llu misses, "
+			"%llu checked, %llu changed\n",
+			(unsigned long long)stats.hits,
+			(unsigned long long)stats.misses,
+			(unsigned long long)stats.checked,
+			(unsigned long long)stats.changed);
+}
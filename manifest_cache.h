@@ -0,0 +1,57 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2017 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MANIFEST_CACHE_H_
+#define _MANIFEST_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The manifests of the modules are cached by gbridge, so a module that
+ * reconnects is enumerated without fetching its manifest again over the
+ * link. The cache is used for the interfaces whose manifest_cache field
+ * is set, because their IDs are unique or because the module advertises
+ * the CRC32C of its manifest (manifest_crc).
+ *
+ * The manifest is recorded from the GET_MANIFEST response of the module.
+ * Then the GET_MANIFEST_SIZE and GET_MANIFEST requests of the kernel are
+ * answered from the cache. Unless its CRC was advertised, the manifest of
+ * the module is fetched again a few seconds later, once the enumeration
+ * is done. If it has changed, the cache is updated and the module is
+ * plugged again (see interface_replug()), to be enumerated with it.
+ */
+struct connection;
+
+/*
+ * Called for the messages going to a module. Return 1 if the message has
+ * been answered from the cache, and must not be sent.
+ */
+int manifest_cache_request(struct connection *conn,
+			   const void *data, size_t len);
+/*
+ * Called for the messages received from a module. Return 1 if the message
+ * was the response to a check of the cache, and must not be forwarded.
+ */
+int manifest_cache_response(struct connection *conn,
+			    const void *data, size_t len);
+/* Drop the pending check of the interface, e.g. once it is unplugged */
+void manifest_cache_cancel(uint8_t intf_id);
+void manifest_cache_exit(void);
+
+#endif /* _MANIFEST_CACHE_H_ */
@@ -26,53 +26,6 @@
 #define CONTROL_VERSION_MAJOR 0
 #define CONTROL_VERSION_MINOR 1
 
-static uint8_t bundle_resume(uint8_t bundle_id)
-{
-	return GB_CONTROL_BUNDLE_PM_OK;
-}
-
-static uint8_t bundle_suspend(uint8_t bundle_id)
-{
-	return GB_CONTROL_BUNDLE_PM_OK;
-}
-
-static uint8_t intf_suspend_prepare(uint8_t intf_id)
-{
-	return GB_CONTROL_INTF_PM_OK;
-}
-
-static uint8_t intf_deactivate_prepare(uint8_t intf_id)
-{
-	return GB_CONTROL_INTF_PM_OK;
-}
-
-static uint8_t intf_hibernate_abort(uint8_t intf_id)
-{
-	return GB_CONTROL_INTF_PM_OK;
-}
-
-static int control_version_response(struct operation *op,
-				    uint8_t major, uint8_t minor)
-{
-	struct gb_control_version_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->major = major;
-	resp->minor = minor;
-
-	return 0;
-}
-
-static int control_version_request(struct operation *op)
-{
-	return control_version_response(op, CONTROL_VERSION_MAJOR,
-					CONTROL_VERSION_MINOR);
-}
-
 static int get_manifest_size_response(struct operation *op,
 				      uint16_t manifest_size)
 {
@@ -97,7 +50,7 @@ static int get_manifest_size_request(struct operation *op)
 }
 
 static int get_manifest_response(struct operation *op,
-				 void * manifest, size_t manifest_len)
+				 const void *manifest, size_t manifest_len)
 {
 	struct gb_control_get_manifest_response *resp;
 	size_t op_size = sizeof(*resp);
@@ -117,63 +70,10 @@ static int get_manifest_request(struct operation *op)
 	struct manifest *manifest;
 
 	manifest = manifest_get(op->intf_id);
-	return get_manifest_response(op, manifest->blob, manifest->size);
-}
-
-static int bundle_suspend_response(struct operation *op, uint8_t status)
-{
-	struct gb_control_bundle_pm_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
+	if (!manifest)
+		return -EINVAL;
 
-	resp = operation_to_response(op);
-	resp->status = status;
-
-	return 0;
-}
-
-static int bundle_suspend_request(struct operation *op)
-{
-	struct gb_control_bundle_pm_request *req;
-	uint8_t bundle_id;
-	uint8_t status;
-
-	req = operation_to_request(op);
-	bundle_id = req->bundle_id;
-
-	status = bundle_suspend(bundle_id);
-
-	return bundle_suspend_response(op, status);
-}
-
-static int bundle_resume_response(struct operation *op, uint8_t status)
-{
-	struct gb_control_bundle_pm_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->status = status;
-
-	return 0;
-}
-
-static int bundle_resume_request(struct operation *op)
-{
-	struct gb_control_bundle_pm_request *req;
-	uint8_t bundle_id;
-	uint8_t status;
-
-	req = operation_to_request(op);
-	bundle_id = req->bundle_id;
-
-	status = bundle_resume(bundle_id);
-
-	return bundle_resume_response(op, status);
+	return get_manifest_response(op, manifest->blob, manifest->size);
 }
 
 static int bundle_deactivate_response(struct operation *op, uint8_t status)
@@ -181,7 +81,7 @@ static int bundle_deactivate_response(struct operation *op, uint8_t status)
 	struct gb_control_bundle_pm_response *resp;
 	size_t op_size = sizeof(*resp);
 
-	if (greybus_alloc_response(op, op_size))
+	if (greybus_alloc_response_in_place(op, op_size))
 		return -ENOMEM;
 
 	resp = operation_to_response(op);
@@ -209,7 +109,7 @@ static int bundle_activate_response(struct operation *op, uint8_t status)
 	struct gb_control_bundle_pm_response *resp;
 	size_t op_size = sizeof(*resp);
 
-	if (greybus_alloc_response(op, op_size))
+	if (greybus_alloc_response_in_place(op, op_size))
 		return -ENOMEM;
 
 	resp = operation_to_response(op);
@@ -232,77 +132,12 @@ static int bundle_activate_request(struct operation *op)
 	return bundle_activate_response(op, status);
 }
 
-static int intf_suspend_prepare_response(struct operation *op, uint8_t status)
-{
-	struct gb_control_intf_pm_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->status = status;
-
-	return 0;
-}
-
-static int intf_suspend_prepare_request(struct operation *op)
-{
-	uint8_t status;
-
-	status = intf_suspend_prepare(op->intf_id);
-	return intf_suspend_prepare_response(op, status);
-}
-
-static int intf_deactivate_prepare_response(struct operation *op,
-					    uint8_t status)
-{
-	struct gb_control_intf_pm_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->status = status;
-
-	return 0;
-}
-
-static int intf_deactivate_prepare_request(struct operation *op)
-{
-	uint8_t status;
-
-	status = intf_deactivate_prepare(op->intf_id);
-	return intf_deactivate_prepare_response(op, status);
-}
-
-static int intf_hibernate_abort_response(struct operation *op,
-					    uint8_t status)
-{
-	struct gb_control_intf_pm_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->status = status;
-
-	return 0;
-}
-
-static int intf_hibernate_abort_request(struct operation *op)
-{
-	uint8_t status;
-
-	status = intf_hibernate_abort(op->intf_id);
-	return intf_hibernate_abort_response(op, status);
-}
-
 static struct operation_handler control_operations[] = {
 	REQUEST_EMPTY_HANDLER(GB_REQUEST_TYPE_CPORT_SHUTDOWN),
-	REQUEST_HANDLER(GB_CONTROL_TYPE_VERSION, control_version_request),
+	REQUEST_CANNED_HANDLER(GB_CONTROL_TYPE_VERSION,
+			       struct gb_control_version_response,
+			       .major = CONTROL_VERSION_MAJOR,
+			       .minor = CONTROL_VERSION_MINOR),
 	REQUEST_NO_HANDLER(GB_CONTROL_TYPE_PROBE_AP),
 	REQUEST_HANDLER(GB_CONTROL_TYPE_GET_MANIFEST_SIZE, get_manifest_size_request),
 	REQUEST_HANDLER(GB_CONTROL_TYPE_GET_MANIFEST, get_manifest_request),
@@ -315,13 +150,23 @@ static struct operation_handler control_operations[] = {
 	REQUEST_EMPTY_HANDLER(GB_CONTROL_TYPE_DISCONNECTING),
 	REQUEST_NO_HANDLER(GB_CONTROL_TYPE_TIMESYNC_GET_LAST_EVENT),
 	REQUEST_NO_HANDLER(GB_CONTROL_TYPE_MODE_SWITCH),
-	REQUEST_HANDLER(GB_CONTROL_TYPE_BUNDLE_SUSPEND, bundle_suspend_request),
-	REQUEST_HANDLER(GB_CONTROL_TYPE_BUNDLE_RESUME, bundle_resume_request),
+	REQUEST_CANNED_HANDLER(GB_CONTROL_TYPE_BUNDLE_SUSPEND,
+			       struct gb_control_bundle_pm_response,
+			       .status = GB_CONTROL_BUNDLE_PM_OK),
+	REQUEST_CANNED_HANDLER(GB_CONTROL_TYPE_BUNDLE_RESUME,
+			       struct gb_control_bundle_pm_response,
+			       .status = GB_CONTROL_BUNDLE_PM_OK),
 	REQUEST_HANDLER(GB_CONTROL_TYPE_BUNDLE_DEACTIVATE, bundle_deactivate_request),
 	REQUEST_HANDLER(GB_CONTROL_TYPE_BUNDLE_ACTIVATE, bundle_activate_request),
-	REQUEST_HANDLER(GB_CONTROL_TYPE_INTF_SUSPEND_PREPARE, intf_suspend_prepare_request),
-	REQUEST_HANDLER(GB_CONTROL_TYPE_INTF_DEACTIVATE_PREPARE, intf_deactivate_prepare_request),
-	REQUEST_HANDLER(GB_CONTROL_TYPE_INTF_HIBERNATE_ABORT, intf_hibernate_abort_request),
+	REQUEST_CANNED_HANDLER(GB_CONTROL_TYPE_INTF_SUSPEND_PREPARE,
+			       struct gb_control_intf_pm_response,
+			       .status = GB_CONTROL_INTF_PM_OK),
+	REQUEST_CANNED_HANDLER(GB_CONTROL_TYPE_INTF_DEACTIVATE_PREPARE,
+			       struct gb_control_intf_pm_response,
+			       .status = GB_CONTROL_INTF_PM_OK),
+	REQUEST_CANNED_HANDLER(GB_CONTROL_TYPE_INTF_HIBERNATE_ABORT,
+			       struct gb_control_intf_pm_response,
+			       .status = GB_CONTROL_INTF_PM_OK),
 };
 
 static struct greybus_driver control_driver = {
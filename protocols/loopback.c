@@ -21,42 +21,20 @@
 
 #include <gbridge.h>
 
-static int gb_loopback_transfer_response(struct operation *op,
-					 uint32_t len, uint32_t reserved0,
-					 uint32_t reserved1, uint8_t *data)
-{
-	struct gb_loopback_transfer_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	op_size += len;
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->len = htole32(len);
-	resp->reserved0 = htole32(reserved0);
-	resp->reserved1 = htole32(reserved1);
-	memcpy(resp->data, data, len);
-
-	return 0;
-}
-
+/* The response has the layout of the request, so it is built over it */
 static int gb_loopback_transfer_request(struct operation *op)
 {
 	struct gb_loopback_transfer_request *req;
 	uint32_t len;
-	uint32_t reserved0;
-	uint32_t reserved1;
-	uint8_t *data;
 
 	req = operation_to_request(op);
 	len = le32toh(req->len);
-	reserved0 = le32toh(req->reserved0);
-	reserved1 = le32toh(req->reserved1);
-	data = req->data;
+	if (sizeof(*op->req) + sizeof(*req) + len >
+	    gb_operation_msg_size(op->req))
+		return -EINVAL;
 
-	return gb_loopback_transfer_response(op, len, reserved0,
-					     reserved1, data);
+	return greybus_alloc_response_in_place(op,
+		sizeof(struct gb_loopback_transfer_response) + len);
 }
 
 static struct operation_handler loopback_operations[] = {
@@ -22,103 +22,127 @@
 
 #include <debug.h>
 #include <gbridge.h>
+#include <controller.h>
 #include <protocols/protocols.h>
 #include <protocols/manifest.h>
 
-LIST_HEAD(manifest_head, manifest) manifests = LIST_HEAD_INITIALIZER(manifests);
-
-#ifndef LIST_FOREACH_SAFE
-#define	LIST_FOREACH_SAFE(var, head, field, tvar)			\
-	for ((var) = LIST_FIRST((head));				\
-	    (var) && ((tvar) = LIST_NEXT((var), field), 1);		\
-	    (var) = (tvar))
-#endif
+/* The manifest of each interface, indexed by interface id */
+static struct manifest *manifests[256];
 
 static struct bundle *find_bundle(struct manifest *manifest, uint8_t id)
 {
-	struct bundle *bundle;
+	uint8_t index = manifest->bundle_index[id];
 
-	LIST_FOREACH(bundle, &manifest->bundles, bundle_node) {
-		if (bundle->id == id)
-			return bundle;
-	}
+	return index == MANIFEST_NO_BUNDLE ? NULL : &manifest->bundles[index];
+}
+
+static struct cport *find_cport(struct manifest *manifest, uint16_t id)
+{
+	uint16_t index;
+
+	if (id >= GB_NETLINK_NUM_CPORT)
+		return NULL;
 
-	return NULL;
+	index = manifest->cport_index[id];
+	return index == MANIFEST_NO_CPORT ? NULL : &manifest->cports[index];
 }
 
-static struct bundle *bundle_alloc(struct manifest *manifest, uint8_t id)
+static const struct greybus_descriptor *
+next_descriptor(const void *manifest_blob, uint16_t size, uint16_t *offset)
 {
-	struct bundle *bundle;
+	const struct greybus_descriptor *desc;
 
-	bundle = malloc(sizeof(*bundle));
-	if (!bundle)
+	if (*offset >= size)
 		return NULL;
 
-	bundle->id = id;
-	LIST_INIT(&bundle->cports);
-	LIST_INSERT_HEAD(&manifest->bundles, bundle, bundle_node);
+	desc = (const void *)((const uint8_t *)manifest_blob + *offset);
+	*offset += le16toh(desc->header.size);
 
-	return bundle;
+	return desc;
 }
 
-static struct bundle *find_bundle_alloc(struct manifest *manifest, uint8_t id)
+/*
+ * First pass over the descriptors: number the bundles in the order they
+ * show up, and count their cports, so the manifest can be allocated at
+ * once.
+ */
+static int manifest_count(const void *manifest_blob, uint16_t size,
+			  uint8_t *bundle_index, uint8_t *bundle_ids,
+			  uint16_t *cport_counts, unsigned int *bundle_count,
+			  unsigned int *cport_count)
 {
-	struct bundle *bundle;
+	const struct greybus_descriptor *desc;
+	uint16_t offset = sizeof(struct greybus_manifest_header);
+	uint8_t id;
+
+	memset(bundle_index, MANIFEST_NO_BUNDLE, 256);
+	*bundle_count = 0;
+	*cport_count = 0;
+
+	while ((desc = next_descriptor(manifest_blob, size, &offset))) {
+		if (desc->header.type == GREYBUS_TYPE_BUNDLE)
+			id = desc->bundle.id;
+		else if (desc->header.type == GREYBUS_TYPE_CPORT)
+			id = desc->cport.bundle;
+		else
+			continue;
+
+		if (bundle_index[id] == MANIFEST_NO_BUNDLE) {
+			if (*bundle_count == MANIFEST_NO_BUNDLE) {
+				pr_err("Too many bundles in the manifest\n");
+				return -EINVAL;
+			}
+			bundle_ids[*bundle_count] = id;
+			cport_counts[*bundle_count] = 0;
+			bundle_index[id] = *bundle_count;
+			(*bundle_count)++;
+		}
 
-	bundle = find_bundle(manifest, id);
-	if (!bundle)
-		bundle = bundle_alloc(manifest, id);
+		if (desc->header.type == GREYBUS_TYPE_CPORT) {
+			cport_counts[bundle_index[id]]++;
+			(*cport_count)++;
+		}
+	}
 
-	return bundle;
+	return 0;
 }
 
-static int parse_descriptor_cport(struct manifest *manifest,
-				  struct greybus_descriptor_cport *desc)
+static void parse_descriptor_cport(struct manifest *manifest,
+				   const struct greybus_descriptor_cport *desc)
 {
 	struct cport *cport;
 	struct bundle *bundle;
+	uint16_t index;
 
-	bundle = find_bundle_alloc(manifest, desc->bundle);
-	if (!bundle)
-		return -ENOMEM;
-
-	cport = malloc(sizeof(*cport));
-	if (!cport)
-		return -ENOMEM;
+	bundle = find_bundle(manifest, desc->bundle);
+	index = bundle->cport_first + bundle->cport_count++;
 
+	cport = &manifest->cports[index];
 	cport->id = le16toh(desc->id);
 	cport->protocol_id = desc->protocol_id;
-	LIST_INSERT_HEAD(&bundle->cports, cport, cport_node);
+	cport->bundle = manifest->bundle_index[desc->bundle];
+	if (cport->id < GB_NETLINK_NUM_CPORT)
+		manifest->cport_index[cport->id] = index;
 
 	pr_dbg("cport_id = %u, protocol_id = %u\n",
 		cport->id, cport->protocol_id);
-
-	return 0;
 }
 
-static int parse_descriptor_bundle(struct manifest *manifest,
-				   struct greybus_descriptor_bundle *desc)
+static void parse_descriptor_bundle(struct manifest *manifest,
+				    const struct greybus_descriptor_bundle *desc)
 {
 	struct bundle *bundle;
 
-	bundle = find_bundle_alloc(manifest, desc->id);
-	if (!bundle)
-		return -ENOMEM;
+	bundle = find_bundle(manifest, desc->id);
 	bundle->class = desc->class;
 
 	pr_dbg("bundle_id = %u, class = %u\n", bundle->id, bundle->class);
-
-	return 0;
 }
 
-static int parse_descriptor(struct manifest *manifest,
-			    struct greybus_descriptor *desc)
+static void parse_descriptor(struct manifest *manifest,
+			     const struct greybus_descriptor *desc)
 {
-	int ret;
-	uint16_t size;
-
-	size = le16toh(desc->header.size);
-	pr_dbg("Parsing a descriptor\nSize: %u\n", size);
+	pr_dbg("Parsing a descriptor\nSize: %u\n", le16toh(desc->header.size));
 	switch (desc->header.type) {
 		case GREYBUS_TYPE_INTERFACE:
 			pr_dbg("Type: interface descriptor\n");
@@ -128,100 +152,167 @@ static int parse_descriptor(struct manifest *manifest,
 			break;
 		case GREYBUS_TYPE_BUNDLE:
 			pr_dbg("Type: bundle descriptor\n");
-			ret = parse_descriptor_bundle(manifest, &desc->bundle);
+			parse_descriptor_bundle(manifest, &desc->bundle);
 			break;
 		case GREYBUS_TYPE_CPORT:
 			pr_dbg("Type: cport descriptor\n");
-			ret = parse_descriptor_cport(manifest, &desc->cport);
-			if (ret < 0)
-				return ret;
+			parse_descriptor_cport(manifest, &desc->cport);
 			break;
 		default:
 			pr_err("Unknown descriptor type\n");
 	}
-
-	return size;
 }
 
 void manifest_free(struct manifest *manifest)
 {
-	struct cport *cport, *tmp_cport;
-	struct bundle *bundle, *tmp_bundle;
+	if (manifests[manifest->intf_id] == manifest)
+		manifests[manifest->intf_id] = NULL;
+	free(manifest);
+}
+
+static size_t descriptor_min_size(uint8_t type)
+{
+	struct greybus_descriptor *desc;
+
+	switch (type) {
+	case GREYBUS_TYPE_INTERFACE:
+		return sizeof(desc->header) + sizeof(desc->interface);
+	case GREYBUS_TYPE_STRING:
+		return sizeof(desc->header) + sizeof(desc->string);
+	case GREYBUS_TYPE_BUNDLE:
+		return sizeof(desc->header) + sizeof(desc->bundle);
+	case GREYBUS_TYPE_CPORT:
+		return sizeof(desc->header) + sizeof(desc->cport);
+	default:
+		return sizeof(desc->header);
+	}
+}
+
+/*
+ * Check that a manifest of len bytes is well formed: its size fits in
+ * len, and its descriptors are big enough for their type and exactly
+ * fill it. parse_manifest() may then walk it without any other check.
+ */
+int manifest_check(const void *manifest_blob, size_t len)
+{
+	size_t size;
+	size_t offset;
+	uint16_t desc_size;
+	const struct greybus_manifest *greybus_manifest = manifest_blob;
+	const struct greybus_descriptor *desc;
+
+	if (len < sizeof(greybus_manifest->header)) {
+		pr_err("The manifest is too short\n");
+		return -EINVAL;
+	}
+
+	size = le16toh(greybus_manifest->header.size);
+	if (size > len || size <= sizeof(greybus_manifest->header)) {
+		pr_err("Invalid manifest size: %zu (%zu bytes available)\n",
+		       size, len);
+		return -EINVAL;
+	}
 
-	LIST_FOREACH_SAFE(bundle, &manifest->bundles, bundle_node, tmp_bundle) {
-		LIST_FOREACH_SAFE(cport, &bundle->cports, cport_node, tmp_cport) {
-			LIST_REMOVE(cport, cport_node);
-			free(cport);
+	/* It must fit in the GET_MANIFEST response */
+	if (size > GB_NETLINK_MTU - sizeof(struct gb_operation_msg_hdr)) {
+		pr_err("The manifest is too big: %zu bytes (max %zu)\n",
+		       size, GB_NETLINK_MTU -
+		       sizeof(struct gb_operation_msg_hdr));
+		return -EFBIG;
+	}
+
+	offset = sizeof(greybus_manifest->header);
+	while (offset < size) {
+		desc = (const void *)((const uint8_t *)manifest_blob + offset);
+		if (size - offset < sizeof(desc->header)) {
+			pr_err("Truncated descriptor at offset %zu\n", offset);
+			return -EINVAL;
 		}
-		LIST_REMOVE(bundle, bundle_node);
-		free(bundle);
+
+		desc_size = le16toh(desc->header.size);
+		if (desc_size < descriptor_min_size(desc->header.type) ||
+		    desc_size > size - offset) {
+			pr_err("Invalid descriptor size %u at offset %zu\n",
+			       desc_size, offset);
+			return -EINVAL;
+		}
+		offset += desc_size;
 	}
-	LIST_REMOVE(manifest, manifest_node);
-	free(manifest->blob);
-	free(manifest);
+
+	return 0;
 }
 
-struct manifest *parse_manifest(void *manifest_blob, uint8_t intf_id)
+/*
+ * The blob is not copied: it must stay valid, and unchanged, until the
+ * manifest is freed.
+ */
+struct manifest *parse_manifest(const void *manifest_blob, uint8_t intf_id)
 {
-	int ret;
 	uint16_t size;
-	uint8_t *p_desc;
+	uint16_t offset;
+	unsigned int i;
+	unsigned int first;
+	unsigned int bundle_count;
+	unsigned int cport_count;
+	uint8_t bundle_index[256];
+	uint8_t bundle_ids[MANIFEST_NO_BUNDLE];
+	uint16_t cport_counts[MANIFEST_NO_BUNDLE];
 	struct manifest *manifest;
-	struct greybus_manifest *greybus_manifest;
+	const struct greybus_descriptor *desc;
+	const struct greybus_manifest *greybus_manifest = manifest_blob;
 
 	pr_dbg("Parsing the manifest for interface %u\n", intf_id);
 
-	manifest = malloc(sizeof(*manifest));
-	if (!manifest)
+	if (manifests[intf_id]) {
+		pr_err("Interface %u already has a manifest\n", intf_id);
 		return NULL;
-	manifest->blob = NULL;
-
-	greybus_manifest = manifest_blob;
-	p_desc = (uint8_t *)greybus_manifest->descriptors;
-	manifest->size = le16toh(greybus_manifest->header.size);
-	pr_dbg("Manifest size: %u\n", manifest->size);
-
-	size = sizeof(struct greybus_manifest_header);
-	do {
-		ret = parse_descriptor(manifest,
-				       (struct greybus_descriptor *)p_desc);
-		if (ret <= 0)
-			goto err_manifest_free;
-		size += (uint16_t)ret;
-		p_desc += (uint16_t)ret;
-	} while(size < manifest->size);
-
-	if (size != manifest->size) {
-		ret = -EINVAL;
-		goto err_manifest_free;
 	}
 
-	manifest->blob = malloc(manifest->size);
-	if (!manifest->blob)
-		goto err_manifest_free;
-	memcpy(manifest->blob, manifest_blob, manifest->size);
-	manifest->intf_id = intf_id;
+	size = le16toh(greybus_manifest->header.size);
+	pr_dbg("Manifest size: %u\n", size);
+	if (manifest_check(manifest_blob, size))
+		return NULL;
 
-	LIST_INSERT_HEAD(&manifests, manifest, manifest_node);
+	if (manifest_count(manifest_blob, size, bundle_index, bundle_ids,
+			   cport_counts, &bundle_count, &cport_count))
+		return NULL;
 
-	return manifest;
+	manifest = malloc(sizeof(*manifest) +
+			  bundle_count * sizeof(struct bundle) +
+			  cport_count * sizeof(struct cport));
+	if (!manifest)
+		return NULL;
+
+	manifest->blob = manifest_blob;
+	manifest->size = size;
+	manifest->intf_id = intf_id;
+	manifest->bundle_count = bundle_count;
+	manifest->cport_count = cport_count;
+	manifest->bundles = (struct bundle *)(manifest + 1);
+	manifest->cports = (struct cport *)(manifest->bundles + bundle_count);
+	memcpy(manifest->bundle_index, bundle_index, sizeof(bundle_index));
+	memset(manifest->cport_index, 0xff, sizeof(manifest->cport_index));
+
+	for (i = 0, first = 0; i < bundle_count; i++) {
+		manifest->bundles[i].id = bundle_ids[i];
+		manifest->bundles[i].class = 0;
+		manifest->bundles[i].cport_first = first;
+		manifest->bundles[i].cport_count = 0;
+		first += cport_counts[i];
+	}
+
+	offset = sizeof(struct greybus_manifest_header);
+	while ((desc = next_descriptor(manifest_blob, size, &offset)))
+		parse_descriptor(manifest, desc);
 
-err_manifest_free:
-	manifest_free(manifest);
+	manifests[intf_id] = manifest;
 
-	return NULL;
+	return manifest;
 }
 
 struct manifest *manifest_get(uint8_t intf_id)
 {
-	struct manifest *manifest;
-
-	LIST_FOREACH(manifest, &manifests, manifest_node) {
-		if (manifest->intf_id == intf_id)
-			return manifest;
-	}
-
-	return NULL;
+	return manifests[intf_id];
 }
 
 uint16_t manifest_get_size(uint8_t intf_id)
@@ -262,12 +353,38 @@ static int cport_disable(uint8_t intf_id, struct cport *cport)
 	return ret;
 }
 
+/*
+ * Make a cport answer as soon as it is connected, as a real module does,
+ * even if its bundle has not been activated, e.g. for the loopback probe.
+ */
+int manifest_connect_cport(uint8_t intf_id, uint16_t cport_id)
+{
+	struct manifest *manifest;
+	struct cport *cport;
+	struct interface *intf;
+
+	if (cport_id >= GB_NETLINK_NUM_CPORT)
+		return 0;
+
+	manifest = manifest_get(intf_id);
+	intf = get_interface(intf_id);
+	if (!manifest || !intf || intf->gb_drivers[cport_id])
+		return 0;
+
+	cport = find_cport(manifest, cport_id);
+	if (!cport || cport->protocol_id != GREYBUS_PROTOCOL_LOOPBACK)
+		return 0;
+
+	return cport_enable(intf_id, cport);
+}
+
 static uint8_t _bundle_activate(uint8_t intf_id, uint8_t bundle_id,
 				uint8_t activate)
 {
 	struct manifest *manifest;
 	struct bundle *bundle;
 	struct cport *cport;
+	unsigned int i;
 	int ret;
 
 	manifest = manifest_get(intf_id);
@@ -284,7 +401,8 @@ static uint8_t _bundle_activate(uint8_t intf_id, uint8_t bundle_id,
 		return GB_CONTROL_BUNDLE_PM_INVAL;
 	}
 
-	LIST_FOREACH(cport, &bundle->cports, cport_node) {
+	for (i = 0; i < bundle->cport_count; i++) {
+		cport = &manifest->cports[bundle->cport_first + i];
 		if (activate)
 			ret = cport_enable(intf_id, cport);
 		else
@@ -16,34 +16,52 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
 #include <stdint.h>
-#include <sys/queue.h>
+
+#include <gb_netlink.h>
+
+#define MANIFEST_NO_BUNDLE	0xff
+#define MANIFEST_NO_CPORT	0xffff
 
 struct cport {
 	uint16_t id;
 	uint8_t protocol_id;
-	LIST_ENTRY(cport) cport_node;
+	uint8_t bundle;		/* index of its bundle in manifest->bundles */
 };
 
+/* The cports of a bundle are contiguous in manifest->cports */
 struct bundle {
 	uint8_t id;
 	uint8_t class;
-	LIST_ENTRY(bundle) bundle_node;
-	LIST_HEAD(cport_head, cport) cports;
+	uint16_t cport_first;
+	uint16_t cport_count;
 };
 
+/*
+ * A parsed manifest is a single allocation: the bundles and cports arrays
+ * follow the structure. The ids are mapped to the array indexes, so the
+ * lookups don't walk the manifest.
+ */
 struct manifest {
 	uint16_t size;
 	uint8_t intf_id;
-	LIST_ENTRY(manifest) manifest_node;
-	LIST_HEAD(bundle_head, bundle) bundles;
+	uint8_t bundle_count;
+	uint16_t cport_count;
+
+	uint8_t bundle_index[256];
+	uint16_t cport_index[GB_NETLINK_NUM_CPORT];
+	struct bundle *bundles;
+	struct cport *cports;
 
-	void *blob;
+	const void *blob;
 };
 
-struct manifest *parse_manifest(void *manifest_blob, uint8_t intf_id);
+int manifest_check(const void *manifest_blob, size_t len);
+struct manifest *parse_manifest(const void *manifest_blob, uint8_t intf_id);
 void manifest_free(struct manifest *manifest);
 struct manifest *manifest_get(uint8_t intf_id);
 uint16_t manifest_get_size(uint8_t intf_id);
+int manifest_connect_cport(uint8_t intf_id, uint16_t cport_id);
 uint8_t bundle_activate(uint8_t intf_id, uint8_t bundle_id);
 uint8_t bundle_deactivate(uint8_t intf_id, uint8_t bundle_id);
\ No newline at end of file
@@ -18,6 +18,7 @@
 
 #include <errno.h>
 #include <endian.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
@@ -28,162 +29,26 @@
 #include <debug.h>
 #include <gbridge.h>
 #include <controller.h>
+#include <hotplug.h>
 
 /* TODO: Can we use other IDs ? */
 #define ENDO_ID 0x4755
 
-static int svc_send_hello_request(void);
-
-static int svc_dme_peer_get_response(struct operation *op, uint16_t result_code,
-				     uint32_t attr_value)
-{
-	struct gb_svc_dme_peer_get_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = htole16(result_code);
-	resp->attr_value = htole32(attr_value);
-
-	return 0;
-}
-
-static int svc_dme_peer_set_response(struct operation *op, uint16_t result_code)
-{
-	struct gb_svc_dme_peer_set_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = htole16(result_code);
-
-	return 0;
-}
-
-static int svc_interface_v_sys_enable_response(struct operation *op,
-					       uint8_t result_code)
-{
-	struct gb_svc_intf_vsys_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = result_code;
-
-	return 0;
-}
-
-static int svc_interface_v_sys_disable_response(struct operation *op,
-						uint8_t result_code)
-{
-	struct gb_svc_intf_vsys_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = result_code;
-
-	return 0;
-}
-
-static int svc_interface_refclk_enable_response(struct operation *op,
-						uint8_t result_code)
-{
-	struct gb_svc_intf_refclk_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = result_code;
-
-	return 0;
-}
-
-static int svc_interface_refclk_disable_response(struct operation *op,
-						 uint8_t result_code)
-{
-	struct gb_svc_intf_refclk_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = result_code;
-
-	return 0;
-}
-
-static int svc_interface_unipro_enable_response(struct operation *op,
-						uint8_t result_code)
-{
-	struct gb_svc_intf_unipro_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = result_code;
-
-	return 0;
-}
-
-static int svc_interface_unipro_disable_response(struct operation *op,
-						 uint8_t result_code)
-{
-	struct gb_svc_intf_unipro_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->result_code = result_code;
-
-	return 0;
-}
-
-static int svc_interface_activate_response(struct operation *op,
-					   uint8_t intf_type)
-{
-	struct gb_svc_intf_activate_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->intf_type = intf_type;
-	resp->status = GB_SVC_OP_SUCCESS;
-
-	return 0;
-}
-
-static int svc_interface_resume_response(struct operation *op,
-					   uint8_t intf_type)
-{
-	struct gb_svc_intf_resume_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
+/*
+ * Creating a connection may block, e.g. on a TCP connect, so the
+ * connection requests are handled by workers: the others, which are
+ * received by the same thread, are not delayed meanwhile.
+ */
+#define SVC_WORKERS	4
 
-	resp = operation_to_response(op);
-	resp->status = GB_SVC_OP_SUCCESS;
+static TAILQ_HEAD(svc_job_head, operation) svc_jobs =
+	TAILQ_HEAD_INITIALIZER(svc_jobs);
+static pthread_mutex_t svc_jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t svc_jobs_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t svc_workers[SVC_WORKERS];
+static int svc_worker_count;
 
-	return 0;
-}
+static int svc_send_hello_request(void);
 
 static int svc_interface_set_pwrm_response(struct operation *op,
 					   uint8_t result_code)
@@ -191,7 +56,8 @@ static int svc_interface_set_pwrm_response(struct operation *op,
 	struct gb_svc_intf_set_pwrm_response *resp;
 	size_t op_size = sizeof(*resp);
 
-	if (greybus_alloc_response(op, op_size))
+	/* The request is bigger, and no longer used */
+	if (greybus_alloc_response_in_place(op, op_size))
 		return -ENOMEM;
 
 	resp = operation_to_response(op);
@@ -200,28 +66,14 @@ static int svc_interface_set_pwrm_response(struct operation *op,
 	return 0;
 }
 
-static int svc_pwrmon_rail_count_get_response(struct operation *op,
-					      uint8_t rail_count)
-{
-	struct gb_svc_pwrmon_rail_count_get_response *resp;
-	size_t op_size = sizeof(*resp);
-
-	if (greybus_alloc_response(op, op_size))
-		return -ENOMEM;
-
-	resp = operation_to_response(op);
-	resp->rail_count = rail_count;
-
-	return 0;
-}
-
 static int svc_ping_request(struct operation *op)
 {
 	return 0;
 }
 
-static int svc_connection_create_request(struct operation *op)
+static int svc_connection_create(struct operation *op)
 {
+	int ret;
 	struct gb_svc_conn_create_request *req;
 	uint8_t intf1_id;
 	uint16_t cport1_id;
@@ -234,10 +86,15 @@ static int svc_connection_create_request(struct operation *op)
 	intf2_id = req->intf2_id;
 	cport2_id = le16toh(req->cport2_id);
 
-	return connection_create(intf1_id, cport1_id, intf2_id, cport2_id);
+	ret = connection_create(intf1_id, cport1_id, intf2_id, cport2_id);
+	if (!ret && intf1_id == AP_INTF_ID)
+		hotplug_event(intf2_id, cport2_id == CONTROL_CPORT ?
+				HOTPLUG_CONTROL : HOTPLUG_READY);
+
+	return ret;
 }
 
-static int svc_connection_destroy_request(struct operation *op)
+static int svc_connection_destroy(struct operation *op)
 {
 	struct gb_svc_conn_destroy_request *req;
 	uint8_t intf1_id;
@@ -251,52 +108,84 @@ static int svc_connection_destroy_request(struct operation *op)
 	intf2_id = req->intf2_id;
 	cport2_id = le16toh(req->cport2_id);
 
+	/* The connections of an unplugged module are already released */
+	if (!get_interface(intf2_id))
+		return 0;
+
 	return connection_destroy(intf1_id, cport1_id, intf2_id, cport2_id);
 }
 
-static int svc_dme_peer_get_request(struct operation *op)
+static void svc_jobs_unlock(void *data)
 {
-	return svc_dme_peer_get_response(op, 0, 0x0126);
+	pthread_mutex_unlock(data);
 }
 
-static int svc_dme_peer_set_request(struct operation *op)
+static void *svc_worker(void *data)
 {
-	return svc_dme_peer_set_response(op, 0);
-}
+	int ret;
+	int state;
+	struct operation *op;
 
-static int svc_interface_v_sys_enable_request(struct operation *op)
-{
-	return svc_interface_v_sys_enable_response(op, GB_SVC_INTF_VSYS_OK);
-}
+	while (1) {
+		pthread_mutex_lock(&svc_jobs_lock);
+		pthread_cleanup_push(svc_jobs_unlock, &svc_jobs_lock);
+		while (TAILQ_EMPTY(&svc_jobs))
+			pthread_cond_wait(&svc_jobs_cond, &svc_jobs_lock);
+		op = TAILQ_FIRST(&svc_jobs);
+		TAILQ_REMOVE(&svc_jobs, op, cnode);
+		pthread_cleanup_pop(1);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+		if (op->req->type == GB_SVC_TYPE_CONN_CREATE)
+			ret = svc_connection_create(op);
+		else
+			ret = svc_connection_destroy(op);
+		greybus_complete_operation(op, ret);
+		pthread_setcancelstate(state, NULL);
+	}
 
-static int svc_interface_v_sys_disable_request(struct operation *op)
-{
-	return svc_interface_v_sys_disable_response(op, GB_SVC_INTF_VSYS_OK);;
+	return NULL;
 }
 
-static int svc_interface_refclk_enable_request(struct operation *op)
+/* Hand the request to a worker, or handle it here if there is none */
+static int svc_defer(struct operation *op,
+		     int (*handler)(struct operation *op))
 {
-	return svc_interface_refclk_enable_response(op, GB_SVC_INTF_REFCLK_OK);
-}
+	struct operation *deferred;
 
-static int svc_interface_refclk_disable_request(struct operation *op)
-{
-	return svc_interface_refclk_disable_response(op, GB_SVC_INTF_REFCLK_OK);
+	if (!svc_worker_count)
+		return handler(op);
+
+	deferred = greybus_defer_operation(op);
+	if (!deferred)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&svc_jobs_lock);
+	TAILQ_INSERT_TAIL(&svc_jobs, deferred, cnode);
+	pthread_cond_signal(&svc_jobs_cond);
+	pthread_mutex_unlock(&svc_jobs_lock);
+
+	return -EINPROGRESS;
 }
 
-static int svc_interface_unipro_enable_request(struct operation *op)
+static int svc_connection_create_request(struct operation *op)
 {
-	return svc_interface_unipro_enable_response(op, GB_SVC_INTF_UNIPRO_OK);
+	return svc_defer(op, svc_connection_create);
 }
 
-static int svc_interface_unipro_disable_request(struct operation *op)
+static int svc_connection_destroy_request(struct operation *op)
 {
-	return svc_interface_unipro_disable_response(op, GB_SVC_INTF_UNIPRO_OK);
+	return svc_defer(op, svc_connection_destroy);
 }
 
 static int svc_interface_activate_request(struct operation *op)
 {
-	return svc_interface_activate_response(op, GB_SVC_INTF_TYPE_GREYBUS);
+	struct gb_svc_intf_activate_request *req;
+
+	req = operation_to_request(op);
+	hotplug_event(req->intf_id, HOTPLUG_ACTIVATED);
+
+	return 0;
 }
 
 static int svc_protocol_version_response(struct operation *op)
@@ -304,11 +193,6 @@ static int svc_protocol_version_response(struct operation *op)
        return svc_send_hello_request();
 }
 
-static int svc_interface_resume_request(struct operation *op)
-{
-	return svc_interface_resume_response(op, GB_SVC_INTF_TYPE_GREYBUS);
-}
-
 static int svc_interface_set_pwrm_request(struct operation *op)
 {
 	struct gb_svc_intf_set_pwrm_request *req;
@@ -325,18 +209,18 @@ static int svc_interface_set_pwrm_request(struct operation *op)
 	return svc_interface_set_pwrm_response(op, GB_SVC_SETPWRM_PWR_LOCAL);
 }
 
-static int svc_pwrmon_rail_count_get_request(struct operation *op)
-{
-	return svc_pwrmon_rail_count_get_response(op, 0);
-}
-
 static struct operation_handler svc_operations[] = {
 	REQUEST_EMPTY_HANDLER(GB_SVC_TYPE_INTF_DEVICE_ID),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_INTF_RESET),
 	REQUEST_HANDLER(GB_SVC_TYPE_CONN_CREATE, svc_connection_create_request),
 	REQUEST_HANDLER(GB_SVC_TYPE_CONN_DESTROY, svc_connection_destroy_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_DME_PEER_GET, svc_dme_peer_get_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_DME_PEER_SET, svc_dme_peer_set_request),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_DME_PEER_GET,
+			       struct gb_svc_dme_peer_get_response,
+			       .result_code = GB_LE16(0),
+			       .attr_value = GB_LE32(0x0126)),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_DME_PEER_SET,
+			       struct gb_svc_dme_peer_set_response,
+			       .result_code = GB_LE16(0)),
 	REQUEST_EMPTY_HANDLER(GB_SVC_TYPE_ROUTE_CREATE),
 	REQUEST_EMPTY_HANDLER(GB_SVC_TYPE_ROUTE_DESTROY),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_TIMESYNC_ENABLE),
@@ -345,7 +229,9 @@ static struct operation_handler svc_operations[] = {
 	REQUEST_HANDLER(GB_SVC_TYPE_INTF_SET_PWRM, svc_interface_set_pwrm_request),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_INTF_EJECT),
 	REQUEST_HANDLER(GB_SVC_TYPE_PING, svc_ping_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_PWRMON_RAIL_COUNT_GET, svc_pwrmon_rail_count_get_request),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_PWRMON_RAIL_COUNT_GET,
+			       struct gb_svc_pwrmon_rail_count_get_response,
+			       .rail_count = 0),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_PWRMON_RAIL_NAMES_GET),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_PWRMON_SAMPLE_GET),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_PWRMON_INTF_SAMPLE_GET),
@@ -354,19 +240,38 @@ static struct operation_handler svc_operations[] = {
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_TIMESYNC_PING),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_MODULE_INSERTED),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_MODULE_REMOVED),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_VSYS_ENABLE, svc_interface_v_sys_enable_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_VSYS_DISABLE, svc_interface_v_sys_disable_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_REFCLK_ENABLE, svc_interface_refclk_enable_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_REFCLK_DISABLE, svc_interface_refclk_disable_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_UNIPRO_ENABLE, svc_interface_unipro_enable_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_UNIPRO_DISABLE, svc_interface_unipro_disable_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_ACTIVATE, svc_interface_activate_request),
-	REQUEST_HANDLER(GB_SVC_TYPE_INTF_RESUME, svc_interface_resume_request),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_INTF_VSYS_ENABLE,
+			       struct gb_svc_intf_vsys_response,
+			       .result_code = GB_SVC_INTF_VSYS_OK),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_INTF_VSYS_DISABLE,
+			       struct gb_svc_intf_vsys_response,
+			       .result_code = GB_SVC_INTF_VSYS_OK),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_INTF_REFCLK_ENABLE,
+			       struct gb_svc_intf_refclk_response,
+			       .result_code = GB_SVC_INTF_REFCLK_OK),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_INTF_REFCLK_DISABLE,
+			       struct gb_svc_intf_refclk_response,
+			       .result_code = GB_SVC_INTF_REFCLK_OK),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_INTF_UNIPRO_ENABLE,
+			       struct gb_svc_intf_unipro_response,
+			       .result_code = GB_SVC_INTF_UNIPRO_OK),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_INTF_UNIPRO_DISABLE,
+			       struct gb_svc_intf_unipro_response,
+			       .result_code = GB_SVC_INTF_UNIPRO_OK),
+	REQUEST_CANNED_HANDLER_CB(GB_SVC_TYPE_INTF_ACTIVATE,
+				  svc_interface_activate_request,
+				  struct gb_svc_intf_activate_response,
+				  .status = GB_SVC_OP_SUCCESS,
+				  .intf_type = GB_SVC_INTF_TYPE_GREYBUS),
+	REQUEST_CANNED_HANDLER(GB_SVC_TYPE_INTF_RESUME,
+			       struct gb_svc_intf_resume_response,
+			       .status = GB_SVC_OP_SUCCESS),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_INTF_MAILBOX_EVENT),
 	REQUEST_NO_HANDLER(GB_SVC_TYPE_INTF_OOPS),
 	RESPONSE_HANDLER(GB_SVC_TYPE_PROTOCOL_VERSION, svc_protocol_version_response),
 	RESPONSE_EMPTY_HANDLER(GB_SVC_TYPE_SVC_HELLO),
 	RESPONSE_EMPTY_HANDLER(GB_SVC_TYPE_MODULE_INSERTED),
+	RESPONSE_EMPTY_HANDLER(GB_SVC_TYPE_MODULE_REMOVED),
 };
 
 static struct greybus_driver svc_driver = {
@@ -428,11 +333,55 @@ int svc_send_module_inserted_event(uint8_t intf_id,
 	return greybus_send_request(AP_INTF_ID, SVC_CPORT, op);
 }
 
+int svc_send_module_removed_event(uint8_t intf_id)
+{
+	struct gb_svc_module_removed_request req;
+	struct operation *op;
+
+	req.primary_intf_id = intf_id;
+
+	op = greybus_alloc_operation(GB_SVC_TYPE_MODULE_REMOVED,
+				     &req, sizeof(req));
+	if (!op)
+		return -ENOMEM;
+
+	return greybus_send_request(AP_INTF_ID, SVC_CPORT, op);
+}
+
 int svc_init(void)
 {
+	int ret;
+
+	for (svc_worker_count = 0; svc_worker_count < SVC_WORKERS;
+	     svc_worker_count++) {
+		ret = pthread_create(&svc_workers[svc_worker_count], NULL,
+				     svc_worker, NULL);
+		if (ret) {
+			pr_err("Failed to create the SVC workers\n");
+			break;
+		}
+	}
+
 	return svc_send_protocol_version_request();
 }
 
+void svc_exit(void)
+{
+	int i;
+	struct operation *op;
+
+	for (i = 0; i < svc_worker_count; i++)
+		pthread_cancel(svc_workers[i]);
+	for (i = 0; i < svc_worker_count; i++)
+		pthread_join(svc_workers[i], NULL);
+	svc_worker_count = 0;
+
+	while ((op = TAILQ_FIRST(&svc_jobs))) {
+		TAILQ_REMOVE(&svc_jobs, op, cnode);
+		greybus_complete_operation(op, -ESHUTDOWN);
+	}
+}
+
 void svc_watchdog_disable(void)
 {
 	int fd;
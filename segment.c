@@ -0,0 +1,182 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <debug.h>
+#include <controller.h>
+#include <segment.h>
+
+/* Number of free buffers kept for the next messages */
+#define SEGMENT_POOL_MAX	16
+
+static SLIST_HEAD(segment_head, segment) pool =
+	SLIST_HEAD_INITIALIZER(pool);
+static unsigned int pool_count;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct segment *segment_get(void)
+{
+	struct segment *seg;
+
+	pthread_mutex_lock(&pool_lock);
+	seg = SLIST_FIRST(&pool);
+	if (seg) {
+		SLIST_REMOVE_HEAD(&pool, node);
+		pool_count--;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (!seg)
+		seg = malloc(sizeof(*seg));
+
+	return seg;
+}
+
+void segment_put(struct segment *seg)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (pool_count < SEGMENT_POOL_MAX) {
+		SLIST_INSERT_HEAD(&pool, seg, node);
+		pool_count++;
+		seg = NULL;
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	free(seg);
+}
+
+/*
+ * Split the message in fragments of ctrl->mtu bytes, at most. The
+ * fragments of a message are not interleaved with the ones of another
+ * message written on the connection meanwhile.
+ */
+int segment_write(struct controller *ctrl, struct connection *conn,
+		  void *data, size_t len)
+{
+	int ret = 0;
+	size_t size;
+	size_t offset = 0;
+	uint8_t seq = 0;
+	uint8_t fragment[GB_NETLINK_MTU];
+	struct segment_hdr *hdr = (struct segment_hdr *)fragment;
+	size_t max_size = ctrl->mtu - sizeof(*hdr);
+
+	if (ctrl->mtu < SEGMENT_MIN_MTU || ctrl->mtu > GB_NETLINK_MTU)
+		return -EINVAL;
+
+	pthread_mutex_lock(&conn->tx_lock);
+	while (offset < len) {
+		size = len - offset;
+		if (size > max_size)
+			size = max_size;
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->size = htole16(sizeof(*hdr) + size);
+		hdr->msg_size = htole16(len);
+		hdr->seq = seq++;
+		hdr->pad[1] = SEGMENT_FRAGMENT;
+		if (offset + size == len)
+			hdr->pad[1] |= SEGMENT_LAST;
+		memcpy(fragment + sizeof(*hdr), (uint8_t *)data + offset, size);
+
+		ret = ctrl->write(conn, fragment, sizeof(*hdr) + size);
+		if (ret < 0)
+			break;
+
+		offset += size;
+	}
+	pthread_mutex_unlock(&conn->tx_lock);
+
+	return ret < 0 ? ret : len;
+}
+
+/*
+ * Add a fragment to the message being reassembled in *rx.
+ * Return the size of the message and set *msg once the last fragment has
+ * been received, 0 if more fragments are expected, or an error if the
+ * fragment doesn't match the message (it is then dropped).
+ * The message must be released with segment_put().
+ */
+int segment_receive(struct segment **rx, const void *data, size_t len,
+		    struct segment **msg)
+{
+	size_t size;
+	size_t msg_size;
+	struct segment *seg = *rx;
+	const struct segment_hdr *hdr = data;
+
+	if (len < sizeof(*hdr) || le16toh(hdr->size) != len)
+		return -EPROTO;
+
+	size = len - sizeof(*hdr);
+	msg_size = le16toh(hdr->msg_size);
+	if (msg_size > GB_NETLINK_MTU)
+		return -EMSGSIZE;
+
+	if (hdr->seq == 0) {
+		if (seg) {
+			pr_err("Dropping an incomplete message\n");
+		} else {
+			seg = segment_get();
+			if (!seg)
+				return -ENOMEM;
+			*rx = seg;
+		}
+		seg->len = 0;
+		seg->msg_size = msg_size;
+	} else if (!seg || hdr->seq != seg->seq ||
+		   msg_size != seg->msg_size) {
+		pr_err("Dropping an out of sequence fragment\n");
+		goto err_drop;
+	}
+
+	if (seg->len + size > seg->msg_size) {
+		pr_err("Dropping a message bigger than announced\n");
+		goto err_drop;
+	}
+
+	memcpy(seg->data + seg->len, (uint8_t *)data + sizeof(*hdr), size);
+	seg->len += size;
+	seg->seq = hdr->seq + 1;
+
+	if (!(hdr->pad[1] & SEGMENT_LAST))
+		return 0;
+
+	*rx = NULL;
+	if (seg->len != seg->msg_size) {
+		pr_err("Dropping a truncated message\n");
+		segment_put(seg);
+		return -EPROTO;
+	}
+
+	*msg = seg;
+
+	return seg->len;
+
+err_drop:
+	if (seg) {
+		segment_put(seg);
+		*rx = NULL;
+	}
+
+	return -EPROTO;
+}
@@ -0,0 +1,77 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SEGMENT_H_
+#define _SEGMENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#include <gbridge.h>
+
+/*
+ * Segmentation is used on links that can't carry a whole Greybus message
+ * (see the mtu field of struct controller).
+ * A message bigger than the link MTU is split in fragments, each one
+ * starting with a segment_hdr. The header is laid out like a
+ * gb_operation_msg_hdr, so the controllers handle the fragments like any
+ * other message: the size is at the same offset, and the cport is packed
+ * in pad[0]. The fragments are marked in pad[1], which is always 0 in a
+ * Greybus message, so the messages that fit in the MTU are sent as is.
+ */
+#define SEGMENT_FRAGMENT	0x80
+#define SEGMENT_LAST		0x40
+
+/* Leave room for 8 bytes of payload per fragment, at least */
+#define SEGMENT_MIN_MTU		(GB_NETLINK_MTU / 256 + 8)
+
+struct segment_hdr {
+	__le16 size;		/* Size of the fragment, header included */
+	__le16 msg_size;	/* Size of the whole message */
+	__u8 seq;		/* Fragment number, starting at 0 */
+	__u8 reserved;
+	__u8 pad[2];		/* cport and flags */
+} __packed;
+
+/* A message being reassembled, or a reassembled one */
+struct segment {
+	size_t len;
+	size_t msg_size;
+	uint8_t seq;
+	SLIST_ENTRY(segment) node;
+	uint8_t data[GB_NETLINK_MTU];
+};
+
+struct connection;
+struct controller;
+
+static inline int segment_is_fragment(const void *data)
+{
+	const struct segment_hdr *hdr = data;
+
+	return hdr->pad[1] & SEGMENT_FRAGMENT;
+}
+
+int segment_write(struct controller *ctrl, struct connection *conn,
+		  void *data, size_t len);
+int segment_receive(struct segment **rx, const void *data, size_t len,
+		    struct segment **msg);
+void segment_put(struct segment *seg);
+
+#endif /* _SEGMENT_H_ */
@@ -0,0 +1,280 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Bluetooth benchmark
+ *
+ * The adapter and RFCOMM are replaced by mocks: the inquiry finds a given
+ * number of Greybus modules, and of other devices, and connecting a module
+ * takes a given time before to return one end of a socketpair. The
+ * benchmark takes the place of the AP, and reports how long the controller
+ * takes to bring up all the modules, which shows how many are connected
+ * concurrently. It then lets the controller scan for a while, and reports
+ * the inquiries and the name reads done meanwhile.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <controllers/bluetooth.h>
+
+#define BENCH_MAX_DEVICES	255
+/* In seconds, how long the benchmark waits for the modules */
+#define BENCH_TIMEOUT		60
+
+static unsigned int module_count = 8;
+static unsigned int other_count;
+static unsigned int connect_delay = 1000;
+
+/* What the controller asked to the adapter */
+static atomic_uint inquiries;
+static atomic_uint name_reads;
+
+/* The module ends of the socketpairs, kept open until exit */
+static pthread_mutex_t modules_lock = PTHREAD_MUTEX_INITIALIZER;
+static int module_socks[BENCH_MAX_DEVICES];
+static unsigned int module_connected;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* The mock adapter */
+
+static int mock_hci_open(void **priv)
+{
+	*priv = NULL;
+
+	return 0;
+}
+
+static void mock_hci_close(void *priv)
+{
+}
+
+/* The modules are numbered from 1, and the other devices follow */
+static int mock_hci_inquiry(void *priv, bdaddr_t *bdaddrs, int max)
+{
+	int i;
+
+	atomic_fetch_add(&inquiries, 1);
+	for (i = 0; i < module_count + other_count && i < max; i++) {
+		memset(&bdaddrs[i], 0, sizeof(bdaddrs[i]));
+		bdaddrs[i].b[0] = i + 1;
+	}
+
+	return i;
+}
+
+static int mock_hci_read_remote_name(void *priv, const bdaddr_t *bdaddr,
+				     char *name, size_t len)
+{
+	atomic_fetch_add(&name_reads, 1);
+	if (bdaddr->b[0] <= module_count)
+		snprintf(name, len, "GREYBUS mock %u", bdaddr->b[0]);
+	else
+		snprintf(name, len, "mock device %u", bdaddr->b[0]);
+
+	return 0;
+}
+
+static const struct bluetooth_hci_ops mock_hci = {
+	.open = mock_hci_open,
+	.close = mock_hci_close,
+	.inquiry = mock_hci_inquiry,
+	.read_remote_name = mock_hci_read_remote_name,
+};
+
+/* The mock transport, as slow as an RFCOMM connect */
+
+static int mock_connect(const bdaddr_t *bdaddr)
+{
+	int sv[2];
+
+	/* The only cancellation point, before anything is allocated */
+	usleep(connect_delay * 1000);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+		return -errno;
+
+	pthread_mutex_lock(&modules_lock);
+	module_socks[module_connected++] = sv[1];
+	pthread_mutex_unlock(&modules_lock);
+
+	return sv[0];
+}
+
+static const struct bluetooth_transport_ops mock_transport = {
+	.connect = mock_connect,
+};
+
+/* The AP side */
+
+static int bench_write(struct connection *conn, void *data, size_t len)
+{
+	return len;
+}
+
+static int bench_interface_create(struct interface *intf)
+{
+	intf->id = AP_INTF_ID;
+
+	return 0;
+}
+
+static int bench_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void bench_exit(struct controller *ctrl)
+{
+}
+
+static struct controller bench_controller = {
+	.name = "bench",
+	.init = bench_init,
+	.exit = bench_exit,
+	.write = bench_write,
+	.interface_create = bench_interface_create,
+};
+
+static unsigned int bench_count_modules(void)
+{
+	int i;
+	unsigned int count = 0;
+	struct interface *intf;
+
+	for (i = 1; i < 256; i++) {
+		intf = get_interface(i);
+		if (intf && intf->ctrl == &bluetooth_controller)
+			count++;
+	}
+
+	return count;
+}
+
+static void help(void)
+{
+	printf("gbridge-bt-bench: Bluetooth controller benchmark over mocks\n"
+		"\t-h: Print the help\n"
+		"\t-n count: number of modules found by the inquiry\n"
+		"\t-o count: number of other devices found by the inquiry\n"
+		"\t-d msecs: time taken by each connect\n"
+		"\t-t secs: time to keep scanning once the modules are up\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int ret;
+	unsigned int i;
+	unsigned int count = 0;
+	unsigned int scan_time = 0;
+	uint64_t start, elapsed;
+	struct interface *ap;
+
+	while ((c = getopt(argc, argv, "hn:o:d:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			if (sscanf(optarg, "%u", &module_count) != 1 ||
+			    !module_count)
+				goto err_help;
+			break;
+		case 'o':
+			if (sscanf(optarg, "%u", &other_count) != 1)
+				goto err_help;
+			break;
+		case 'd':
+			if (sscanf(optarg, "%u", &connect_delay) != 1)
+				goto err_help;
+			break;
+		case 't':
+			if (sscanf(optarg, "%u", &scan_time) != 1)
+				goto err_help;
+			break;
+		default:
+			goto err_help;
+		}
+	}
+
+	/* The devices are told apart by a single byte of their address */
+	if (module_count + other_count > BENCH_MAX_DEVICES)
+		goto err_help;
+
+	set_log_level(LL_ERROR);
+
+	ret = greybus_init();
+	if (ret)
+		return ret;
+
+	bluetooth_set_hci_ops(&mock_hci);
+	bluetooth_set_transport_ops(&mock_transport);
+	register_controller(&bench_controller);
+	register_controller(&bluetooth_controller);
+
+	start = now_ms();
+	controllers_init();
+
+	ap = interface_create(&bench_controller, 0, 0, 0, NULL);
+	if (!ap)
+		return -ENOMEM;
+	/* Used by svc to send the hotplug event */
+	connection_create(AP_INTF_ID, SVC_CPORT, AP_INTF_ID, SVC_CPORT);
+
+	while (count < module_count &&
+	       now_ms() - start < BENCH_TIMEOUT * 1000) {
+		usleep(10000);
+		count = bench_count_modules();
+	}
+	elapsed = now_ms() - start;
+
+	printf("%u of %u modules connected in %.2f s (%u ms per connect)\n",
+	       count, module_count, elapsed / 1000.0, connect_delay);
+
+	/* The names already read are cached, and the scans spaced out */
+	sleep(scan_time);
+	elapsed = now_ms() - start;
+	printf("%u inquiries and %u name reads of %u devices in %.2f s\n",
+	       atomic_load(&inquiries), atomic_load(&name_reads),
+	       module_count + other_count, elapsed / 1000.0);
+
+	controllers_exit();
+	for (i = 0; i < module_connected; i++)
+		close(module_socks[i]);
+
+	return count == module_count ? 0 : -ETIMEDOUT;
+
+err_help:
+	help();
+	return -EINVAL;
+}
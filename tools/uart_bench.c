@@ -0,0 +1,605 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * UART benchmark
+ *
+ * A pseudo-terminal pair replaces the serial link: the UART controller is
+ * attached to the slave end, and a simulated module runs on the master end.
+ * The module decodes the messages like a firmware would, and gives them to
+ * the gbsim loopback driver (protocols/loopback.c), registered on a local
+ * interface. The responses of the driver are sent back on the pty.
+ * The benchmark takes the place of the AP: it sends loopback transfers
+ * through controller_write(), and gets the responses back from the UART
+ * reader thread. This measures the software path of the UART controller,
+ * not the serial link, since a pty is not rate limited.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <compress.h>
+#include <framing.h>
+#include <segment.h>
+#include <controllers/uart.h>
+#include <protocols/protocols.h>
+
+#define BENCH_CPORT		1
+#define MODULE_CPORT		1
+#define BENCH_MAX_OPS		65536
+
+struct bench {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int inflight;
+	unsigned int received;
+	uint64_t sent_at[BENCH_MAX_OPS];
+	uint64_t *latencies;
+};
+
+static struct bench bench = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static enum uart_framing framing = UART_FRAMING_NONE;
+static struct tx_queue_aggregation aggregation;
+static unsigned int mtu;
+static int compress;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The simulated module, on the master end of the pty.
+ * Its loopback cport is connected to the link interface, whose write
+ * sends the responses of the driver to the pty.
+ */
+
+struct module {
+	int fd;
+	struct segment *rx_segment;
+	struct interface *intf;
+	struct interface *link;
+	size_t start;
+	size_t end;
+	uint8_t buf[8 * GB_NETLINK_MTU];
+};
+
+static int module_fill(struct module *mod)
+{
+	int ret;
+
+	if (mod->start == mod->end) {
+		mod->start = mod->end = 0;
+	} else if (mod->end == sizeof(mod->buf)) {
+		memmove(mod->buf, mod->buf + mod->start, mod->end - mod->start);
+		mod->end -= mod->start;
+		mod->start = 0;
+	}
+
+	ret = read(mod->fd, mod->buf + mod->end, sizeof(mod->buf) - mod->end);
+	if (ret <= 0)
+		return -EIO;
+	mod->end += ret;
+
+	return 0;
+}
+
+static int module_read(struct module *mod, uint8_t *msg)
+{
+	int ret;
+	size_t size;
+	uint8_t *delimiter;
+
+	if (framing == UART_FRAMING_COBS) {
+		while (1) {
+			delimiter = memchr(mod->buf + mod->start, FRAME_DELIMITER,
+					   mod->end - mod->start);
+			if (delimiter)
+				break;
+			if (module_fill(mod))
+				return -EIO;
+		}
+
+		size = delimiter - (mod->buf + mod->start);
+		ret = frame_decode(mod->buf + mod->start, size,
+				   msg, GB_NETLINK_MTU);
+		mod->start += size + 1;
+		return ret;
+	}
+
+	while (mod->end - mod->start < sizeof(struct gb_operation_msg_hdr))
+		if (module_fill(mod))
+			return -EIO;
+
+	size = gb_operation_msg_size(mod->buf + mod->start);
+	if (size < sizeof(struct gb_operation_msg_hdr) || size > GB_NETLINK_MTU)
+		return -EPROTO;
+
+	while (mod->end - mod->start < size)
+		if (module_fill(mod))
+			return -EIO;
+
+	memcpy(msg, mod->buf + mod->start, size);
+	mod->start += size;
+
+	return size;
+}
+
+static int module_write(struct module *mod, uint8_t *msg, size_t len)
+{
+	int ret;
+	uint8_t frame[FRAME_MAX_SIZE(GB_NETLINK_MTU)];
+
+	if (framing == UART_FRAMING_COBS) {
+		len = frame_encode(msg, len, frame);
+		msg = frame;
+	}
+
+	while (len) {
+		ret = write(mod->fd, msg, len);
+		if (ret < 0)
+			return -errno;
+		msg += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Split the messages bigger than the link MTU, like segment_write() */
+static int module_send(struct module *mod, uint8_t *msg, size_t len)
+{
+	int ret;
+	size_t size;
+	size_t offset = 0;
+	uint8_t seq = 0;
+	uint8_t fragment[GB_NETLINK_MTU];
+	struct segment_hdr *hdr = (struct segment_hdr *)fragment;
+
+	if (!mtu || len <= mtu)
+		return module_write(mod, msg, len);
+
+	while (offset < len) {
+		size = len - offset;
+		if (size > mtu - sizeof(*hdr))
+			size = mtu - sizeof(*hdr);
+
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->size = htole16(sizeof(*hdr) + size);
+		hdr->msg_size = htole16(len);
+		hdr->seq = seq++;
+		hdr->pad[0] = MODULE_CPORT;
+		hdr->pad[1] = SEGMENT_FRAGMENT;
+		if (offset + size == len)
+			hdr->pad[1] |= SEGMENT_LAST;
+		memcpy(fragment + sizeof(*hdr), msg + offset, size);
+
+		ret = module_write(mod, fragment, sizeof(*hdr) + size);
+		if (ret)
+			return ret;
+		offset += size;
+	}
+
+	return 0;
+}
+
+/* Called by greybus_handler(), with the responses of the loopback driver */
+static int module_link_write(struct connection *conn, void *data, size_t len)
+{
+	int ret;
+	struct module *mod = conn->intf1->priv;
+	struct gb_operation_msg_hdr *hdr = data;
+	uint8_t buf[GB_NETLINK_MTU];
+
+	hdr->pad[0] = MODULE_CPORT;
+	hdr->pad[1] = 0;
+
+	ret = 0;
+	if (conn->compress)
+		ret = compress_message(conn, data, len, buf, sizeof(buf));
+	if (ret > 0) {
+		((struct compress_hdr *)buf)->pad[0] = MODULE_CPORT;
+		ret = module_send(mod, buf, ret);
+	} else {
+		ret = module_send(mod, data, len);
+	}
+
+	return ret ? ret : len;
+}
+
+static int module_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void module_exit(struct controller *ctrl)
+{
+}
+
+static struct controller module_controller = {
+	.name = "module",
+	.init = module_init,
+	.exit = module_exit,
+	.write = module_link_write,
+};
+
+static void module_handle(struct module *mod, struct gb_operation_msg_hdr *hdr)
+{
+	cport_clear(hdr);
+	greybus_handler(mod->intf->id, MODULE_CPORT, hdr);
+}
+
+static int module_create(struct module *mod)
+{
+	int ret;
+
+	mod->link = interface_create(&module_controller, 0, 0, 0, mod);
+	mod->intf = interface_create(&module_controller, 0, 0, 0, mod);
+	if (!mod->link || !mod->intf)
+		return -ENOMEM;
+
+	ret = loopback_register_driver(mod->intf->id, MODULE_CPORT);
+	if (ret)
+		return ret;
+
+	/* The module compresses first, which enables it on the gbridge side */
+	module_controller.compress = compress ? COMPRESS_ON : COMPRESS_OFF;
+
+	return connection_create(mod->link->id, MODULE_CPORT,
+				 mod->intf->id, MODULE_CPORT);
+}
+
+static void module_receive(struct module *mod, uint8_t *msg, size_t len)
+{
+	int ret;
+	struct segment *seg = NULL;
+	uint8_t buf[GB_NETLINK_MTU];
+
+	if (segment_is_fragment(msg)) {
+		ret = segment_receive(&mod->rx_segment, msg, len, &seg);
+		if (ret <= 0)
+			return;
+		msg = seg->data;
+		len = ret;
+	}
+
+	if (compress_is_compressed(msg)) {
+		ret = decompress_message(msg, len, buf, sizeof(buf));
+		if (ret > 0)
+			module_handle(mod, (struct gb_operation_msg_hdr *)buf);
+	} else {
+		module_handle(mod, (struct gb_operation_msg_hdr *)msg);
+	}
+
+	if (seg)
+		segment_put(seg);
+}
+
+static void *module_thread(void *data)
+{
+	int ret;
+	size_t size;
+	uint8_t *msg;
+	struct module *mod = data;
+	uint8_t buf[GB_NETLINK_MTU];
+
+	while (1) {
+		ret = module_read(mod, buf);
+		if (ret == -EIO)
+			break;
+		if (ret < 0)
+			continue;
+
+		/* An aggregated frame holds several messages */
+		for (msg = buf; msg + sizeof(struct gb_operation_msg_hdr) <=
+		     buf + ret; msg += size) {
+			size = gb_operation_msg_size(msg);
+			if (size < sizeof(struct gb_operation_msg_hdr) ||
+			    msg + size > buf + ret)
+				break;
+			module_receive(mod, msg, size);
+		}
+	}
+
+	return NULL;
+}
+
+/* The AP side */
+
+static int bench_write(struct connection *conn, void *data, size_t len)
+{
+	uint16_t id;
+	struct gb_operation_msg_hdr *hdr = data;
+
+	if (conn->cport1_id != BENCH_CPORT || !(hdr->type & OP_RESPONSE))
+		return len;
+
+	id = le16toh(hdr->operation_id);
+	pthread_mutex_lock(&bench.lock);
+	bench.latencies[bench.received++] = now_ns() - bench.sent_at[id];
+	bench.inflight--;
+	pthread_cond_broadcast(&bench.cond);
+	pthread_mutex_unlock(&bench.lock);
+
+	return len;
+}
+
+static int bench_interface_create(struct interface *intf)
+{
+	intf->id = AP_INTF_ID;
+
+	return 0;
+}
+
+static int bench_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void bench_exit(struct controller *ctrl)
+{
+}
+
+static struct controller bench_controller = {
+	.name = "bench",
+	.init = bench_init,
+	.exit = bench_exit,
+	.write = bench_write,
+	.interface_create = bench_interface_create,
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t *u64_a = a;
+	const uint64_t *u64_b = b;
+
+	return (*u64_a > *u64_b) - (*u64_a < *u64_b);
+}
+
+static int bench_run(uint8_t intf_id, size_t size,
+		     unsigned int count, unsigned int window)
+{
+	int ret;
+	unsigned int i;
+	uint64_t start, elapsed, sum = 0;
+	uint8_t msg[GB_NETLINK_MTU];
+	struct gb_operation_msg_hdr *hdr = (struct gb_operation_msg_hdr *)msg;
+	struct gb_loopback_transfer_request *req = (void *)(hdr + 1);
+	size_t len = sizeof(*hdr) + sizeof(*req) + size;
+
+	memset(msg, 0xa5, sizeof(msg));
+	bench.received = 0;
+	bench.inflight = 0;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		pthread_mutex_lock(&bench.lock);
+		while (bench.inflight >= window)
+			pthread_cond_wait(&bench.cond, &bench.lock);
+		bench.inflight++;
+		bench.sent_at[i % BENCH_MAX_OPS] = now_ns();
+		pthread_mutex_unlock(&bench.lock);
+
+		hdr->size = htole16(len);
+		hdr->operation_id = htole16(i % BENCH_MAX_OPS);
+		hdr->type = GB_LOOPBACK_TYPE_TRANSFER;
+		hdr->result = 0;
+		hdr->pad[0] = 0;
+		hdr->pad[1] = 0;
+		req->len = htole32(size);
+		req->reserved0 = 0;
+		req->reserved1 = 0;
+
+		ret = controller_write(intf_id, MODULE_CPORT, msg, len);
+		if (ret < 0) {
+			pr_err("Failed to send the request: %d\n", ret);
+			return ret;
+		}
+	}
+
+	pthread_mutex_lock(&bench.lock);
+	while (bench.inflight)
+		pthread_cond_wait(&bench.cond, &bench.lock);
+	pthread_mutex_unlock(&bench.lock);
+	elapsed = now_ns() - start;
+
+	qsort(bench.latencies, count, sizeof(uint64_t), compare_u64);
+	for (i = 0; i < count; i++)
+		sum += bench.latencies[i];
+
+	printf("%6zu %6u %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+	       size, window,
+	       bench.latencies[0] / 1000.0,
+	       sum / count / 1000.0,
+	       bench.latencies[count * 99 / 100] / 1000.0,
+	       bench.latencies[count - 1] / 1000.0,
+	       2.0 * len * count / (elapsed / 1000000000.0) / 1024);
+
+	return 0;
+}
+
+static void help(void)
+{
+	printf("gbridge-uart-bench: UART controller benchmark over a pty\n"
+		"\t-h: Print the help\n"
+		"\t-b baudrate: set the uart baudrate\n"
+		"\t-f framing: set the uart framing (none or cobs)\n"
+		"\t-a usecs[,bytes]: aggregate the messages\n"
+		"\t-l mtu: split the messages bigger than mtu\n"
+		"\t-z: compress the messages\n"
+		"\t-n count: number of transfers per run\n"
+		"\t-w window: number of transfers in flight for throughput\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int ret;
+	int i;
+	int master;
+	int baudrate = 115200;
+	unsigned int count = 10000;
+	unsigned int window = 16;
+	struct termios tio;
+	struct interface *ap, *intf = NULL;
+	pthread_t thread;
+	struct module *mod;
+	const size_t sizes[] = { 0, 16, 64, 256, 1024,
+				 GB_NETLINK_MTU - 8 -
+				 sizeof(struct gb_loopback_transfer_request) };
+
+	while ((c = getopt(argc, argv, "hb:f:a:l:zn:w:")) != -1) {
+		switch (c) {
+		case 'b':
+			if (sscanf(optarg, "%d", &baudrate) != 1)
+				goto err_help;
+			break;
+		case 'f':
+			if (strcmp(optarg, "cobs") == 0)
+				framing = UART_FRAMING_COBS;
+			else if (strcmp(optarg, "none") != 0)
+				goto err_help;
+			break;
+		case 'a':
+			if (tx_queue_parse_aggregation(optarg, &aggregation))
+				goto err_help;
+			break;
+		case 'l':
+			if (sscanf(optarg, "%u", &mtu) != 1)
+				goto err_help;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'n':
+			if (sscanf(optarg, "%u", &count) != 1 || !count)
+				goto err_help;
+			break;
+		case 'w':
+			if (sscanf(optarg, "%u", &window) != 1 || !window ||
+			    window >= BENCH_MAX_OPS)
+				goto err_help;
+			break;
+		default:
+			goto err_help;
+		}
+	}
+
+	set_log_level(LL_ERROR);
+
+	bench.latencies = malloc(count * sizeof(uint64_t));
+	mod = malloc(sizeof(*mod));
+	if (!bench.latencies || !mod)
+		return -ENOMEM;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) || unlockpt(master)) {
+		perror("Failed to create the pty");
+		return -errno;
+	}
+	tcgetattr(master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(master, TCSANOW, &tio);
+
+	mod->fd = master;
+	mod->rx_segment = NULL;
+	mod->start = 0;
+	mod->end = 0;
+
+	ret = greybus_init();
+	if (ret)
+		return ret;
+
+	register_controller(&bench_controller);
+	register_controller(&module_controller);
+	ret = register_uart_controller(ptsname(master), baudrate, framing,
+				       &aggregation, mtu, compress);
+	if (ret)
+		return ret;
+	controllers_init();
+
+	ap = interface_create(&bench_controller, 0, 0, 0, NULL);
+	if (!ap)
+		return -ENOMEM;
+	/* Used by svc to send the hotplug event */
+	connection_create(AP_INTF_ID, SVC_CPORT, AP_INTF_ID, SVC_CPORT);
+
+	ret = module_create(mod);
+	if (ret)
+		return ret;
+
+	ret = pthread_create(&thread, NULL, module_thread, mod);
+	if (ret)
+		return -ret;
+
+	/* Wait for the UART controller to hotplug the module */
+	while (!intf) {
+		for (i = 1; i < 256 && !intf; i++) {
+			intf = get_interface(i);
+			if (intf && (intf->ctrl == &bench_controller ||
+				     intf->ctrl == &module_controller))
+				intf = NULL;
+		}
+		usleep(1000);
+	}
+
+	ret = connection_create(AP_INTF_ID, BENCH_CPORT, intf->id, MODULE_CPORT);
+	if (ret)
+		return ret;
+
+	printf("latency: -w 1, throughput: -w %u, %u transfers per run\n",
+	       window, count);
+	printf("%6s %6s %10s %10s %10s %10s %12s\n", "size", "window",
+	       "min (us)", "avg (us)", "p99 (us)", "max (us)", "KiB/s");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ret = bench_run(intf->id, sizes[i], count, 1);
+		if (ret)
+			break;
+		ret = bench_run(intf->id, sizes[i], count, window);
+		if (ret)
+			break;
+	}
+
+	controllers_exit();
+	close(master);
+
+	return ret;
+
+err_help:
+	help();
+	return -EINVAL;
+}
@@ -0,0 +1,398 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Unix socket benchmark
+ *
+ * A simulated module is connected to the unix socket controller through a
+ * socket pair (see unix_socketpair_hotplug()). On the module end, the
+ * messages are given to the gbsim loopback driver (protocols/loopback.c),
+ * registered on a local interface, and its responses are sent back on the
+ * socket pair.
+ * The benchmark takes the place of the AP: it sends loopback transfers
+ * through controller_write(), and gets the responses back from the unix
+ * socket reader thread.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <debug.h>
+#include <gbridge.h>
+#include <controller.h>
+#include <controllers/unix_socket.h>
+#include <protocols/protocols.h>
+
+#define BENCH_CPORT		1
+#define MODULE_CPORT		1
+#define BENCH_MAX_OPS		65536
+
+struct bench {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int inflight;
+	unsigned int received;
+	uint64_t sent_at[BENCH_MAX_OPS];
+	uint64_t *latencies;
+};
+
+static struct bench bench = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * The simulated module, on the other end of the socket pair.
+ * Its loopback cport is connected to the link interface, whose write
+ * sends the responses of the driver to the socket pair.
+ */
+
+struct module {
+	int fd;
+	struct interface *intf;
+	struct interface *link;
+};
+
+static struct module module = {
+	.fd = -1,
+};
+
+static int module_link_write(struct connection *conn, void *data, size_t len)
+{
+	int ret;
+
+	cport_pack(data, conn->cport2_id);
+	ret = send(module.fd, data, len, MSG_NOSIGNAL);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+static int module_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void module_exit(struct controller *ctrl)
+{
+}
+
+static struct controller module_controller = {
+	.name = "module",
+	.init = module_init,
+	.exit = module_exit,
+	.write = module_link_write,
+};
+
+static void *module_thread(void *data)
+{
+	int ret;
+	uint16_t cport_id;
+	uint8_t buf[GB_NETLINK_MTU];
+	struct gb_operation_msg_hdr *hdr = (struct gb_operation_msg_hdr *)buf;
+
+	while (1) {
+		ret = recv(module.fd, buf, sizeof(buf), 0);
+		if (ret <= 0)
+			break;
+		if (ret < sizeof(*hdr) || gb_operation_msg_size(hdr) != ret)
+			continue;
+
+		cport_id = cport_unpack(hdr);
+		cport_clear(hdr);
+		greybus_handler(module.intf->id, cport_id, hdr);
+	}
+
+	return NULL;
+}
+
+static int module_create(void)
+{
+	int ret;
+
+	module.link = interface_create(&module_controller, 0, 0, 0, NULL);
+	module.intf = interface_create(&module_controller, 0, 0, 0, NULL);
+	if (!module.link || !module.intf)
+		return -ENOMEM;
+
+	ret = loopback_register_driver(module.intf->id, MODULE_CPORT);
+	if (ret)
+		return ret;
+
+	return connection_create(module.link->id, MODULE_CPORT,
+				 module.intf->id, MODULE_CPORT);
+}
+
+/* The AP side */
+
+static int bench_write(struct connection *conn, void *data, size_t len)
+{
+	uint16_t id;
+	struct gb_operation_msg_hdr *hdr = data;
+
+	if (conn->cport1_id != BENCH_CPORT || !(hdr->type & OP_RESPONSE))
+		return len;
+
+	id = le16toh(hdr->operation_id);
+	pthread_mutex_lock(&bench.lock);
+	bench.latencies[bench.received++] = now_ns() - bench.sent_at[id];
+	bench.inflight--;
+	pthread_cond_broadcast(&bench.cond);
+	pthread_mutex_unlock(&bench.lock);
+
+	return len;
+}
+
+static int bench_interface_create(struct interface *intf)
+{
+	intf->id = AP_INTF_ID;
+
+	return 0;
+}
+
+static int bench_init(struct controller *ctrl)
+{
+	return 0;
+}
+
+static void bench_exit(struct controller *ctrl)
+{
+}
+
+static struct controller bench_controller = {
+	.name = "bench",
+	.init = bench_init,
+	.exit = bench_exit,
+	.write = bench_write,
+	.interface_create = bench_interface_create,
+};
+
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t *u64_a = a;
+	const uint64_t *u64_b = b;
+
+	return (*u64_a > *u64_b) - (*u64_a < *u64_b);
+}
+
+static int bench_run(uint8_t intf_id, size_t size,
+		     unsigned int count, unsigned int window)
+{
+	int ret;
+	unsigned int i;
+	uint64_t start, elapsed, sum = 0;
+	uint8_t msg[GB_NETLINK_MTU];
+	struct gb_operation_msg_hdr *hdr = (struct gb_operation_msg_hdr *)msg;
+	struct gb_loopback_transfer_request *req = (void *)(hdr + 1);
+	size_t len = sizeof(*hdr) + sizeof(*req) + size;
+
+	memset(msg, 0xa5, sizeof(msg));
+	bench.received = 0;
+	bench.inflight = 0;
+
+	start = now_ns();
+	for (i = 0; i < count; i++) {
+		pthread_mutex_lock(&bench.lock);
+		while (bench.inflight >= window)
+			pthread_cond_wait(&bench.cond, &bench.lock);
+		bench.inflight++;
+		bench.sent_at[i % BENCH_MAX_OPS] = now_ns();
+		pthread_mutex_unlock(&bench.lock);
+
+		hdr->size = htole16(len);
+		hdr->operation_id = htole16(i % BENCH_MAX_OPS);
+		hdr->type = GB_LOOPBACK_TYPE_TRANSFER;
+		hdr->result = 0;
+		hdr->pad[0] = 0;
+		hdr->pad[1] = 0;
+		req->len = htole32(size);
+		req->reserved0 = 0;
+		req->reserved1 = 0;
+
+		ret = controller_write(intf_id, MODULE_CPORT, msg, len);
+		if (ret < 0) {
+			pr_err("Failed to send the request: %d\n", ret);
+			return ret;
+		}
+	}
+
+	pthread_mutex_lock(&bench.lock);
+	while (bench.inflight)
+		pthread_cond_wait(&bench.cond, &bench.lock);
+	pthread_mutex_unlock(&bench.lock);
+	elapsed = now_ns() - start;
+
+	qsort(bench.latencies, count, sizeof(uint64_t), compare_u64);
+	for (i = 0; i < count; i++)
+		sum += bench.latencies[i];
+
+	printf("%6zu %6u %10.1f %10.1f %10.1f %10.1f %12.1f\n",
+	       size, window,
+	       bench.latencies[0] / 1000.0,
+	       sum / count / 1000.0,
+	       bench.latencies[count * 99 / 100] / 1000.0,
+	       bench.latencies[count - 1] / 1000.0,
+	       2.0 * len * count / (elapsed / 1000000000.0) / 1024);
+
+	return 0;
+}
+
+static void help(void)
+{
+	printf("gbridge-unix-bench: unix socket controller benchmark over "
+		"a socket pair\n"
+		"\t-h: Print the help\n"
+		"\t-n count: number of transfers per run\n"
+		"\t-w window: number of transfers in flight for throughput\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+	int ret;
+	int i;
+	unsigned int count = 10000;
+	unsigned int window = 16;
+	char dir[] = "/tmp/gbridge-unix-bench-XXXXXX";
+	struct interface *ap, *intf = NULL;
+	pthread_t thread;
+	int module_running = 0;
+	const size_t sizes[] = { 0, 16, 64, 256, 1024,
+				 GB_NETLINK_MTU - 8 -
+				 sizeof(struct gb_loopback_transfer_request) };
+
+	while ((c = getopt(argc, argv, "hn:w:")) != -1) {
+		switch (c) {
+		case 'n':
+			if (sscanf(optarg, "%u", &count) != 1 || !count)
+				goto err_help;
+			break;
+		case 'w':
+			if (sscanf(optarg, "%u", &window) != 1 || !window ||
+			    window >= BENCH_MAX_OPS)
+				goto err_help;
+			break;
+		default:
+			goto err_help;
+		}
+	}
+
+	set_log_level(LL_ERROR);
+
+	bench.latencies = malloc(count * sizeof(uint64_t));
+	if (!bench.latencies)
+		return -ENOMEM;
+
+	/* The controller watches a directory, left empty */
+	if (!mkdtemp(dir)) {
+		perror("Failed to create the socket directory");
+		return -errno;
+	}
+
+	ret = greybus_init();
+	if (ret)
+		goto out_rmdir;
+
+	register_controller(&bench_controller);
+	register_controller(&module_controller);
+	ret = register_unix_controller(dir);
+	if (ret)
+		goto out_rmdir;
+	controllers_init();
+
+	ap = interface_create(&bench_controller, 0, 0, 0, NULL);
+	if (!ap) {
+		ret = -ENOMEM;
+		goto out_exit;
+	}
+	/* Used by svc to send the hotplug event */
+	connection_create(AP_INTF_ID, SVC_CPORT, AP_INTF_ID, SVC_CPORT);
+
+	ret = module_create();
+	if (ret)
+		goto out_exit;
+
+	ret = unix_socketpair_hotplug("bench", &module.fd);
+	if (ret)
+		goto out_exit;
+
+	ret = pthread_create(&thread, NULL, module_thread, NULL);
+	if (ret) {
+		ret = -ret;
+		goto out_exit;
+	}
+	module_running = 1;
+
+	/* The interface of the socket pair is the only other one */
+	for (i = 1; i < 256 && !intf; i++) {
+		intf = get_interface(i);
+		if (intf && (intf->ctrl == &bench_controller ||
+			     intf->ctrl == &module_controller))
+			intf = NULL;
+	}
+
+	ret = connection_create(AP_INTF_ID, BENCH_CPORT, intf->id, MODULE_CPORT);
+	if (ret)
+		goto out_exit;
+
+	printf("latency: -w 1, throughput: -w %u, %u transfers per run\n",
+	       window, count);
+	printf("%6s %6s %10s %10s %10s %10s %12s\n", "size", "window",
+	       "min (us)", "avg (us)", "p99 (us)", "max (us)", "KiB/s");
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		ret = bench_run(intf->id, sizes[i], count, 1);
+		if (ret)
+			break;
+		ret = bench_run(intf->id, sizes[i], count, window);
+		if (ret)
+			break;
+	}
+
+out_exit:
+	/* The module thread stops once the controller end is closed */
+	controllers_exit();
+	if (module_running)
+		pthread_join(thread, NULL);
+	if (module.fd >= 0)
+		close(module.fd);
+out_rmdir:
+	rmdir(dir);
+
+	return ret;
+
+err_help:
+	help();
+	return -EINVAL;
+}
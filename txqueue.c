@@ -0,0 +1,275 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <debug.h>
+#include <txqueue.h>
+
+/* Wait for more messages, until the aggregation budget is exhausted */
+static void tx_queue_aggregate(struct tx_queue *queue)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_nsec += (long)queue->aggregation.delay * 1000;
+	deadline.tv_sec += deadline.tv_nsec / 1000000000;
+	deadline.tv_nsec %= 1000000000;
+
+	while (!queue->stop && queue->stats.depth < TX_QUEUE_BURST_MAX) {
+		if (queue->aggregation.size &&
+		    queue->bytes >= queue->aggregation.size)
+			break;
+		if (pthread_cond_timedwait(&queue->cond, &queue->lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+	}
+}
+
+static void *tx_queue_thread(void *data)
+{
+	int i;
+	int ret;
+	int count;
+	size_t bytes;
+	struct tx_queue *queue = data;
+	struct tx_msg *msgs[TX_QUEUE_BURST_MAX];
+	struct iovec iov[TX_QUEUE_BURST_MAX];
+
+	pthread_mutex_lock(&queue->lock);
+	while (1) {
+		while (TAILQ_EMPTY(&queue->msgs) && !queue->stop) {
+			queue->busy = 0;
+			pthread_cond_broadcast(&queue->idle);
+			pthread_cond_wait(&queue->cond, &queue->lock);
+		}
+
+		if (TAILQ_EMPTY(&queue->msgs))
+			break;
+
+		queue->busy = 1;
+		if (queue->aggregation.delay)
+			tx_queue_aggregate(queue);
+
+		bytes = 0;
+		for (count = 0; count < TX_QUEUE_BURST_MAX; count++) {
+			msgs[count] = TAILQ_FIRST(&queue->msgs);
+			if (!msgs[count])
+				break;
+			TAILQ_REMOVE(&queue->msgs, msgs[count], node);
+			iov[count].iov_base = msgs[count]->data;
+			iov[count].iov_len = msgs[count]->len;
+			bytes += msgs[count]->len;
+		}
+		queue->stats.depth -= count;
+		queue->bytes -= bytes;
+		pthread_cond_broadcast(&queue->room);
+		pthread_mutex_unlock(&queue->lock);
+
+		ret = queue->flush(queue->priv, iov, count);
+		if (ret < 0)
+			pr_err("%s: Failed to write %d messages: %d\n",
+			       queue->name, count, ret);
+
+		for (i = 0; i < count; i++)
+			free(msgs[i]);
+
+		pthread_mutex_lock(&queue->lock);
+		queue->stats.bursts++;
+		if (ret < 0) {
+			queue->stats.errors += count;
+			queue->error = ret;
+			pthread_cond_broadcast(&queue->room);
+		} else {
+			queue->stats.msgs += count;
+			queue->stats.bytes += bytes;
+		}
+	}
+	queue->busy = 0;
+	pthread_cond_broadcast(&queue->idle);
+	pthread_mutex_unlock(&queue->lock);
+
+	return NULL;
+}
+
+int tx_queue_init(struct tx_queue *queue, const char *name,
+		  tx_queue_flush_t *flush, void *priv)
+{
+	int ret;
+	pthread_condattr_t attr;
+
+	memset(queue, 0, sizeof(*queue));
+	queue->name = name;
+	queue->flush = flush;
+	queue->priv = priv;
+	TAILQ_INIT(&queue->msgs);
+	pthread_mutex_init(&queue->lock, NULL);
+	/* The aggregation deadline must not move with the wall clock */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&queue->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&queue->idle, NULL);
+	pthread_cond_init(&queue->room, NULL);
+
+	ret = pthread_create(&queue->thread, NULL, tx_queue_thread, queue);
+	if (ret) {
+		pthread_cond_destroy(&queue->room);
+		pthread_cond_destroy(&queue->idle);
+		pthread_cond_destroy(&queue->cond);
+		pthread_mutex_destroy(&queue->lock);
+		return -ret;
+	}
+
+	return 0;
+}
+
+/* Write the queued messages, and stop the thread */
+void tx_queue_exit(struct tx_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->stop = 1;
+	pthread_cond_signal(&queue->cond);
+	pthread_cond_broadcast(&queue->room);
+	pthread_mutex_unlock(&queue->lock);
+
+	pthread_join(queue->thread, NULL);
+
+	pthread_cond_destroy(&queue->room);
+	pthread_cond_destroy(&queue->idle);
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->lock);
+}
+
+/*
+ * Block while the queue is full, so a slow link pushes back on its writers
+ * instead of piling up messages.
+ * If the last flush has failed, its error is returned, and the message
+ * isn't queued.
+ */
+int tx_queue_push(struct tx_queue *queue, const void *data, size_t len)
+{
+	int ret;
+	struct tx_msg *msg;
+
+	msg = malloc(sizeof(*msg) + len);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->len = len;
+	memcpy(msg->data, data, len);
+
+	pthread_mutex_lock(&queue->lock);
+	while (!queue->stop && !queue->error &&
+	       queue->stats.depth >= TX_QUEUE_DEPTH_MAX)
+		pthread_cond_wait(&queue->room, &queue->lock);
+
+	if (queue->stop || queue->error) {
+		ret = -ESHUTDOWN;
+		if (!queue->stop) {
+			ret = queue->error;
+			queue->error = 0;
+		}
+		pthread_mutex_unlock(&queue->lock);
+		free(msg);
+		return ret;
+	}
+
+	TAILQ_INSERT_TAIL(&queue->msgs, msg, node);
+	queue->bytes += len;
+	queue->stats.depth++;
+	if (queue->stats.depth > queue->stats.max_depth)
+		queue->stats.max_depth = queue->stats.depth;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+
+	return len;
+}
+
+/* Wait until all the queued messages have been given to flush callback */
+void tx_queue_drain(struct tx_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	while (queue->busy || !TAILQ_EMPTY(&queue->msgs))
+		pthread_cond_wait(&queue->idle, &queue->lock);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void tx_queue_get_stats(struct tx_queue *queue, struct tx_queue_stats *stats)
+{
+	pthread_mutex_lock(&queue->lock);
+	*stats = queue->stats;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void tx_queue_set_aggregation(struct tx_queue *queue,
+			      const struct tx_queue_aggregation *aggregation)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->aggregation = *aggregation;
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* Parse an aggregation budget given as "usecs[,bytes]" */
+int tx_queue_parse_aggregation(const char *str,
+			       struct tx_queue_aggregation *aggregation)
+{
+	int ret;
+	unsigned int delay;
+	size_t size = 0;
+
+	ret = sscanf(str, "%u,%zu", &delay, &size);
+	if (ret < 1)
+		return -EINVAL;
+
+	aggregation->delay = delay;
+	aggregation->size = size;
+
+	return 0;
+}
+
+/* Write all the buffers to a stream, for the flush callbacks */
+int tx_writev_all(int fd, struct iovec *iov, int count)
+{
+	int ret;
+
+	while (count) {
+		ret = writev(fd, iov, count);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		while (count && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count) {
+			iov->iov_base = (uint8_t *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+
+	return 0;
+}
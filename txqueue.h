@@ -0,0 +1,101 @@
+/*
+ * GBridge (Greybus Bridge)
+ * Copyright (c) 2016 Alexandre Bailon
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TXQUEUE_H_
+#define _TXQUEUE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+/* Maximum number of messages given at once to the flush callback */
+#define TX_QUEUE_BURST_MAX	64
+/* Maximum number of messages queued, before tx_queue_push() blocks */
+#define TX_QUEUE_DEPTH_MAX	256
+
+/*
+ * Messages pushed to the queue are copied, and then written by a single
+ * thread, so writers never interleave their messages.
+ * Every message queued when the thread wakes up is given at once to the
+ * flush callback, which may write them with a single syscall.
+ * A writer blocks while the queue is full, and gets the error of a failed
+ * flush on its next push.
+ */
+typedef int tx_queue_flush_t(void *priv, struct iovec *iov, int count);
+
+/*
+ * With aggregation, the thread waits up to delay usecs after the first
+ * message, or until size bytes are queued, before to flush, so small
+ * messages sent close together end up in the same burst.
+ */
+struct tx_queue_aggregation {
+	unsigned int delay;
+	size_t size;
+};
+
+struct tx_msg {
+	size_t len;
+	TAILQ_ENTRY(tx_msg) node;
+	uint8_t data[];
+};
+
+struct tx_queue_stats {
+	unsigned int depth;
+	unsigned int max_depth;
+	uint64_t msgs;
+	uint64_t bursts;
+	uint64_t bytes;
+	uint64_t errors;
+};
+
+struct tx_queue {
+	const char *name;
+	tx_queue_flush_t *flush;
+	void *priv;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t idle;
+	pthread_cond_t room;
+	TAILQ_HEAD(tx_msg_head, tx_msg) msgs;
+	size_t bytes;
+	struct tx_queue_aggregation aggregation;
+	int busy;
+	int stop;
+	int error;
+
+	struct tx_queue_stats stats;
+};
+
+int tx_queue_init(struct tx_queue *queue, const char *name,
+		  tx_queue_flush_t *flush, void *priv);
+void tx_queue_exit(struct tx_queue *queue);
+int tx_queue_push(struct tx_queue *queue, const void *data, size_t len);
+void tx_queue_drain(struct tx_queue *queue);
+void tx_queue_get_stats(struct tx_queue *queue, struct tx_queue_stats *stats);
+void tx_queue_set_aggregation(struct tx_queue *queue,
+			      const struct tx_queue_aggregation *aggregation);
+int tx_queue_parse_aggregation(const char *str,
+			       struct tx_queue_aggregation *aggregation);
+
+int tx_writev_all(int fd, struct iovec *iov, int count);
+
+#endif /* _TXQUEUE_H_ */